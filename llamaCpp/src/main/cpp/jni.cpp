@@ -2,6 +2,8 @@
 // #include <android/asset_manager.h>
 // #include <android/asset_manager_jni.h>
 #include <android/log.h>
+#include <algorithm>
+#include <chrono>
 #include <cstdlib>
 #include <ctime>
 #include <sys/sysinfo.h>
@@ -183,8 +185,23 @@ static inline void putHashMapHashMap(JNIEnv *env, jobject hashMap, const char *k
     env->CallObjectMethod(hashMap, putMethod, jKey, value);
 }
 
+// Helper method to put a float[] into a Java HashMap
+static inline void putFloatArrayHashMap(JNIEnv *env, jobject hashMap, const char *key, const std::vector<float> &value) {
+    jclass hashMapClass = env->FindClass("java/util/HashMap");
+    jmethodID putMethod = env->GetMethodID(hashMapClass, "put", "(Ljava/lang/Object;Ljava/lang/Object;)Ljava/lang/Object;");
+
+    jstring jKey = env->NewStringUTF(key);
+    jfloatArray jValue = env->NewFloatArray(value.size());
+    env->SetFloatArrayRegion(jValue, 0, value.size(), value.data());
+
+    env->CallObjectMethod(hashMap, putMethod, jKey, jValue);
+}
+
 std::unordered_map<long, rnllama::llama_rn_context *> context_map;
 
+// chunks a streamed completion may queue before the worker waits for the caller to drain them
+static const size_t stream_capacity = 256;
+
 struct CallbackContext {
     JNIEnv * env;
     jobject  thiz;
@@ -198,9 +215,32 @@ Java_org_nehuatl_llamacpp_LlamaContext_initContext(
         jobject thiz,
         jstring model_path_str,
         jboolean embedding,
+        jboolean reranking,
+        jint pooling_type,
         jint n_ctx,
         jint n_batch,
+        jint n_ubatch,
+        jstring cache_type_k_str,
+        jstring cache_type_v_str,
+        jboolean flash_attn,
+        jboolean auto_plan,
+        jint memory_budget_mb,
         jint n_threads,
+        jint n_threads_batch,
+        jint thread_priority,
+        jint thread_priority_batch,
+        jint poll,
+        jint poll_batch,
+        jstring cpu_profile_str,
+        jint n_parallel,
+        jint prefix_cache_mb,
+        jint conversation_cache_mb,
+        jstring conversation_dir_str,
+        jstring model_draft_str,
+        jint n_draft,
+        jint lookup_ngram,
+        jstring lookup_cache_str,
+        jint lookup_cache_mb,
         jint n_gpu_layers, // TODO: Support this
         jboolean use_mlock,
         jboolean use_mmap,
@@ -222,15 +262,54 @@ Java_org_nehuatl_llamacpp_LlamaContext_initContext(
     const char *model_path_chars = env->GetStringUTFChars(model_path_str, nullptr);
     defaultParams.model = model_path_chars;
 
-    defaultParams.embedding = embedding;
+    defaultParams.embedding = embedding || reranking;
+    defaultParams.reranking = reranking;
+    defaultParams.pooling_type = (enum llama_pooling_type) pooling_type;
 
     defaultParams.n_ctx = n_ctx;
     defaultParams.n_batch = n_batch;
+    if (n_ubatch > 0) {
+        defaultParams.n_ubatch = n_ubatch;
+    }
+    // empty cache types are left to the planner, f16 without it
+    const char *cache_type_k_chars = env->GetStringUTFChars(cache_type_k_str, nullptr);
+    const char *cache_type_v_chars = env->GetStringUTFChars(cache_type_v_str, nullptr);
+    defaultParams.cache_type_k = cache_type_k_chars;
+    defaultParams.cache_type_v = cache_type_v_chars;
+    env->ReleaseStringUTFChars(cache_type_k_str, cache_type_k_chars);
+    env->ReleaseStringUTFChars(cache_type_v_str, cache_type_v_chars);
+    defaultParams.flash_attn = flash_attn;
+
+    rnllama::llama_rn_cpu_plan cpu_plan;
+    if (n_threads > 0) {
+        defaultParams.cpuparams.n_threads = n_threads;
+    } else if (!vocab_only) {
+        // separate thread counts and cores for generation and prefill, benchmarked once per device
+        const char *cpu_profile_chars = env->GetStringUTFChars(cpu_profile_str, nullptr);
+        cpu_plan = rnllama::plan_threads("/sys", cpu_profile_chars);
+        env->ReleaseStringUTFChars(cpu_profile_str, cpu_profile_chars);
+        rnllama::apply_cpu_plan(cpu_plan, defaultParams);
+    } else {
+        int max_threads = std::thread::hardware_concurrency();
+        // Use 2 threads by default on 4-core devices, 4 threads on more cores
+        defaultParams.cpuparams.n_threads = max_threads == 4 ? 2 : min(4, max_threads);
+    }
+    if (n_threads_batch > 0) {
+        defaultParams.cpuparams_batch.n_threads = n_threads_batch;
+    } else if (n_threads > 0) {
+        defaultParams.cpuparams_batch.n_threads = n_threads;
+    }
+    // the generation and batch threadpools take these, see createThreadpools
+    defaultParams.cpuparams.priority = (enum lm_ggml_sched_priority) thread_priority;
+    defaultParams.cpuparams_batch.priority = (enum lm_ggml_sched_priority) thread_priority_batch;
+    defaultParams.cpuparams.poll = std::max(0, std::min(100, (int) poll));
+    defaultParams.cpuparams_batch.poll = std::max(0, std::min(100, (int) poll_batch));
+
+    defaultParams.n_parallel = n_parallel > 0 ? n_parallel : 1;
 
-    int max_threads = std::thread::hardware_concurrency();
-    // Use 2 threads by default on 4-core devices, 4 threads on more cores
-    int default_n_threads = max_threads == 4 ? 2 : min(4, max_threads);
-    defaultParams.cpuparams.n_threads = n_threads > 0 ? n_threads : default_n_threads;
+    const char *model_draft_chars = env->GetStringUTFChars(model_draft_str, nullptr);
+    defaultParams.model_draft = model_draft_chars;
+    defaultParams.n_draft = n_draft;
 
     defaultParams.n_gpu_layers = n_gpu_layers;
 
@@ -246,14 +325,34 @@ Java_org_nehuatl_llamacpp_LlamaContext_initContext(
     defaultParams.rope_freq_base = rope_freq_base;
     defaultParams.rope_freq_scale = rope_freq_scale;
 
-
-
-
     auto llama = new rnllama::llama_rn_context();
+    llama->cpu_plan = cpu_plan;
+    if (auto_plan && !vocab_only) {
+        const size_t mb = 1024 * 1024;
+        size_t caches_mb = std::max(0, prefix_cache_mb) + std::max(0, conversation_cache_mb);
+        if (lookup_ngram > 0 && env->GetStringUTFLength(lookup_cache_str) > 0) {
+            caches_mb += std::max(0, lookup_cache_mb);
+        }
+        llama->plan = rnllama::plan_context(defaultParams, memory_budget_mb > 0 ? memory_budget_mb * mb : 0, caches_mb * mb);
+        if (llama->plan.n_ctx > 0) {
+            rnllama::apply_plan(llama->plan, defaultParams);
+        }
+    }
+    if (defaultParams.cache_type_k.empty()) defaultParams.cache_type_k = "f16";
+    if (defaultParams.cache_type_v.empty()) defaultParams.cache_type_v = "f16";
     bool is_model_loaded = llama->loadModel(defaultParams);
 
     LOGI("[RNLlama] is_model_loaded %s", (is_model_loaded ? "true" : "false"));
     if (is_model_loaded) {
+        llama->prefix_cache.n_bytes_max = prefix_cache_mb > 0 ? (size_t) prefix_cache_mb * 1024 * 1024 : 0;
+        llama->conversations.n_bytes_max = conversation_cache_mb > 0 ? (size_t) conversation_cache_mb * 1024 * 1024 : 0;
+        const char *conversation_dir_chars = env->GetStringUTFChars(conversation_dir_str, nullptr);
+        llama->conversations.spill_dir = conversation_dir_chars;
+        env->ReleaseStringUTFChars(conversation_dir_str, conversation_dir_chars);
+        llama->lookup_cache.n_bytes_max = lookup_cache_mb > 0 ? (size_t) lookup_cache_mb * 1024 * 1024 : 0;
+        const char *lookup_cache_chars = env->GetStringUTFChars(lookup_cache_str, nullptr);
+        llama->initLookup(lookup_ngram, lookup_cache_chars);
+        env->ReleaseStringUTFChars(lookup_cache_str, lookup_cache_chars);
         context_map[(long) llama->ctx] = llama;
     } else {
         llama_free(llama->ctx);
@@ -261,6 +360,7 @@ Java_org_nehuatl_llamacpp_LlamaContext_initContext(
 
     env->ReleaseStringUTFChars(model_path_str, model_path_chars);
     env->ReleaseStringUTFChars(lora_str, lora_chars);
+    env->ReleaseStringUTFChars(model_draft_str, model_draft_chars);
 
     return reinterpret_cast<jlong>(llama->ctx);
 }
@@ -293,11 +393,87 @@ Java_org_nehuatl_llamacpp_LlamaContext_loadModelDetails(
     putDoubleHashMap(env, result, "size", llama_model_size(llama->model));
     putDoubleHashMap(env, result, "nParams", llama_model_n_params(llama->model));
     putBooleanHashMap(env, result, "isChatTemplateSupported", llama->validateModelChatTemplate());
+    if (llama->cpu_plan.n_threads > 0) {
+        const auto &cpu_plan = llama->cpu_plan;
+        auto threads = createHashMap(env);
+        putIntHashMap(env, threads, "n_threads", cpu_plan.n_threads);
+        putIntHashMap(env, threads, "n_threads_batch", cpu_plan.n_threads_batch);
+        std::string cores, cores_batch;
+        for (int core : cpu_plan.cores) cores += (cores.empty() ? "" : ",") + std::to_string(core);
+        for (int core : cpu_plan.cores_batch) cores_batch += (cores_batch.empty() ? "" : ",") + std::to_string(core);
+        putStringHashMap(env, threads, "cores", cores.c_str());
+        putStringHashMap(env, threads, "cores_batch", cores_batch.c_str());
+        putBooleanHashMap(env, threads, "measured", cpu_plan.measured);
+        putBooleanHashMap(env, threads, "loaded", cpu_plan.loaded);
+        putHashMapHashMap(env, result, "threads", threads);
+    }
+    if (llama->plan.n_ctx > 0) {
+        const auto &plan = llama->plan;
+        auto plan_map = createHashMap(env);
+        putIntHashMap(env, plan_map, "n_ctx", plan.n_ctx);
+        putIntHashMap(env, plan_map, "n_ubatch", plan.n_ubatch);
+        putStringHashMap(env, plan_map, "type_k", plan.type_k.c_str());
+        putStringHashMap(env, plan_map, "type_v", plan.type_v.c_str());
+        putBooleanHashMap(env, plan_map, "flash_attn", plan.flash_attn);
+        putBooleanHashMap(env, plan_map, "use_mmap", plan.use_mmap);
+        putBooleanHashMap(env, plan_map, "use_mlock", plan.use_mlock);
+        putBooleanHashMap(env, plan_map, "fits", plan.fits);
+        putDoubleHashMap(env, plan_map, "bytes_weights", plan.n_bytes_weights);
+        putDoubleHashMap(env, plan_map, "bytes_kv", plan.n_bytes_kv);
+        putDoubleHashMap(env, plan_map, "bytes_compute", plan.n_bytes_compute);
+        putDoubleHashMap(env, plan_map, "bytes_output", plan.n_bytes_output);
+        putDoubleHashMap(env, plan_map, "bytes_caches", plan.n_bytes_caches);
+        putDoubleHashMap(env, plan_map, "bytes_total", plan.total());
+        putDoubleHashMap(env, plan_map, "bytes_budget", plan.n_bytes_budget);
+        putDoubleHashMap(env, plan_map, "bytes_available", plan.n_bytes_available);
+        putHashMapHashMap(env, result, "plan", plan_map);
+    }
     putHashMapHashMap(env, result, "metadata", meta);
 
     return reinterpret_cast<jobject>(result);
 }
 
+JNIEXPORT jobject JNICALL
+Java_org_nehuatl_llamacpp_LlamaContext_memoryReport(
+        JNIEnv *env,
+        jobject thiz,
+        jlong context_ptr
+) {
+    UNUSED(thiz);
+    auto llama = context_map[(long) context_ptr];
+    const rnllama::llama_rn_memory_report report = llama->memoryReport();
+
+    auto result = createHashMap(env);
+    putDoubleHashMap(env, result, "bytes_model", report.model_bytes);
+    putDoubleHashMap(env, result, "bytes_model_mapped", report.model_mapped);
+    putDoubleHashMap(env, result, "bytes_model_resident", report.model_resident);
+    putIntHashMap(env, result, "model_refs", report.model_refs);
+    putDoubleHashMap(env, result, "bytes_kv", report.context.kv_buffers);
+    putDoubleHashMap(env, result, "bytes_kv_k", report.context.kv_k);
+    putDoubleHashMap(env, result, "bytes_kv_v", report.context.kv_v);
+    putIntHashMap(env, result, "kv_cells_used", report.kv_cells_used);
+    putIntHashMap(env, result, "kv_cells", report.kv_cells);
+    putDoubleHashMap(env, result, "bytes_compute", report.context.compute);
+    putDoubleHashMap(env, result, "bytes_compute_meta", report.context.compute_meta);
+    putDoubleHashMap(env, result, "bytes_output", report.context.output);
+    putDoubleHashMap(env, result, "bytes_logits", report.context.logits);
+    putDoubleHashMap(env, result, "bytes_embeddings", report.context.embd);
+    putDoubleHashMap(env, result, "bytes_context", rnllama::context_memory_total(report.context));
+    putDoubleHashMap(env, result, "bytes_prefix_cache", report.prefix_cache_bytes);
+    putDoubleHashMap(env, result, "bytes_conversations", report.conversation_bytes);
+    putDoubleHashMap(env, result, "bytes_lookup_cache", report.lookup_cache_bytes);
+    putDoubleHashMap(env, result, "bytes_draft_model", report.draft_model_bytes);
+    putDoubleHashMap(env, result, "bytes_draft_model_resident", report.draft_model_resident);
+    putDoubleHashMap(env, result, "bytes_draft_context", report.draft_context_bytes);
+    putDoubleHashMap(env, result, "bytes_rss", report.process.rss);
+    putDoubleHashMap(env, result, "bytes_rss_peak", report.process.rss_peak);
+    putDoubleHashMap(env, result, "bytes_rss_anon", report.process.rss_anon);
+    putDoubleHashMap(env, result, "bytes_rss_file", report.process.rss_file);
+    putDoubleHashMap(env, result, "bytes_swap", report.process.swap);
+    putDoubleHashMap(env, result, "bytes_available", rnllama::available_memory());
+    return reinterpret_cast<jobject>(result);
+}
+
 JNIEXPORT jstring JNICALL
 Java_org_nehuatl_llamacpp_LlamaContext_getFormattedChat(
         JNIEnv *env,
@@ -366,19 +542,24 @@ Java_org_nehuatl_llamacpp_LlamaContext_loadSession(
     const char *path_chars = env->GetStringUTFChars(path, nullptr);
 
     auto result = createHashMap(env);
-    size_t n_token_count_out = 0;
-    llama->embd.resize(llama->params.n_ctx);
-    if (!llama_state_load_file(llama->ctx, path_chars, llama->embd.data(), llama->embd.capacity(), &n_token_count_out)) {
+    if (llama->isPredicting()) {
         env->ReleaseStringUTFChars(path, path_chars);
 
-        putStringHashMap(env, result, "error", "Failed to load session");
+        putStringHashMap(env, result, "error", "Context is busy");
         return reinterpret_cast<jobject>(result);
     }
-    llama->embd.resize(n_token_count_out);
+
+    std::string error;
+    const bool ok = llama->loadSession(path_chars, error);
     env->ReleaseStringUTFChars(path, path_chars);
+    if (!ok) {
+        putStringHashMap(env, result, "error", error.c_str());
+        return reinterpret_cast<jobject>(result);
+    }
 
-    const std::string text = rnllama::tokens_to_str(llama->ctx, llama->embd.cbegin(), llama->embd.cend());
-    putIntHashMap(env, result, "tokens_loaded", n_token_count_out);
+    const auto &embd = llama->slots[0]->embd;
+    const std::string text = rnllama::tokens_to_str(llama->ctx, embd.cbegin(), embd.cend());
+    putIntHashMap(env, result, "tokens_loaded", embd.size());
     putStringHashMap(env, result, "prompt", text.c_str());
     return reinterpret_cast<jobject>(result);
 }
@@ -396,7 +577,9 @@ Java_org_nehuatl_llamacpp_LlamaContext_saveSession(
 
     const char *path_chars = env->GetStringUTFChars(path, nullptr);
 
-    std::vector<llama_token> session_tokens = llama->embd;
+    // no llama_decode may run while the KV cache is written out
+    std::lock_guard<std::mutex> lock(llama->slots_mutex);
+    std::vector<llama_token> session_tokens = llama->slots[0]->embd;
     int default_size = session_tokens.size();
     int save_size = size > 0 && size <= default_size ? size : default_size;
     if (!llama_state_save_file(llama->ctx, path_chars, session_tokens.data(), save_size)) {
@@ -408,22 +591,57 @@ Java_org_nehuatl_llamacpp_LlamaContext_saveSession(
     return session_tokens.size();
 }
 
+JNIEXPORT jobject JNICALL
+Java_org_nehuatl_llamacpp_LlamaContext_checkpointSession(
+        JNIEnv *env,
+        jobject thiz,
+        jlong context_ptr,
+        jstring path,
+        jboolean compress,
+        jboolean quantize_kv
+) {
+    UNUSED(thiz);
+    auto llama = context_map[(long) context_ptr];
+    const char *path_chars = env->GetStringUTFChars(path, nullptr);
+
+    uint32_t flags = 0;
+    if (compress) flags |= rnllama::SESSION_ZLIB;
+    if (quantize_kv) flags |= rnllama::SESSION_Q8_0;
+    rnllama::llama_rn_context::session_checkpoint checkpoint;
+    std::string error;
+    const bool ok = llama->checkpointSession(path_chars, flags, checkpoint, error);
+    env->ReleaseStringUTFChars(path, path_chars);
+
+    auto result = createHashMap(env);
+    if (!ok) {
+        putStringHashMap(env, result, "error", error.c_str());
+        return reinterpret_cast<jobject>(result);
+    }
+    putIntHashMap(env, result, "tokens_saved", checkpoint.n_tokens);
+    putIntHashMap(env, result, "tokens_added", checkpoint.n_added);
+    putDoubleHashMap(env, result, "bytes_written", (double) checkpoint.n_written);
+    putBooleanHashMap(env, result, "rewritten", checkpoint.rewritten);
+    return reinterpret_cast<jobject>(result);
+}
+
 static inline jobject tokenProbsToMap(
         JNIEnv *env,
         rnllama::llama_rn_context *llama,
-        std::vector<rnllama::completion_token_output> probs
+        std::vector<rnllama::completion_token_output>::const_iterator begin,
+        std::vector<rnllama::completion_token_output>::const_iterator end
 ) {
     auto result = createArrayList(env);
-    for (const auto &prob : probs) {
+    for (; begin != end; ++begin) {
+        const auto &prob = *begin;
         auto probsForToken = createArrayList(env);
         for (const auto &p : prob.probs) {
-            std::string tokStr = rnllama::tokens_to_output_formatted_string(llama->ctx, p.tok);
+            std::string tokStr = rnllama::piece_to_output_formatted_string(llama->tokenPiece(p.tok));
             auto probResult = createHashMap(env);
             putStringHashMap(env, probResult, "tok_str", tokStr.c_str());
             putDoubleHashMap(env, probResult, "prob", p.prob);
             addHashMapArrayList(env, probsForToken, probResult);
         }
-        std::string tokStr = rnllama::tokens_to_output_formatted_string(llama->ctx, prob.tok);
+        std::string tokStr = rnllama::piece_to_output_formatted_string(llama->tokenPiece(prob.tok));
         auto tokenResult = createHashMap(env);
         putStringHashMap(env, tokenResult, "content", tokStr.c_str());
         putArrayListHashMap(env, tokenResult, "probs", probsForToken);
@@ -432,8 +650,78 @@ static inline jobject tokenProbsToMap(
     return result;
 }
 
+static inline jobject latencyHistogramToMap(JNIEnv *env, const rnllama::llama_rn_latency_histogram &histogram) {
+    auto result = createHashMap(env);
+    putIntHashMap(env, result, "n", histogram.count());
+    putDoubleHashMap(env, result, "mean_ms", histogram.mean());
+    putDoubleHashMap(env, result, "p50_ms", histogram.percentile(50));
+    putDoubleHashMap(env, result, "p90_ms", histogram.percentile(90));
+    putDoubleHashMap(env, result, "p99_ms", histogram.percentile(99));
+    putDoubleHashMap(env, result, "max_ms", histogram.max());
+    // buckets[i] counts the latencies up to bounds_ms[i], the last one those above
+    auto bounds = createArrayList(env);
+    for (double bound : rnllama::llama_rn_latency_histogram::bounds()) {
+        addDoubleArrayList(env, bounds, bound);
+    }
+    auto buckets = createArrayList(env);
+    for (size_t count : histogram.buckets()) {
+        addIntArrayList(env, buckets, count);
+    }
+    putArrayListHashMap(env, result, "bounds_ms", bounds);
+    putArrayListHashMap(env, result, "buckets", buckets);
+    return result;
+}
+
+static inline jobject completionResultToMap(JNIEnv *env, rnllama::llama_rn_context *llama, const rnllama::llama_rn_slot *slot) {
+    auto result = createHashMap(env);
+    putStringHashMap(env, result, "text", slot->generated_text.c_str());
+    putArrayListHashMap(env, result, "completion_probabilities", tokenProbsToMap(env, llama, slot->generated_token_probs.begin(), slot->generated_token_probs.end()));
+    putIntHashMap(env, result, "slot_id", slot->id);
+    putIntHashMap(env, result, "tokens_predicted", slot->num_tokens_predicted);
+    putIntHashMap(env, result, "tokens_evaluated", slot->num_prompt_tokens);
+    putIntHashMap(env, result, "truncated", slot->truncated);
+    putIntHashMap(env, result, "stopped_eos", slot->stopped_eos);
+    putIntHashMap(env, result, "stopped_word", slot->stopped_word);
+    putIntHashMap(env, result, "stopped_limit", slot->stopped_limit);
+    putStringHashMap(env, result, "stopping_word", slot->stopping_word.c_str());
+    putIntHashMap(env, result, "tokens_cached", slot->n_past);
+    putIntHashMap(env, result, "tokens_restored", slot->n_restored);
+
+    auto timingsResult = createHashMap(env);
+    putIntHashMap(env, timingsResult, "prompt_n", slot->n_prompt_processed);
+    putDoubleHashMap(env, timingsResult, "prompt_ms", slot->t_prompt_processing);
+    putDoubleHashMap(env, timingsResult, "prompt_per_token_ms", slot->n_prompt_processed > 0 ? slot->t_prompt_processing / slot->n_prompt_processed : 0.0);
+    putDoubleHashMap(env, timingsResult, "prompt_per_second", slot->t_prompt_processing > 0 ? 1e3 / slot->t_prompt_processing * slot->n_prompt_processed : 0.0);
+    putIntHashMap(env, timingsResult, "predicted_n", slot->n_decoded);
+    putDoubleHashMap(env, timingsResult, "predicted_ms", slot->t_token_generation);
+    putDoubleHashMap(env, timingsResult, "predicted_per_token_ms", slot->n_decoded > 0 ? slot->t_token_generation / slot->n_decoded : 0.0);
+    putDoubleHashMap(env, timingsResult, "predicted_per_second", slot->t_token_generation > 0 ? 1e3 / slot->t_token_generation * slot->n_decoded : 0.0);
+    putIntHashMap(env, timingsResult, "draft_n", slot->n_drafted);
+    putIntHashMap(env, timingsResult, "draft_accepted_n", slot->n_draft_accepted);
+    putDoubleHashMap(env, timingsResult, "draft_acceptance_rate", slot->n_drafted > 0 ? (double) slot->n_draft_accepted / slot->n_drafted : 0.0);
+    putDoubleHashMap(env, timingsResult, "ttft_ms", slot->t_first_token);
+    putHashMapHashMap(env, timingsResult, "token_latency", latencyHistogramToMap(env, slot->token_latency));
+
+    // time in gpt_sampler_sample by stage: logits, grammar, then the sampler chain in order
+    auto samplingResult = createHashMap(env);
+    double sample_ms = 0.0;
+    if (slot->ctx_sampling != nullptr) {
+        for (const gpt_sampler_stage_time &stage : gpt_sampler_stage_times(slot->ctx_sampling)) {
+            putDoubleHashMap(env, samplingResult, stage.name.c_str(), stage.t_us / 1e3);
+            sample_ms += stage.t_us / 1e3;
+        }
+    }
+    putHashMapHashMap(env, timingsResult, "sampling_ms", samplingResult);
+    putDoubleHashMap(env, timingsResult, "sample_ms", sample_ms);
+    putDoubleHashMap(env, timingsResult, "stop_match_ms", slot->t_stop_match_us / 1e3);
+    putDoubleHashMap(env, timingsResult, "marshal_ms", slot->t_marshal_ms);
+
+    putHashMapHashMap(env, result, "timings", timingsResult);
+    return result;
+}
+
 JNIEXPORT jobject JNICALL
-Java_org_nehuatl_llamacpp_LlamaContext_doCompletion(
+Java_org_nehuatl_llamacpp_LlamaContext_startCompletion(
         JNIEnv *env,
         jobject thiz,
         jlong context_ptr,
@@ -459,30 +747,36 @@ Java_org_nehuatl_llamacpp_LlamaContext_doCompletion(
         jfloat tfs_z,
         jfloat typical_p,
         jint seed,
+        jint n,
+        jstring conversation_id,
         jobjectArray stop,
+        jboolean stop_token_triggers,
         jboolean ignore_eos,
-        jobjectArray logit_bias,
-        jobject partialCompletionCallback // The Java class for callbacks
+        jobjectArray logit_bias
 ) {
     UNUSED(thiz);
     auto llama = context_map[(long) context_ptr];
 
-    llama->rewind();
-
-    //llama_reset_timings(llama->ctx);
+    const char *prompt_chars = env->GetStringUTFChars(prompt, nullptr);
+    rnllama::llama_rn_slot *slot = llama->acquireSlot(prompt_chars);
+    env->ReleaseStringUTFChars(prompt, prompt_chars);
+    if (slot == nullptr) {
+        auto result = createHashMap(env);
+        putStringHashMap(env, result, "error", "Context is busy");
+        return reinterpret_cast<jobject>(result);
+    }
 
-    llama->params.prompt = env->GetStringUTFChars(prompt, nullptr);
-    llama->params.sparams.seed = (seed == -1) ? time(NULL) : seed;
+    slot->params.sparams.seed = (seed == -1) ? time(NULL) : seed;
 
-    int max_threads = std::thread::hardware_concurrency();
-    // Use 2 threads by default on 4-core devices, 4 threads on more cores
-    int default_n_threads = max_threads == 4 ? 2 : min(4, max_threads);
-    llama->params.cpuparams.n_threads = n_threads > 0 ? n_threads : default_n_threads;
+    // the context's threads otherwise, chosen at init
+    if (n_threads > 0) {
+        slot->params.cpuparams.n_threads = n_threads;
+    }
 
-    llama->params.n_predict = n_predict;
-    llama->params.sparams.ignore_eos = ignore_eos;
+    slot->params.n_predict = n_predict;
+    slot->params.sparams.ignore_eos = ignore_eos;
 
-    auto & sparams = llama->params.sparams;
+    auto & sparams = slot->params.sparams;
     sparams.temp = temperature;
     sparams.penalty_last_n = penalty_last_n;
     sparams.penalty_repeat = penalty_repeat;
@@ -529,122 +823,292 @@ Java_org_nehuatl_llamacpp_LlamaContext_doCompletion(
         env->DeleteLocalRef(el);
     }
 
-    llama->params.antiprompt.clear();
+    slot->params.antiprompt.clear();
     int stop_len = env->GetArrayLength(stop);
     for (int i = 0; i < stop_len; i++) {
         jstring stop_str = (jstring) env->GetObjectArrayElement(stop, i);
         const char *stop_chars = env->GetStringUTFChars(stop_str, nullptr);
-        llama->params.antiprompt.push_back(stop_chars);
+        slot->params.antiprompt.push_back(stop_chars);
         env->ReleaseStringUTFChars(stop_str, stop_chars);
     }
+    slot->stop_token_triggers = stop_token_triggers;
 
-    if (!llama->initSampling()) {
+    // n > 1: the other completions fork from the slot once its prompt is decoded
+    if (n > 1 && !llama->acquireForks(*slot, n - 1)) {
+        llama->releaseSlot(*slot);
         auto result = createHashMap(env);
-        putStringHashMap(env, result, "error", "Failed to initialize sampling");
+        putStringHashMap(env, result, "error", "Not enough free slots for n completions, n_parallel must be at least n");
         return reinterpret_cast<jobject>(result);
     }
-    llama->beginCompletion();
-    llama->loadPrompt();
+    std::vector<rnllama::llama_rn_slot *> completion_slots(1, slot);
+    completion_slots.insert(completion_slots.end(), slot->forks.begin(), slot->forks.end());
+
+    for (auto *s : completion_slots) {
+        if (!llama->initSampling(*s)) {
+            for (auto *r : completion_slots) {
+                llama->releaseSlot(*r);
+            }
+            auto result = createHashMap(env);
+            putStringHashMap(env, result, "error", "Failed to initialize sampling");
+            return reinterpret_cast<jobject>(result);
+        }
+        llama->beginCompletion(*s);
+    }
+    // set once the request can no longer fail: releasing the slot snapshots it into
+    // the conversation, which would replace the conversation's KV with the slot's
+    const char *conversation_id_chars = env->GetStringUTFChars(conversation_id, nullptr);
+    slot->conversation_id = conversation_id_chars;
+    env->ReleaseStringUTFChars(conversation_id, conversation_id_chars);
+    llama->loadPrompt(*slot);
+    // decoded by the context's worker thread, the caller drains the text with drainCompletion
+    llama->startStream(*slot, stream_capacity);
 
-    size_t sent_count = 0;
-    size_t sent_token_probs_index = 0;
+    auto result = createHashMap(env);
+    putIntHashMap(env, result, "slot_id", slot->id);
+    return reinterpret_cast<jobject>(result);
+}
 
-    while (llama->has_next_token && !llama->is_interrupted) {
-        const rnllama::completion_token_output token_with_probs = llama->doCompletion();
-        if (token_with_probs.tok == -1 || llama->incomplete) {
+JNIEXPORT jobject JNICALL
+Java_org_nehuatl_llamacpp_LlamaContext_drainCompletion(
+        JNIEnv *env,
+        jobject thiz,
+        jlong context_ptr,
+        jint slot_id,
+        jint flush_tokens,
+        jint flush_ms
+) {
+    UNUSED(thiz);
+    auto llama = context_map[(long) context_ptr];
+
+    auto result = createHashMap(env);
+    rnllama::llama_rn_slot *slot = slot_id >= 0 && slot_id < (jint) llama->slots.size() ? llama->slots[slot_id].get() : nullptr;
+    if (slot == nullptr || !slot->stream) {
+        putStringHashMap(env, result, "error", "No completion in progress");
+        return reinterpret_cast<jobject>(result);
+    }
+    rnllama::llama_rn_stream &stream = *slot->stream;
+
+    // flush once flush_tokens chunks are queued or after flush_ms, whichever comes first;
+    // waiting for at most half the queue keeps the worker from stalling on a full queue
+    const size_t n_flush = std::min((size_t) std::max(1, (int) flush_tokens), stream.queue.capacity() / 2);
+    stream.queue.wait(n_flush, std::chrono::steady_clock::now() + std::chrono::milliseconds(std::max(0, (int) flush_ms)));
+    // closed before popping: nothing is pushed after the last pop
+    const bool is_done = stream.queue.isClosed();
+    const int64_t t_marshal_start = llama_time_us();
+
+    // chunks of the same completion are sent as one
+    std::vector<rnllama::completion_stream_event> chunks(stream.slots.size());
+    std::vector<bool> has_chunk(stream.slots.size(), false);
+    rnllama::completion_stream_event event;
+    bool has_progress = false;
+    rnllama::completion_stream_event progress;
+    while (stream.queue.pop(event)) {
+        if (event.index < 0) {
+            progress = std::move(event);
+            has_progress = true;
             continue;
         }
-        const std::string token_text = llama_token_to_piece(llama->ctx, token_with_probs.tok);
-
-        size_t pos = std::min(sent_count, llama->generated_text.size());
-
-        const std::string str_test = llama->generated_text.substr(pos);
-        bool is_stop_full = false;
-        size_t stop_pos =
-                llama->findStoppingStrings(str_test, token_text.size(), rnllama::STOP_FULL);
-        if (stop_pos != std::string::npos) {
-            is_stop_full = true;
-            llama->generated_text.erase(
-                    llama->generated_text.begin() + pos + stop_pos,
-                    llama->generated_text.end());
-            pos = std::min(sent_count, llama->generated_text.size());
-        } else {
-            is_stop_full = false;
-            stop_pos = llama->findStoppingStrings(str_test, token_text.size(),
-                                                  rnllama::STOP_PARTIAL);
+        rnllama::completion_stream_event &chunk = chunks[event.index];
+        has_chunk[event.index] = true;
+        chunk.text += event.text;
+        chunk.probs.insert(chunk.probs.end(), event.probs.begin(), event.probs.end());
+    }
+    if (stream.is_throttled) {
+        llama->worker.wake();
+    }
+
+    if (has_progress) {
+        auto progressResult = createHashMap(env);
+        putIntHashMap(env, progressResult, "prompt_n", progress.prompt_n);
+        putIntHashMap(env, progressResult, "prompt_total", progress.prompt_total);
+        putDoubleHashMap(env, progressResult, "prompt_ms", progress.prompt_ms);
+        putDoubleHashMap(env, progressResult, "prompt_per_second", progress.prompt_ms > 0 ? 1e3 / progress.prompt_ms * progress.prompt_n : 0.0);
+        putHashMapHashMap(env, result, "prompt_progress", progressResult);
+    }
+    auto tokens = createArrayList(env);
+    for (size_t index = 0; index < chunks.size(); index++) {
+        if (!has_chunk[index]) {
+            continue;
+        }
+        auto tokenResult = createHashMap(env);
+        putStringHashMap(env, tokenResult, "token", chunks[index].text.c_str());
+        putIntHashMap(env, tokenResult, "slot_id", stream.slots[index]->id);
+        putIntHashMap(env, tokenResult, "index", index);
+        if (stream.slots[index]->params.sparams.n_probs > 0) {
+            putArrayListHashMap(env, tokenResult, "completion_probabilities",
+                tokenProbsToMap(env, llama, chunks[index].probs.cbegin(), chunks[index].probs.cend()));
         }
+        addHashMapArrayList(env, tokens, tokenResult);
+    }
+    putArrayListHashMap(env, result, "tokens", tokens);
+    // the conversion of the final result itself is not counted
+    slot->t_marshal_ms += (llama_time_us() - t_marshal_start) / 1e3;
+
+    if (is_done) {
+        const std::vector<rnllama::llama_rn_slot *> completion_slots = stream.slots;
+        // the first completion at the top level, all of them in "completions" when n > 1
+        auto completionResult = completionResultToMap(env, llama, slot);
+        if (completion_slots.size() > 1) {
+            auto completions = createArrayList(env);
+            for (size_t index = 0; index < completion_slots.size(); index++) {
+                auto completion = completionResultToMap(env, llama, completion_slots[index]);
+                putIntHashMap(env, completion, "index", index);
+                addHashMapArrayList(env, completions, completion);
+            }
+            putArrayListHashMap(env, completionResult, "completions", completions);
+        }
+        putHashMapHashMap(env, result, "result", completionResult);
 
-        if (
-                stop_pos == std::string::npos ||
-                // Send rest of the text if we are at the end of the generation
-                (!llama->has_next_token && !is_stop_full && stop_pos > 0)
-                ) {
-            const std::string to_send = llama->generated_text.substr(pos, std::string::npos);
+        slot->stream.reset();
+        for (auto *s : completion_slots) {
+            llama->releaseSlot(*s);
+        }
+    }
+    return reinterpret_cast<jobject>(result);
+}
 
-            sent_count += to_send.size();
+JNIEXPORT jboolean JNICALL
+Java_org_nehuatl_llamacpp_LlamaContext_cancelCompletion(
+        JNIEnv *env,
+        jobject thiz,
+        jlong context_ptr,
+        jint slot_id
+) {
+    UNUSED(env);
+    UNUSED(thiz);
+    auto llama = context_map[(long) context_ptr];
 
-            std::vector<rnllama::completion_token_output> probs_output = {};
+    // a stream its owner stopped draining, its slots would otherwise stay busy
+    rnllama::llama_rn_slot *slot = slot_id >= 0 && slot_id < (jint) llama->slots.size() ? llama->slots[slot_id].get() : nullptr;
+    if (slot == nullptr || !slot->stream) {
+        return false;
+    }
+    llama->cancelStream(*slot);
+    return true;
+}
 
-            auto tokenResult = createHashMap(env);
-            putStringHashMap(env, tokenResult, "token", to_send.c_str());
+JNIEXPORT jobject JNICALL
+Java_org_nehuatl_llamacpp_LlamaContext_beamSearch(
+        JNIEnv *env,
+        jobject thiz,
+        jlong context_ptr,
+        jstring prompt,
+        jint n_beams,
+        jint n_predict,
+        jfloat length_penalty,
+        jboolean early_stopping,
+        jobjectArray stop
+) {
+    UNUSED(thiz);
+    auto llama = context_map[(long) context_ptr];
 
-            if (llama->params.sparams.n_probs > 0) {
-                const std::vector<llama_token> to_send_toks = llama_tokenize(llama->ctx, to_send, false);
-                size_t probs_pos = std::min(sent_token_probs_index, llama->generated_token_probs.size());
-                size_t probs_stop_pos = std::min(sent_token_probs_index + to_send_toks.size(), llama->generated_token_probs.size());
-                if (probs_pos < probs_stop_pos) {
-                    probs_output = std::vector<rnllama::completion_token_output>(llama->generated_token_probs.begin() + probs_pos, llama->generated_token_probs.begin() + probs_stop_pos);
-                }
-                sent_token_probs_index = probs_stop_pos;
+    const char *prompt_chars = env->GetStringUTFChars(prompt, nullptr);
+    rnllama::llama_rn_slot *slot = llama->acquireSlot(prompt_chars);
+    env->ReleaseStringUTFChars(prompt, prompt_chars);
+    auto result = createHashMap(env);
+    if (slot == nullptr) {
+        putStringHashMap(env, result, "error", "Context is busy");
+        return reinterpret_cast<jobject>(result);
+    }
+    // one sequence per beam: the slot's and those of n_beams - 1 forks
+    if (n_beams > 1 && !llama->acquireForks(*slot, n_beams - 1)) {
+        llama->releaseSlot(*slot);
+        putStringHashMap(env, result, "error", "Not enough free slots for the beams, n_parallel must be at least n_beams");
+        return reinterpret_cast<jobject>(result);
+    }
 
-                putArrayListHashMap(env, tokenResult, "completion_probabilities", tokenProbsToMap(env, llama, probs_output));
-            }
+    slot->params.n_predict = n_predict;
+    slot->beam_search.reset(new rnllama::llama_rn_beam_search());
+    rnllama::llama_rn_beam_params &beam_params = slot->beam_search->params;
+    beam_params.n_beams = std::max(1, (int) n_beams);
+    beam_params.n_predict = n_predict > 0 ? n_predict : slot->n_ctx;
+    beam_params.length_penalty = length_penalty;
+    beam_params.early_stopping = early_stopping;
+    int stop_len = env->GetArrayLength(stop);
+    for (int i = 0; i < stop_len; i++) {
+        jstring stop_str = (jstring) env->GetObjectArrayElement(stop, i);
+        const char *stop_chars = env->GetStringUTFChars(stop_str, nullptr);
+        beam_params.stop.push_back(stop_chars);
+        env->ReleaseStringUTFChars(stop_str, stop_chars);
+    }
 
-            jclass cb_class = env->GetObjectClass(partialCompletionCallback); // Get class of callback object
-            jmethodID onPartialCompletion = env->GetMethodID(cb_class, "onPartialCompletion", "(Ljava/util/Map;)V"); // Find method ID
-            env->CallVoidMethod(partialCompletionCallback, onPartialCompletion, tokenResult); // Call method
+    std::vector<rnllama::llama_rn_slot *> beam_slots(1, slot);
+    beam_slots.insert(beam_slots.end(), slot->forks.begin(), slot->forks.end());
+    if (!llama->initSampling(*slot)) {
+        for (auto *s : beam_slots) {
+            llama->releaseSlot(*s);
         }
+        putStringHashMap(env, result, "error", "Failed to initialize sampling");
+        return reinterpret_cast<jobject>(result);
+    }
+    llama->beginCompletion(*slot);
+    llama->loadPrompt(*slot);
+    while (slot->has_next_token && !slot->is_interrupted) {
+        llama->doCompletion(*slot);
     }
+    const std::vector<rnllama::llama_rn_beam> beams = llama->beamSearch(*slot);
 
-    llama_perf_context_print(llama->ctx);
-    llama->is_predicting = false;
+    if (beams.empty()) {
+        putStringHashMap(env, result, "error", slot->is_interrupted ? "Beam search interrupted" : "Beam search failed");
+    } else {
+        auto beamsResult = createArrayList(env);
+        for (const auto &beam : beams) {
+            auto item = createHashMap(env);
+            putStringHashMap(env, item, "text", beam.text.c_str());
+            putDoubleHashMap(env, item, "score", beam.score);
+            putDoubleHashMap(env, item, "logprob", beam.logprob);
+            putIntHashMap(env, item, "tokens_predicted", beam.tokens.size());
+            addHashMapArrayList(env, beamsResult, item);
+        }
+        putStringHashMap(env, result, "text", beams[0].text.c_str());
+        putArrayListHashMap(env, result, "beams", beamsResult);
+        putIntHashMap(env, result, "tokens_predicted", beams[0].tokens.size());
+        putIntHashMap(env, result, "tokens_evaluated", slot->num_prompt_tokens);
+        putBooleanHashMap(env, result, "interrupted", slot->is_interrupted);
+
+        auto timingsResult = createHashMap(env);
+        putIntHashMap(env, timingsResult, "prompt_n", slot->n_prompt_processed);
+        putDoubleHashMap(env, timingsResult, "prompt_ms", slot->t_prompt_processing);
+        putIntHashMap(env, timingsResult, "steps", slot->n_decoded);
+        putDoubleHashMap(env, timingsResult, "predicted_ms", slot->t_token_generation);
+        putHashMapHashMap(env, result, "timings", timingsResult);
+    }
 
-    auto result = createHashMap(env);
-    putStringHashMap(env, result, "text", llama->generated_text.c_str());
-    putArrayListHashMap(env, result, "completion_probabilities", tokenProbsToMap(env, llama, llama->generated_token_probs));
-    putIntHashMap(env, result, "tokens_predicted", llama->num_tokens_predicted);
-    putIntHashMap(env, result, "tokens_evaluated", llama->num_prompt_tokens);
-    putIntHashMap(env, result, "truncated", llama->truncated);
-    putIntHashMap(env, result, "stopped_eos", llama->stopped_eos);
-    putIntHashMap(env, result, "stopped_word", llama->stopped_word);
-    putIntHashMap(env, result, "stopped_limit", llama->stopped_limit);
-    putStringHashMap(env, result, "stopping_word", llama->stopping_word.c_str());
-    putIntHashMap(env, result, "tokens_cached", llama->n_past);
-
-    const auto timings_token = llama_perf_context(llama -> ctx);
+    for (auto *s : beam_slots) {
+        llama->releaseSlot(*s);
+    }
+    return reinterpret_cast<jobject>(result);
+}
 
-    auto timingsResult = createHashMap(env);
-    putIntHashMap(env, timingsResult, "prompt_n", timings_token.n_p_eval);
-    putIntHashMap(env, timingsResult, "prompt_ms", timings_token.t_p_eval_ms);
-    putIntHashMap(env, timingsResult, "prompt_per_token_ms", timings_token.t_p_eval_ms / timings_token.n_p_eval);
-    putDoubleHashMap(env, timingsResult, "prompt_per_second", 1e3 / timings_token.t_p_eval_ms * timings_token.n_p_eval);
-    putIntHashMap(env, timingsResult, "predicted_n", timings_token.n_eval);
-    putIntHashMap(env, timingsResult, "predicted_ms", timings_token.t_eval_ms);
-    putIntHashMap(env, timingsResult, "predicted_per_token_ms", timings_token.t_eval_ms / timings_token.n_eval);
-    putDoubleHashMap(env, timingsResult, "predicted_per_second", 1e3 / timings_token.t_eval_ms * timings_token.n_eval);
+JNIEXPORT jboolean JNICALL
+Java_org_nehuatl_llamacpp_LlamaContext_removeConversation(
+        JNIEnv *env, jobject thiz, jlong context_ptr, jstring conversation_id) {
+    UNUSED(thiz);
+    auto llama = context_map[(long) context_ptr];
 
-    putHashMapHashMap(env, result, "timings", timingsResult);
+    const char *conversation_id_chars = env->GetStringUTFChars(conversation_id, nullptr);
+    const bool removed = llama->conversations.remove(conversation_id_chars);
+    env->ReleaseStringUTFChars(conversation_id, conversation_id_chars);
+    return removed;
+}
 
-    return reinterpret_cast<jobject>(result);
+JNIEXPORT jboolean JNICALL
+Java_org_nehuatl_llamacpp_LlamaContext_stopCompletion(
+        JNIEnv *env, jobject thiz, jlong context_ptr, jint slot_id) {
+    UNUSED(env);
+    UNUSED(thiz);
+    auto llama = context_map[(long) context_ptr];
+    // only the request started on slot_id, the context may be serving others
+    return llama->interruptSlot(slot_id);
 }
 
 JNIEXPORT void JNICALL
-Java_org_nehuatl_llamacpp_LlamaContext_stopCompletion(
+Java_org_nehuatl_llamacpp_LlamaContext_stopAll(
         JNIEnv *env, jobject thiz, jlong context_ptr) {
     UNUSED(env);
     UNUSED(thiz);
     auto llama = context_map[(long) context_ptr];
-    llama->is_interrupted = true;
+    llama->interrupt();
 }
 
 JNIEXPORT jboolean JNICALL
@@ -653,7 +1117,7 @@ Java_org_nehuatl_llamacpp_LlamaContext_isPredicting(
     UNUSED(env);
     UNUSED(thiz);
     auto llama = context_map[(long) context_ptr];
-    return llama->is_predicting;
+    return llama->isPredicting();
 }
 
 JNIEXPORT jobject JNICALL
@@ -716,25 +1180,29 @@ Java_org_nehuatl_llamacpp_LlamaContext_embedding(
 
     const char *text_chars = env->GetStringUTFChars(text, nullptr);
 
-    llama->rewind();
-
-    llama_perf_context_reset(llama->ctx);
-
-    llama->params.prompt = text_chars;
+    auto result = createHashMap(env);
+    rnllama::llama_rn_slot *slot = llama->acquireSlot(text_chars);
+    if (slot == nullptr) {
+        env->ReleaseStringUTFChars(text, text_chars);
+        putStringHashMap(env, result, "error", "Context is busy");
+        return reinterpret_cast<jobject>(result);
+    }
 
-    llama->params.n_predict = 0;
+    slot->params.n_predict = 0;
 
-    auto result = createHashMap(env);
-    if (!llama->initSampling()) {
+    if (!llama->initSampling(*slot)) {
+        llama->releaseSlot(*slot);
+        env->ReleaseStringUTFChars(text, text_chars);
         putStringHashMap(env, result, "error", "Failed to initialize sampling");
         return reinterpret_cast<jobject>(result);
     }
 
-    llama->beginCompletion();
-    llama->loadPrompt();
-    llama->doCompletion();
+    llama->beginCompletion(*slot);
+    llama->loadPrompt(*slot);
+    llama->doCompletion(*slot);
 
-    std::vector<float> embedding = llama->getEmbedding();
+    std::vector<float> embedding = llama->getEmbedding(*slot);
+    llama->releaseSlot(*slot);
 
     auto embeddings = createArrayList(env);
     for (const auto &val : embedding) {
@@ -746,6 +1214,155 @@ Java_org_nehuatl_llamacpp_LlamaContext_embedding(
     return result;
 }
 
+JNIEXPORT jobject JNICALL
+Java_org_nehuatl_llamacpp_LlamaContext_embedBatch(
+        JNIEnv *env, jobject thiz, jlong context_ptr, jobjectArray texts) {
+    UNUSED(thiz);
+    auto llama = context_map[(long) context_ptr];
+
+    std::vector<std::string> texts_vector;
+    const jsize n_texts = env->GetArrayLength(texts);
+    texts_vector.reserve(n_texts);
+    for (jsize i = 0; i < n_texts; i++) {
+        jstring text = (jstring) env->GetObjectArrayElement(texts, i);
+        const char *text_chars = env->GetStringUTFChars(text, nullptr);
+        texts_vector.push_back(text_chars);
+        env->ReleaseStringUTFChars(text, text_chars);
+        env->DeleteLocalRef(text);
+    }
+
+    auto result = createHashMap(env);
+    if (llama->isPredicting()) {
+        putStringHashMap(env, result, "error", "Context is busy");
+        return reinterpret_cast<jobject>(result);
+    }
+    const std::vector<float> embeddings = llama->embedBatch(texts_vector);
+    if (embeddings.empty() && n_texts > 0) {
+        putStringHashMap(env, result, "error", llama->is_interrupted ? "Embedding interrupted" : "Failed to embed texts");
+        return reinterpret_cast<jobject>(result);
+    }
+    putFloatArrayHashMap(env, result, "embeddings", embeddings);
+    putIntHashMap(env, result, "n_embd", llama_n_embd(llama->model));
+    putIntHashMap(env, result, "n_texts", n_texts);
+    return result;
+}
+
+// Java strings index UTF-16 code units, GetStringUTFChars gives modified UTF-8 where
+// a supplementary character is a surrogate pair of 3-byte sequences
+static std::vector<int> utf8ToUtf16Offsets(const std::string &text) {
+    std::vector<int> offsets(text.size() + 1);
+    int n = 0;
+    for (size_t i = 0; i < text.size(); i++) {
+        offsets[i] = n;
+        const unsigned char c = text[i];
+        if ((c & 0xC0) != 0x80) {
+            n += (c & 0xF8) == 0xF0 ? 2 : 1;
+        }
+    }
+    offsets[text.size()] = n;
+    return offsets;
+}
+
+JNIEXPORT jobject JNICALL
+Java_org_nehuatl_llamacpp_LlamaContext_embedDocument(
+        JNIEnv *env, jobject thiz, jlong context_ptr, jstring text, jint n_chunk, jint n_overlap, jboolean late_chunking) {
+    UNUSED(thiz);
+    auto llama = context_map[(long) context_ptr];
+
+    const char *text_chars = env->GetStringUTFChars(text, nullptr);
+    const std::string text_string = text_chars;
+    env->ReleaseStringUTFChars(text, text_chars);
+
+    auto result = createHashMap(env);
+    if (late_chunking && llama_pooling_type(llama->ctx) != LLAMA_POOLING_TYPE_NONE) {
+        putStringHashMap(env, result, "error", "Late chunking needs a context created with pooling_type 0 (none)");
+        return reinterpret_cast<jobject>(result);
+    }
+    if (llama->isPredicting()) {
+        putStringHashMap(env, result, "error", "Context is busy");
+        return reinterpret_cast<jobject>(result);
+    }
+    std::vector<rnllama::document_chunk> chunks;
+    std::vector<float> embeddings;
+    if (!llama->embedDocument(text_string, n_chunk, n_overlap, late_chunking, chunks, embeddings)) {
+        putStringHashMap(env, result, "error", llama->is_interrupted ? "Embedding interrupted" : "Failed to embed document");
+        return reinterpret_cast<jobject>(result);
+    }
+
+    const std::vector<int> offsets = utf8ToUtf16Offsets(text_string);
+    auto chunksResult = createArrayList(env);
+    for (const auto &chunk : chunks) {
+        auto item = createHashMap(env);
+        putIntHashMap(env, item, "start", offsets[chunk.text_start]);
+        putIntHashMap(env, item, "end", offsets[chunk.text_end]);
+        putIntHashMap(env, item, "token_start", chunk.token_start);
+        putIntHashMap(env, item, "token_end", chunk.token_end);
+        addHashMapArrayList(env, chunksResult, item);
+    }
+    putArrayListHashMap(env, result, "chunks", chunksResult);
+    putFloatArrayHashMap(env, result, "embeddings", embeddings);
+    putIntHashMap(env, result, "n_embd", llama_n_embd(llama->model));
+    return result;
+}
+
+JNIEXPORT jboolean JNICALL
+Java_org_nehuatl_llamacpp_LlamaContext_isRerankingEnabled(
+        JNIEnv *env, jobject thiz, jlong context_ptr) {
+    UNUSED(env);
+    UNUSED(thiz);
+    auto llama = context_map[(long) context_ptr];
+    return llama->params.reranking;
+}
+
+JNIEXPORT jobject JNICALL
+Java_org_nehuatl_llamacpp_LlamaContext_rerank(
+        JNIEnv *env, jobject thiz, jlong context_ptr, jstring query, jobjectArray documents) {
+    UNUSED(thiz);
+    auto llama = context_map[(long) context_ptr];
+
+    const char *query_chars = env->GetStringUTFChars(query, nullptr);
+    const std::string query_string = query_chars;
+    env->ReleaseStringUTFChars(query, query_chars);
+
+    std::vector<std::string> documents_vector;
+    const jsize n_documents = env->GetArrayLength(documents);
+    documents_vector.reserve(n_documents);
+    for (jsize i = 0; i < n_documents; i++) {
+        jstring document = (jstring) env->GetObjectArrayElement(documents, i);
+        const char *document_chars = env->GetStringUTFChars(document, nullptr);
+        documents_vector.push_back(document_chars);
+        env->ReleaseStringUTFChars(document, document_chars);
+        env->DeleteLocalRef(document);
+    }
+
+    auto result = createHashMap(env);
+    if (llama->isPredicting()) {
+        putStringHashMap(env, result, "error", "Context is busy");
+        return reinterpret_cast<jobject>(result);
+    }
+    const std::vector<float> scores = llama->rerank(query_string, documents_vector);
+    if (scores.empty() && n_documents > 0) {
+        putStringHashMap(env, result, "error", llama->is_interrupted ? "Reranking interrupted" : "Failed to rerank documents");
+        return reinterpret_cast<jobject>(result);
+    }
+
+    std::vector<int> order(scores.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&scores](int a, int b) { return scores[a] > scores[b]; });
+
+    auto results = createArrayList(env);
+    for (int i : order) {
+        auto item = createHashMap(env);
+        putIntHashMap(env, item, "index", i);
+        putDoubleHashMap(env, item, "score", scores[i]);
+        addHashMapArrayList(env, results, item);
+    }
+    putArrayListHashMap(env, result, "results", results);
+    return result;
+}
+
 JNIEXPORT jstring JNICALL
 Java_org_nehuatl_llamacpp_LlamaContext_bench(
         JNIEnv *env,
@@ -762,23 +1379,134 @@ Java_org_nehuatl_llamacpp_LlamaContext_bench(
     return env->NewStringUTF(result.c_str());
 }
 
+static std::vector<int> intArrayToVector(JNIEnv *env, jintArray array) {
+    std::vector<int> values;
+    if (array == nullptr) {
+        return values;
+    }
+    values.resize(env->GetArrayLength(array));
+    env->GetIntArrayRegion(array, 0, values.size(), values.data());
+    return values;
+}
+
+JNIEXPORT jstring JNICALL
+Java_org_nehuatl_llamacpp_LlamaContext_benchSuite(
+        JNIEnv *env,
+        jobject thiz,
+        jlong context_ptr,
+        jstring prompt,
+        jint n_prompt,
+        jint n_gen,
+        jint n_reps,
+        jboolean cold,
+        jintArray n_threads,
+        jintArray n_batch,
+        jintArray n_ubatch,
+        jintArray n_parallel
+) {
+    UNUSED(thiz);
+    auto llama = context_map[(long) context_ptr];
+
+    rnllama::llama_rn_bench_params bench_params;
+    const char *prompt_chars = env->GetStringUTFChars(prompt, nullptr);
+    bench_params.prompt = prompt_chars;
+    env->ReleaseStringUTFChars(prompt, prompt_chars);
+    bench_params.n_prompt = n_prompt;
+    bench_params.n_gen = n_gen;
+    bench_params.n_reps = n_reps;
+    bench_params.cold = cold;
+    bench_params.n_threads = intArrayToVector(env, n_threads);
+    bench_params.n_batch = intArrayToVector(env, n_batch);
+    bench_params.n_ubatch = intArrayToVector(env, n_ubatch);
+    bench_params.n_parallel = intArrayToVector(env, n_parallel);
+
+    std::string result = llama->benchSuite(bench_params).dump();
+    return env->NewStringUTF(result.c_str());
+}
+
 JNIEXPORT void JNICALL
-Java_org_nehuatl_llamacpp_LlamaContext_freeContext(
-        JNIEnv *env, jobject thiz, jlong context_ptr) {
+Java_org_nehuatl_llamacpp_LlamaContext_startProfiler(
+        JNIEnv *env,
+        jobject thiz,
+        jlong context_ptr,
+        jboolean counters,
+        jint max_trace_events
+) {
     UNUSED(env);
     UNUSED(thiz);
     auto llama = context_map[(long) context_ptr];
-    if (llama->model) {
-        llama_free_model(llama->model);
+    llama->startProfiler(counters, std::max(0, (int) max_trace_events));
+}
+
+static inline jobject profileStatsToList(JNIEnv *env, const char *key_name, const std::vector<std::pair<std::string, rnllama::llama_rn_profile_stat>> &rows, bool has_counters) {
+    auto result = createArrayList(env);
+    for (const auto &row : rows) {
+        auto item = createHashMap(env);
+        putStringHashMap(env, item, key_name, row.first.c_str());
+        putDoubleHashMap(env, item, "count", (double) row.second.count);
+        putDoubleHashMap(env, item, "wall_ms", row.second.wall_us / 1e3);
+        putDoubleHashMap(env, item, "busy_ms", row.second.busy_us / 1e3);
+        if (has_counters) {
+            putDoubleHashMap(env, item, "cycles", (double) row.second.cycles);
+            putDoubleHashMap(env, item, "cache_misses", (double) row.second.cache_misses);
+        }
+        addHashMapArrayList(env, result, item);
     }
-    if (llama->ctx) {
-        llama_free(llama->ctx);
+    return result;
+}
+
+JNIEXPORT jobject JNICALL
+Java_org_nehuatl_llamacpp_LlamaContext_stopProfiler(
+        JNIEnv *env,
+        jobject thiz,
+        jlong context_ptr,
+        jstring trace_path
+) {
+    UNUSED(thiz);
+    auto llama = context_map[(long) context_ptr];
+    auto result = createHashMap(env);
+    const std::unique_ptr<rnllama::llama_rn_profiler> stopped = llama->stopProfiler();
+    if (!stopped) {
+        putStringHashMap(env, result, "error", "Profiler is not running");
+        return reinterpret_cast<jobject>(result);
     }
-    if (llama->ctx_sampling != nullptr)
-    {
-        gpt_sampler_free(llama->ctx_sampling);
+    rnllama::llama_rn_profiler &profiler = *stopped;
+
+    const char *trace_path_chars = env->GetStringUTFChars(trace_path, nullptr);
+    const std::string path = trace_path_chars;
+    env->ReleaseStringUTFChars(trace_path, trace_path_chars);
+    std::string error;
+    if (!path.empty() && !profiler.writeTrace(path, error)) {
+        putStringHashMap(env, result, "error", error.c_str());
+        return reinterpret_cast<jobject>(result);
+    }
+
+    putStringHashMap(env, result, "table", profiler.table().c_str());
+    putIntHashMap(env, result, "n_graphs", profiler.n_graphs);
+    putDoubleHashMap(env, result, "wall_ms", profiler.total_wall_us / 1e3);
+    putBooleanHashMap(env, result, "counters", profiler.has_counters);
+    putIntHashMap(env, result, "trace_events", profiler.trace.size());
+    putIntHashMap(env, result, "trace_events_dropped", profiler.n_dropped);
+
+    putArrayListHashMap(env, result, "ops", profileStatsToList(env, "op", rnllama::llama_rn_profiler::sorted(profiler.by_op), profiler.has_counters));
+    putArrayListHashMap(env, result, "tensors", profileStatsToList(env, "name", rnllama::llama_rn_profiler::sorted(profiler.by_name), profiler.has_counters));
+    std::vector<std::pair<std::string, rnllama::llama_rn_profile_stat>> layers;
+    for (const auto &row : profiler.by_layer) {
+        layers.push_back(std::make_pair(std::to_string(row.first), row.second));
     }
+    putArrayListHashMap(env, result, "layers", profileStatsToList(env, "layer", layers, profiler.has_counters));
+    return reinterpret_cast<jobject>(result);
+}
+
+JNIEXPORT void JNICALL
+Java_org_nehuatl_llamacpp_LlamaContext_freeContext(
+        JNIEnv *env, jobject thiz, jlong context_ptr) {
+    UNUSED(env);
+    UNUSED(thiz);
+    auto llama = context_map[(long) context_ptr];
     context_map.erase((long) llama->ctx);
+    llama->saveLookupCache();
+    delete llama;
 }
 
 } // extern "C"
\ No newline at end of file
@@ -844,6 +844,19 @@ struct llama_init_result llama_init_from_gpt_params(gpt_params & params) {
         return iparams;
     }
 
+    iparams = llama_init_from_model(model, params);
+    if (iparams.context == NULL) {
+        llama_free_model(model);
+    }
+
+    return iparams;
+}
+
+// Same as llama_init_from_gpt_params with a model that is already loaded: the model is
+// not freed on failure, it stays with the caller
+struct llama_init_result llama_init_from_model(llama_model * model, gpt_params & params) {
+    llama_init_result iparams;
+
     if (params.reranking) {
         bool ok = true;
 
@@ -863,8 +876,6 @@ struct llama_init_result llama_init_from_gpt_params(gpt_params & params) {
         }
 
         if (!ok) {
-            llama_free_model(model);
-
             return iparams;
         }
     }
@@ -874,7 +885,6 @@ struct llama_init_result llama_init_from_gpt_params(gpt_params & params) {
     llama_context * lctx = llama_new_context_with_model(model, cparams);
     if (lctx == NULL) {
         LOG_ERR("%s: failed to create context with model '%s'\n", __func__, params.model.c_str());
-        llama_free_model(model);
         return iparams;
     }
 
@@ -885,8 +895,6 @@ struct llama_init_result llama_init_from_gpt_params(gpt_params & params) {
         const auto cvec = llama_control_vector_load(params.control_vectors);
         if (cvec.n_embd == -1) {
             llama_free(lctx);
-            llama_free_model(model);
-
             return iparams;
         }
 
@@ -898,8 +906,6 @@ struct llama_init_result llama_init_from_gpt_params(gpt_params & params) {
                                              params.control_vector_layer_end);
         if (err) {
             llama_free(lctx);
-            llama_free_model(model);
-
             return iparams;
         }
     }
@@ -912,8 +918,12 @@ struct llama_init_result llama_init_from_gpt_params(gpt_params & params) {
         loaded_la.adapter = llama_lora_adapter_init(model, la.path.c_str());
         if (loaded_la.adapter == nullptr) {
             LOG_ERR("%s: failed to apply lora adapter '%s'\n", __func__, la.path.c_str());
+            // the model stays with the caller, without the adapters loaded so far
+            for (auto & loaded : iparams.lora_adapters) {
+                llama_lora_adapter_free(loaded.adapter);
+            }
+            iparams.lora_adapters.clear();
             llama_free(lctx);
-            llama_free_model(model);
             return iparams;
         }
         iparams.lora_adapters.push_back(loaded_la); // copy to list of loaded adapters
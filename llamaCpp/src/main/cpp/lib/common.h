@@ -430,6 +430,7 @@ struct llama_init_result {
 };
 
 struct llama_init_result    llama_init_from_gpt_params(gpt_params & params);
+struct llama_init_result    llama_init_from_model     (llama_model * model, gpt_params & params);
 
 struct llama_model_params     llama_model_params_from_gpt_params    (const gpt_params & params);
 struct llama_context_params   llama_context_params_from_gpt_params  (const gpt_params & params);
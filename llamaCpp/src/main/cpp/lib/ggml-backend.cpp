@@ -867,6 +867,10 @@ struct lm_ggml_backend_cpu_context {
 
     lm_ggml_abort_callback abort_callback;
     void *              abort_callback_data;
+
+    lm_ggml_profile_callback profile_callback;
+    void *                profile_callback_data;
+    bool                  profile_counters;
 };
 
 static const char * lm_ggml_backend_cpu_get_name(lm_ggml_backend_t backend) {
@@ -912,6 +916,10 @@ static lm_ggml_backend_graph_plan_t lm_ggml_backend_cpu_graph_plan_create(lm_ggm
     cpu_plan->cplan.abort_callback      = cpu_ctx->abort_callback;
     cpu_plan->cplan.abort_callback_data = cpu_ctx->abort_callback_data;
 
+    cpu_plan->cplan.profile_callback      = cpu_ctx->profile_callback;
+    cpu_plan->cplan.profile_callback_data = cpu_ctx->profile_callback_data;
+    cpu_plan->cplan.profile_counters      = cpu_ctx->profile_counters;
+
     return cpu_plan;
 }
 
@@ -951,6 +959,10 @@ static enum lm_ggml_status lm_ggml_backend_cpu_graph_compute(lm_ggml_backend_t b
     cplan.abort_callback      = cpu_ctx->abort_callback;
     cplan.abort_callback_data = cpu_ctx->abort_callback_data;
 
+    cplan.profile_callback      = cpu_ctx->profile_callback;
+    cplan.profile_callback_data = cpu_ctx->profile_callback_data;
+    cplan.profile_counters      = cpu_ctx->profile_counters;
+
     return lm_ggml_graph_compute(cgraph, &cplan);
 }
 
@@ -991,6 +1003,9 @@ lm_ggml_backend_t lm_ggml_backend_cpu_init(void) {
     ctx->work_size           = 0;
     ctx->abort_callback      = NULL;
     ctx->abort_callback_data = NULL;
+    ctx->profile_callback      = NULL;
+    ctx->profile_callback_data = NULL;
+    ctx->profile_counters      = false;
 
     lm_ggml_backend_t cpu_backend = new lm_ggml_backend {
         /* .guid      = */ lm_ggml_backend_cpu_guid(),
@@ -1038,6 +1053,15 @@ void lm_ggml_backend_cpu_set_abort_callback(lm_ggml_backend_t backend_cpu, lm_gg
     ctx->abort_callback_data = abort_callback_data;
 }
 
+void lm_ggml_backend_cpu_set_profile_callback(lm_ggml_backend_t backend_cpu, lm_ggml_profile_callback profile_callback, void * profile_callback_data, bool counters) {
+    LM_GGML_ASSERT(lm_ggml_backend_is_cpu(backend_cpu));
+
+    struct lm_ggml_backend_cpu_context * ctx = (struct lm_ggml_backend_cpu_context *)backend_cpu->context;
+    ctx->profile_callback      = profile_callback;
+    ctx->profile_callback_data = profile_callback_data;
+    ctx->profile_counters      = counters;
+}
+
 lm_ggml_backend_buffer_t lm_ggml_backend_cpu_buffer_from_ptr(void * ptr, size_t size) {
     LM_GGML_ASSERT((uintptr_t)ptr % TENSOR_ALIGNMENT == 0 && "buffer pointer must be aligned");
     return lm_ggml_backend_buffer_init(lm_ggml_backend_cpu_buffer_type(), lm_ggml_backend_cpu_buffer_from_ptr_i, ptr, size);
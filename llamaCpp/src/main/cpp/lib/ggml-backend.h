@@ -310,6 +310,7 @@ extern "C" {
     LM_GGML_API void lm_ggml_backend_cpu_set_n_threads     (lm_ggml_backend_t backend_cpu, int n_threads);
     LM_GGML_API void lm_ggml_backend_cpu_set_threadpool    (lm_ggml_backend_t backend_cpu, lm_ggml_threadpool_t threadpool);
     LM_GGML_API void lm_ggml_backend_cpu_set_abort_callback(lm_ggml_backend_t backend_cpu, lm_ggml_abort_callback abort_callback, void * abort_callback_data);
+    LM_GGML_API void lm_ggml_backend_cpu_set_profile_callback(lm_ggml_backend_t backend_cpu, lm_ggml_profile_callback profile_callback, void * profile_callback_data, bool counters);
 
     // Create a backend buffer from an existing pointer
     LM_GGML_API lm_ggml_backend_buffer_t      lm_ggml_backend_cpu_buffer_from_ptr(void * ptr, size_t size);
@@ -31,6 +31,11 @@
 #include <syscall.h>
 #endif
 
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
 #ifdef LM_GGML_USE_OPENMP
 #include <omp.h>
 #endif
@@ -2103,6 +2108,8 @@ struct lm_ggml_threadpool {
     uint32_t     poll;        // Polling level (0 - no polling)
 
     enum lm_ggml_status ec;
+
+    struct lm_ggml_profile_event * profile_events; // set while a profiled graph is computed
 };
 
 // Per-thread state
@@ -19866,6 +19873,107 @@ struct lm_ggml_cplan lm_ggml_graph_plan(
     return cplan;
 }
 
+// cycles and cache misses of the calling thread, as a group read from fds[0]:
+// fds[0] is -1 when perf events are not available, fds[1] when misses are not
+static void lm_ggml_profile_counters_open(int fds[2]) {
+    fds[0] = -1;
+    fds[1] = -1;
+#if defined(__linux__)
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size           = sizeof(attr);
+    attr.type           = PERF_TYPE_HARDWARE;
+    attr.config         = PERF_COUNT_HW_CPU_CYCLES;
+    attr.read_format    = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+
+    fds[0] = (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fds[0] < 0) {
+        fds[0] = -1;
+        return;
+    }
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    fds[1] = (int) syscall(__NR_perf_event_open, &attr, 0, -1, fds[0], 0);
+    if (fds[1] < 0) {
+        fds[1] = -1;
+    }
+#endif
+}
+
+// values[0] = cycles, values[1] = cache misses, -1 when not counted
+static void lm_ggml_profile_counters_read(const int fds[2], int64_t values[2]) {
+    values[0] = -1;
+    values[1] = -1;
+#if defined(__linux__)
+    uint64_t data[3] = { 0, 0, 0 }; // number of counters, then their values
+    if (fds[0] >= 0 && read(fds[0], data, sizeof(data)) >= (ssize_t) (2 * sizeof(uint64_t))) {
+        values[0] = (int64_t) data[1];
+        if (data[0] > 1) {
+            values[1] = (int64_t) data[2];
+        }
+    }
+#else
+    LM_GGML_UNUSED(fds);
+#endif
+}
+
+static void lm_ggml_profile_counters_close(const int fds[2]) {
+#if defined(__linux__)
+    for (int i = 1; i >= 0; i--) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+#else
+    LM_GGML_UNUSED(fds);
+#endif
+}
+
+// lm_ggml_graph_compute_thread with every node timed, see lm_ggml_cplan.profile_callback
+static thread_ret_t lm_ggml_graph_compute_thread_profiled(struct lm_ggml_compute_state * state, struct lm_ggml_compute_params * params) {
+    struct lm_ggml_threadpool * tp = state->threadpool;
+
+    const struct lm_ggml_cgraph * cgraph = tp->cgraph;
+    const struct lm_ggml_cplan  * cplan  = tp->cplan;
+
+    struct lm_ggml_profile_event * events = tp->profile_events + (size_t) state->ith * cgraph->n_nodes;
+
+    int fds[2] = { -1, -1 };
+    if (cplan->profile_counters) {
+        lm_ggml_profile_counters_open(fds);
+    }
+    int64_t counters_start[2];
+    int64_t counters_end[2];
+
+    for (int node_n = 0; node_n < cgraph->n_nodes && !tp->abort; node_n++) {
+        struct lm_ggml_tensor * node = cgraph->nodes[node_n];
+        struct lm_ggml_profile_event * event = &events[node_n];
+
+        lm_ggml_profile_counters_read(fds, counters_start);
+        event->t_start_us = lm_ggml_time_us();
+
+        lm_ggml_compute_forward(params, node);
+
+        event->t_end_us = lm_ggml_time_us();
+        lm_ggml_profile_counters_read(fds, counters_end);
+        event->cycles       = counters_start[0] < 0 ? -1 : counters_end[0] - counters_start[0];
+        event->cache_misses = counters_start[1] < 0 ? -1 : counters_end[1] - counters_start[1];
+
+        if (state->ith == 0 && cplan->abort_callback &&
+                cplan->abort_callback(cplan->abort_callback_data)) {
+            tp->abort = true;
+            tp->ec    = LM_GGML_STATUS_ABORTED;
+        }
+
+        lm_ggml_barrier(state->threadpool);
+    }
+
+    lm_ggml_profile_counters_close(fds);
+
+    return 0;
+}
+
 static thread_ret_t lm_ggml_graph_compute_thread(void * data) {
     struct lm_ggml_compute_state * state = (struct lm_ggml_compute_state *) data;
     struct lm_ggml_threadpool    * tp    = state->threadpool;
@@ -19883,6 +19991,10 @@ static thread_ret_t lm_ggml_graph_compute_thread(void * data) {
         /*.threadpool=*/ tp,
     };
 
+    if (tp->profile_events) {
+        return lm_ggml_graph_compute_thread_profiled(state, &params);
+    }
+
     for (int node_n = 0; node_n < cgraph->n_nodes && !tp->abort; node_n++) {
         struct lm_ggml_tensor * node = cgraph->nodes[node_n];
 
@@ -20093,6 +20205,7 @@ static struct lm_ggml_threadpool * lm_ggml_threadpool_new_impl(
         threadpool->poll             = tpp->poll;
         threadpool->prio             = tpp->prio;
         threadpool->ec               = LM_GGML_STATUS_SUCCESS;
+        threadpool->profile_events   = NULL;
     }
 
     // Allocate and init workers state
@@ -20190,11 +20303,21 @@ enum lm_ggml_status lm_ggml_graph_compute(struct lm_ggml_cgraph * cgraph, struct
         n_threads = threadpool->n_threads_max;
     }
 
+    if (cplan->profile_callback) {
+        threadpool->profile_events = calloc((size_t) n_threads * cgraph->n_nodes, sizeof(struct lm_ggml_profile_event));
+    }
+
     // Kick all threads to start the new graph
     lm_ggml_graph_compute_kickoff(threadpool, n_threads);
 
     // This is a work thread too
     lm_ggml_graph_compute_thread(&threadpool->workers[0]);
+
+    if (threadpool->profile_events) {
+        cplan->profile_callback(cgraph, threadpool->profile_events, n_threads, cplan->profile_callback_data);
+        free(threadpool->profile_events);
+        threadpool->profile_events = NULL;
+    }
 #endif
 
     // don't leave affinity set on the main thread
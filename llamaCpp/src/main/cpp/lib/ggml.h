@@ -643,6 +643,18 @@ extern "C" {
 
     typedef struct lm_ggml_threadpool * lm_ggml_threadpool_t;
 
+    // profiling of lm_ggml_graph_compute: one event per node and thread
+    struct lm_ggml_profile_event {
+        int64_t t_start_us;   // 0 when the thread did not take part in the graph
+        int64_t t_end_us;
+        int64_t cycles;       // perf counters over the node (Linux), -1 when not available
+        int64_t cache_misses;
+    };
+
+    // called by lm_ggml_graph_compute once the graph is computed: events[ith * cgraph->n_nodes + i]
+    // is node i on thread ith
+    typedef void (*lm_ggml_profile_callback)(struct lm_ggml_cgraph * cgraph, const struct lm_ggml_profile_event * events, int n_threads, void * user_data);
+
     // the compute plan that needs to be prepared for lm_ggml_graph_compute()
     // since https://github.com/ggerganov/ggml/issues/287
     struct lm_ggml_cplan {
@@ -655,6 +667,11 @@ extern "C" {
         // abort lm_ggml_graph_compute when true
         lm_ggml_abort_callback abort_callback;
         void *              abort_callback_data;
+
+        // time every node when set, also with perf counters if profile_counters
+        lm_ggml_profile_callback profile_callback;
+        void *                profile_callback_data;
+        bool                  profile_counters;
     };
 
     // scratch buffer
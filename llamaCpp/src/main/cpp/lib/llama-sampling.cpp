@@ -1850,3 +1850,13 @@ void llama_perf_sampler_reset(struct llama_sampler * chain) {
 
     ctx->t_sample_us = ctx->n_sample = 0;
 }
+
+void llama_perf_sampler_add(struct llama_sampler * chain, int64_t t_us) {
+    if (chain == nullptr || chain->iface != &llama_sampler_chain_i) {
+        LM_GGML_ABORT("%s: invalid sampler passed - requires a sampler created with llama_sampler_chain_init()\n", __func__);
+    }
+
+    auto * ctx = (struct llama_sampler_chain *) chain->ctx;
+
+    ctx->t_sample_us += t_us;
+}
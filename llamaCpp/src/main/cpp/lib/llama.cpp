@@ -3351,6 +3351,10 @@ struct llama_context {
     lm_ggml_abort_callback abort_callback      = nullptr;
     void *              abort_callback_data = nullptr;
 
+    lm_ggml_profile_callback profile_callback      = nullptr;
+    void *                profile_callback_data = nullptr;
+    bool                  profile_counters      = false;
+
     // input tensors
     struct lm_ggml_tensor * inp_tokens;      // I32 [n_batch]
     struct lm_ggml_tensor * inp_embd;        // F32 [n_embd, n_batch]
@@ -17049,7 +17053,7 @@ static void llama_output_reorder(struct llama_context * ctx) {
     }
 }
 
-static void llama_graph_compute(
+static enum lm_ggml_status llama_graph_compute(
           llama_context & lctx,
             lm_ggml_cgraph * gf,
                     int   n_threads,
@@ -17057,6 +17061,7 @@ static void llama_graph_compute(
     if (lctx.backend_cpu != nullptr) {
         lm_ggml_backend_cpu_set_threadpool(lctx.backend_cpu, threadpool);
         lm_ggml_backend_cpu_set_abort_callback(lctx.backend_cpu, lctx.abort_callback, lctx.abort_callback_data);
+        lm_ggml_backend_cpu_set_profile_callback(lctx.backend_cpu, lctx.profile_callback, lctx.profile_callback_data, lctx.profile_counters);
     }
 
     // set the number of threads for all the backends
@@ -17065,11 +17070,12 @@ static void llama_graph_compute(
     }
 
     auto err = lm_ggml_backend_sched_graph_compute_async(lctx.sched, gf);
-    if (err != LM_GGML_STATUS_SUCCESS) {
+    if (err != LM_GGML_STATUS_SUCCESS && err != LM_GGML_STATUS_ABORTED) {
         LLAMA_LOG_ERROR("%s: lm_ggml_backend_sched_graph_compute_async failed with error %d\n", __func__, err);
     }
 
     // fprintf(stderr, "splits: %d\n", lm_ggml_backend_sched_get_n_splits(lctx.sched));
+    return err;
 }
 
 // decode a batch of tokens by evaluating the transformer
@@ -17251,7 +17257,11 @@ static int llama_decode_internal(
 
         llama_set_inputs(lctx, ubatch);
 
-        llama_graph_compute(lctx, gf, n_threads, threadpool);
+        const auto compute_status = llama_graph_compute(lctx, gf, n_threads, threadpool);
+        if (compute_status == LM_GGML_STATUS_ABORTED) {
+            // the cells of this ubatch hold partial results, the caller has to drop them
+            return 2;
+        }
 
         // update the kv ring buffer
         {
@@ -20028,6 +20038,31 @@ int32_t llama_get_kv_cache_used_cells(const struct llama_context * ctx) {
     return ctx->kv_self.used;
 }
 
+struct llama_context_memory llama_get_context_memory(const struct llama_context * ctx) {
+    struct llama_context_memory memory = {};
+
+    for (auto * k : ctx->kv_self.k_l) {
+        memory.kv_k += lm_ggml_nbytes(k);
+    }
+    for (auto * v : ctx->kv_self.v_l) {
+        memory.kv_v += lm_ggml_nbytes(v);
+    }
+    memory.kv_buffers = ctx->kv_self.total_size();
+
+    if (ctx->sched) {
+        for (auto * backend : ctx->backends) {
+            memory.compute += lm_ggml_backend_sched_get_buffer_size(ctx->sched, backend);
+        }
+    }
+    memory.compute_meta = ctx->buf_compute_meta.size();
+
+    memory.output = ctx->buf_output ? lm_ggml_backend_buffer_get_size(ctx->buf_output) : 0;
+    memory.logits = ctx->logits_size * sizeof(float);
+    memory.embd   = ctx->embd_size   * sizeof(float);
+
+    return memory;
+}
+
 void llama_kv_cache_clear(struct llama_context * ctx) {
     llama_kv_cache_clear(ctx->kv_self);
 }
@@ -20283,7 +20318,8 @@ struct llama_data_write {
         }
     }
 
-    void write_kv_cache(const struct llama_context * ctx, llama_seq_id seq_id = -1) {
+    // rnllama: p0 >= 0 / p1 >= 0 restrict a sequence to its cells at positions [p0, p1)
+    void write_kv_cache(const struct llama_context * ctx, llama_seq_id seq_id = -1, llama_pos p0 = -1, llama_pos p1 = -1) {
         const struct llama_kv_cache & kv_self = ctx->kv_self;
         std::vector<std::pair<uint32_t, uint32_t>> cell_ranges; // ranges, from inclusive, to exclusive
         uint32_t cell_count = 0;
@@ -20293,7 +20329,8 @@ struct llama_data_write {
         uint32_t cell_range_begin = kv_self.size;
         for (uint32_t i = 0; i < kv_self.size; ++i) {
             const auto & cell = kv_self.cells[i];
-            if ((seq_id == -1 && !cell.is_empty()) || cell.has_seq_id(seq_id)) {
+            if ((seq_id == -1 && !cell.is_empty()) ||
+                (cell.has_seq_id(seq_id) && (p0 < 0 || cell.pos >= p0) && (p1 < 0 || cell.pos < p1))) {
                 ++cell_count;
                 if (cell_range_begin == kv_self.size) {
                     cell_range_begin = i;
@@ -20411,13 +20448,16 @@ struct llama_data_read {
         }
     }
 
-    bool read_kv_cache_meta(struct llama_context * ctx, uint32_t cell_count, llama_seq_id dest_seq_id = -1) {
+    // rnllama: append adds the cells to the sequence instead of replacing it
+    bool read_kv_cache_meta(struct llama_context * ctx, uint32_t cell_count, llama_seq_id dest_seq_id = -1, bool append = false) {
         struct llama_kv_cache & kv_self = ctx->kv_self;
 
         if (dest_seq_id != -1) {
             // single sequence
 
-            llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
+            if (!append) {
+                llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
+            }
 
             llama_ubatch batch = ctx->sbatch.reserve_ubatch(cell_count, /* has_embd */ false);
             batch.n_tokens = cell_count;
@@ -20629,11 +20669,11 @@ struct llama_data_read {
         return true;
     }
 
-    void read_kv_cache(struct llama_context * ctx, llama_seq_id seq_id = -1) {
+    void read_kv_cache(struct llama_context * ctx, llama_seq_id seq_id = -1, bool append = false) {
         uint32_t cell_count;
         read_to(&cell_count, sizeof(cell_count));
 
-        bool res = read_kv_cache_meta(ctx, cell_count, seq_id) && read_kv_cache_data(ctx, cell_count);
+        bool res = read_kv_cache_meta(ctx, cell_count, seq_id, append) && read_kv_cache_data(ctx, cell_count);
 
         if (!res) {
             if (seq_id == -1) {
@@ -20945,6 +20985,37 @@ size_t llama_state_seq_get_data(struct llama_context * ctx, uint8_t * dst, size_
     }
 }
 
+size_t llama_state_seq_get_size_range(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+    llama_data_write_dummy data_ctx;
+    llama_synchronize(ctx);
+    data_ctx.write_kv_cache(ctx, seq_id, p0, p1);
+    return data_ctx.get_size_written();
+}
+
+size_t llama_state_seq_get_data_range(struct llama_context * ctx, uint8_t * dst, size_t size, llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+    llama_data_write_buffer data_ctx(dst, size);
+    try {
+        llama_synchronize(ctx);
+        data_ctx.write_kv_cache(ctx, seq_id, p0, p1);
+        return data_ctx.get_size_written();
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: error saving sequence state: %s\n", __func__, err.what());
+        return 0;
+    }
+}
+
+size_t llama_state_seq_add_data(struct llama_context * ctx, const uint8_t * src, size_t size, llama_seq_id dest_seq_id) {
+    llama_data_read_buffer data_ctx(src, size);
+    try {
+        llama_synchronize(ctx);
+        data_ctx.read_kv_cache(ctx, dest_seq_id, true);
+        return data_ctx.get_size_read();
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: error loading sequence state: %s\n", __func__, err.what());
+        return 0;
+    }
+}
+
 static size_t llama_state_seq_set_data_internal(struct llama_context * ctx, llama_data_read & data_ctx, llama_seq_id dest_seq_id) {
     llama_synchronize(ctx);
 
@@ -21061,6 +21132,12 @@ void llama_set_abort_callback(struct llama_context * ctx, bool (*abort_callback)
     ctx->abort_callback_data = abort_callback_data;
 }
 
+void llama_set_profile_callback(struct llama_context * ctx, lm_ggml_profile_callback profile_callback, void * profile_callback_data, bool counters) {
+    ctx->profile_callback      = profile_callback;
+    ctx->profile_callback_data = profile_callback_data;
+    ctx->profile_counters      = counters;
+}
+
 void llama_set_embeddings(struct llama_context * ctx, bool embeddings) {
     ctx->cparams.embeddings = embeddings;
 }
@@ -603,6 +603,20 @@ extern "C" {
     // Returns the number of used KV cells (i.e. have at least one sequence assigned to them)
     LLAMA_API int32_t llama_get_kv_cache_used_cells(const struct llama_context * ctx);
 
+    // Bytes allocated by a context, by buffer
+    struct llama_context_memory {
+        size_t kv_k;         // K cache tensors
+        size_t kv_v;         // V cache tensors
+        size_t kv_buffers;   // KV cache buffers, including their padding
+        size_t compute;      // compute buffers of all the backends
+        size_t compute_meta; // graph and tensor metadata
+        size_t output;       // host buffer of the outputs
+        size_t logits;       // capacity of the logits in the output buffer
+        size_t embd;         // capacity of the embeddings in the output buffer
+    };
+
+    LLAMA_API struct llama_context_memory llama_get_context_memory(const struct llama_context * ctx);
+
     // Clear the KV cache - both cell info is erased and KV data is zeroed
     LLAMA_API void llama_kv_cache_clear(
             struct llama_context * ctx);
@@ -757,6 +771,30 @@ extern "C" {
                           size_t   size,
                     llama_seq_id   dest_seq_id);
 
+    // rnllama: llama_state_seq_get_size and llama_state_seq_get_data limited to the
+    // cells of the sequence at positions [p0, p1), p0 < 0 / p1 < 0 leave a side open
+    LLAMA_API size_t llama_state_seq_get_size_range(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+                       llama_pos   p0,
+                       llama_pos   p1);
+
+    LLAMA_API size_t llama_state_seq_get_data_range(
+            struct llama_context * ctx,
+                         uint8_t * dst,
+                          size_t   size,
+                    llama_seq_id   seq_id,
+                       llama_pos   p0,
+                       llama_pos   p1);
+
+    // rnllama: llama_state_seq_set_data adding the cells to the sequence instead of
+    // replacing it, to restore a sequence saved in position ranges
+    LLAMA_API size_t llama_state_seq_add_data(
+            struct llama_context * ctx,
+                   const uint8_t * src,
+                          size_t   size,
+                    llama_seq_id   dest_seq_id);
+
     LLAMA_API size_t llama_state_seq_save_file(
             struct llama_context * ctx,
                       const char * filepath,
@@ -812,6 +850,7 @@ extern "C" {
     // Positive return values does not mean a fatal error, but rather a warning.
     //   0 - success
     //   1 - could not find a KV slot for the batch (try reducing the size of the batch or increase the context)
+    //   2 - aborted by the abort callback, the KV cells of the batch must be discarded
     // < 0 - error
     LLAMA_API int32_t llama_decode(
             struct llama_context * ctx,
@@ -839,6 +878,10 @@ extern "C" {
     // Set abort callback
     LLAMA_API void llama_set_abort_callback(struct llama_context * ctx, lm_ggml_abort_callback abort_callback, void * abort_callback_data);
 
+    // Time every node of the graphs computed on the CPU (see lm_ggml_profile_callback), with
+    // perf counters if counters is true; NULL turns profiling off
+    LLAMA_API void llama_set_profile_callback(struct llama_context * ctx, lm_ggml_profile_callback profile_callback, void * profile_callback_data, bool counters);
+
     // Wait until all computations are finished
     // This is automatically done when using one of the functions below to obtain the computation results
     // and is not necessary to call it explicitly in most cases
@@ -1212,6 +1255,10 @@ extern "C" {
     LLAMA_API void                           llama_perf_sampler_print(const struct llama_sampler * chain);
     LLAMA_API void                           llama_perf_sampler_reset(      struct llama_sampler * chain);
 
+    // adds t_us to the sampling time of a chain whose samplers were applied one by one
+    // (llama_sampler_chain_get), which bypasses the chain's own timing
+    LLAMA_API void                           llama_perf_sampler_add  (      struct llama_sampler * chain, int64_t t_us);
+
     LLAMA_API void llama_perf_dump_yaml(FILE * stream, const struct llama_context * ctx);
 
 #ifdef __cplusplus
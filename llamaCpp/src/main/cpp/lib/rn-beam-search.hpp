@@ -0,0 +1,267 @@
+#ifndef RNLLAMA_BEAM_SEARCH_H
+#define RNLLAMA_BEAM_SEARCH_H
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+#include "llama.h"
+
+namespace rnllama {
+
+struct llama_rn_beam
+{
+    std::vector<llama_token> tokens; // generated tokens, the last one is not in the KV cache yet
+    std::string text;
+    double logprob = 0.0;            // sum of the tokens' log probabilities
+    double score = 0.0;              // logprob normalized by length, set once finished
+    llama_seq_id seq_id = -1;        // KV sequence of a live beam
+};
+
+struct llama_rn_beam_params
+{
+    int n_beams = 4;
+    int n_predict = 128;
+    float length_penalty = 1.0f; // finished beams are ranked by logprob / length^length_penalty
+    bool early_stopping = true;  // stop once n_beams beams are finished, instead of when no live beam can beat them
+    std::vector<std::string> stop;
+};
+
+// Beam search over KV sequences: each live beam owns one sequence, all of them hold
+// the prompt and the beam's tokens. A step decodes the last token of every live beam
+// in one batch, then keeps the n_beams best extensions. A beam with several kept
+// extensions hands its sequence to the first one, the others take the sequence of a
+// pruned beam with seq_rm/seq_cp; cells are shared between sequences, not copied.
+struct llama_rn_beam_search
+{
+    llama_rn_beam_params params;
+    llama_pos n_prompt = 0;
+    int n_vocab = 0;
+    std::vector<llama_rn_beam> beams;    // live, best first
+    std::vector<llama_rn_beam> finished; // at most n_beams, best first
+    std::vector<llama_seq_id> idle;      // sequences without a live beam
+    bool is_done = false;
+
+    // Take over the prompt in sequence seq_ids[0]: it is shared with the other
+    // sequences so that every sequence always starts with the prompt.
+    void init(llama_context *ctx, const std::vector<llama_seq_id> &seq_ids, llama_pos n_prompt_, const llama_rn_beam_params &params_)
+    {
+        params = params_;
+        params.n_beams = std::max(1, std::min(params.n_beams, (int) seq_ids.size()));
+        n_prompt = n_prompt_;
+        n_vocab = llama_n_vocab(llama_get_model(ctx));
+        beams.assign(1, llama_rn_beam());
+        beams[0].seq_id = seq_ids[0];
+        finished.clear();
+        idle.assign(seq_ids.begin() + 1, seq_ids.end());
+        for (llama_seq_id seq_id : idle)
+        {
+            llama_kv_cache_seq_rm(ctx, seq_id, 0, -1);
+            llama_kv_cache_seq_cp(ctx, seq_ids[0], seq_id, 0, n_prompt);
+        }
+        is_done = false;
+    }
+
+    double normalized(double logprob, size_t n_tokens) const
+    {
+        return logprob / std::pow((double) std::max((size_t) 1, n_tokens), (double) params.length_penalty);
+    }
+
+    // last token of every live beam, logits requested for each in beam order
+    void fillBatch(llama_batch &batch) const
+    {
+        batch.n_tokens = 0;
+        for (const llama_rn_beam &beam : beams)
+        {
+            const int i = batch.n_tokens++;
+            batch.token[i] = beam.tokens.back();
+            batch.pos[i] = n_prompt + beam.tokens.size() - 1;
+            batch.n_seq_id[i] = 1;
+            batch.seq_id[i][0] = beam.seq_id;
+            batch.logits[i] = 1;
+        }
+    }
+
+    // Extend the live beams given the logits of each, in beam order. is_eog tells
+    // the end-of-generation tokens, piece gives the text of a token. n_ctx bounds
+    // the positions of a sequence.
+    void expand(llama_context *ctx, const std::function<const float *(size_t)> &logits_of,
+                const std::function<bool(llama_token)> &is_eog, const std::function<std::string(llama_token)> &piece, int n_ctx)
+    {
+        struct candidate
+        {
+            double logprob;
+            size_t parent;
+            llama_token tok;
+        };
+        // 2 * n_beams per beam: enough to keep n_beams live beams even if n_beams of them end
+        const size_t n_top = 2 * params.n_beams;
+        std::vector<candidate> candidates;
+        std::vector<std::pair<float, llama_token>> top;
+        for (size_t b = 0; b < beams.size(); b++)
+        {
+            const float *logits = logits_of(b);
+            float max_logit = logits[0];
+            for (int i = 1; i < n_vocab; i++)
+            {
+                max_logit = std::max(max_logit, logits[i]);
+            }
+            double sum = 0.0;
+            top.clear();
+            for (int i = 0; i < n_vocab; i++)
+            {
+                sum += std::exp((double) (logits[i] - max_logit));
+                // min-heap of the n_top largest logits
+                if (top.size() < n_top || logits[i] > top.front().first)
+                {
+                    if (top.size() == n_top)
+                    {
+                        std::pop_heap(top.begin(), top.end(), std::greater<std::pair<float, llama_token>>());
+                        top.pop_back();
+                    }
+                    top.push_back(std::make_pair(logits[i], (llama_token) i));
+                    std::push_heap(top.begin(), top.end(), std::greater<std::pair<float, llama_token>>());
+                }
+            }
+            const double log_sum = max_logit + std::log(sum);
+            for (const auto &t : top)
+            {
+                candidates.push_back({beams[b].logprob + t.first - log_sum, b, t.second});
+            }
+        }
+        std::sort(candidates.begin(), candidates.end(), [](const candidate &a, const candidate &b) {
+            return a.logprob > b.logprob;
+        });
+
+        std::vector<llama_rn_beam> next;
+        std::vector<int> n_children(beams.size(), 0);
+        for (size_t c = 0; c < candidates.size() && (int) next.size() < params.n_beams; c++)
+        {
+            const candidate &cand = candidates[c];
+            const llama_rn_beam &parent = beams[cand.parent];
+            llama_rn_beam beam;
+            beam.tokens = parent.tokens;
+            beam.tokens.push_back(cand.tok);
+            beam.logprob = cand.logprob;
+            beam.text = parent.text;
+            const size_t n_text = beam.text.size();
+            bool is_finished = is_eog(cand.tok);
+            if (!is_finished)
+            {
+                beam.text += piece(cand.tok);
+                is_finished = cutStopWord(beam.text, n_text);
+            }
+            if (is_finished)
+            {
+                // only extensions ranked among the n_beams best may end the search
+                if ((int) c < params.n_beams)
+                {
+                    addFinished(beam);
+                }
+                continue;
+            }
+            n_children[cand.parent]++;
+            beam.seq_id = cand.parent; // parent index until sequences are assigned
+            next.push_back(beam);
+        }
+
+        // sequences of beams without extensions are free, a beam's first extension
+        // keeps its sequence
+        for (size_t b = 0; b < beams.size(); b++)
+        {
+            if (n_children[b] == 0)
+            {
+                idle.push_back(beams[b].seq_id);
+            }
+        }
+        std::vector<bool> parent_seq_taken(beams.size(), false);
+        for (llama_rn_beam &beam : next)
+        {
+            const size_t parent = beam.seq_id;
+            if (!parent_seq_taken[parent])
+            {
+                parent_seq_taken[parent] = true;
+                beam.seq_id = beams[parent].seq_id;
+                continue;
+            }
+            beam.seq_id = idle.back();
+            idle.pop_back();
+            llama_kv_cache_seq_rm(ctx, beam.seq_id, 0, -1);
+            llama_kv_cache_seq_cp(ctx, beams[parent].seq_id, beam.seq_id, 0, -1);
+        }
+        beams.swap(next);
+
+        const size_t n_len = beams.empty() ? 0 : beams[0].tokens.size();
+        if (beams.empty() || (int) n_len >= params.n_predict || n_prompt + (int) n_len >= n_ctx)
+        {
+            is_done = true;
+        }
+        else if ((int) finished.size() >= params.n_beams)
+        {
+            // without early stopping: the best live beam, normalized at its current length,
+            // can no longer beat the worst finished one
+            is_done = params.early_stopping || normalized(beams[0].logprob, n_len) <= finished.back().score;
+        }
+    }
+
+    // finished beams, then the live ones, best first
+    std::vector<llama_rn_beam> results()
+    {
+        std::vector<llama_rn_beam> all = finished;
+        for (llama_rn_beam beam : beams)
+        {
+            beam.score = normalized(beam.logprob, beam.tokens.size());
+            all.push_back(beam);
+        }
+        std::stable_sort(all.begin(), all.end(), [](const llama_rn_beam &a, const llama_rn_beam &b) {
+            return a.score > b.score;
+        });
+        if ((int) all.size() > params.n_beams)
+        {
+            all.resize(params.n_beams);
+        }
+        return all;
+    }
+
+private:
+    void addFinished(llama_rn_beam &beam)
+    {
+        beam.score = normalized(beam.logprob, beam.tokens.size());
+        beam.seq_id = -1;
+        auto it = std::upper_bound(finished.begin(), finished.end(), beam, [](const llama_rn_beam &a, const llama_rn_beam &b) {
+            return a.score > b.score;
+        });
+        finished.insert(it, beam);
+        if ((int) finished.size() > params.n_beams)
+        {
+            finished.pop_back();
+        }
+    }
+
+    // cut text at the first stop word ending after n_text, true if there is one
+    bool cutStopWord(std::string &text, size_t n_text) const
+    {
+        size_t cut = std::string::npos;
+        for (const std::string &word : params.stop)
+        {
+            if (word.empty())
+            {
+                continue;
+            }
+            const size_t from = n_text >= word.size() ? n_text - word.size() + 1 : 0;
+            cut = std::min(cut, text.find(word, from));
+        }
+        if (cut == std::string::npos)
+        {
+            return false;
+        }
+        text.erase(cut);
+        return true;
+    }
+};
+
+}
+
+#endif /* RNLLAMA_BEAM_SEARCH_H */
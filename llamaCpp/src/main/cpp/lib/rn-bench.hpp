@@ -0,0 +1,326 @@
+#ifndef RNLLAMA_BENCH_H
+#define RNLLAMA_BENCH_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <string>
+#include <vector>
+#include "common.h"
+#include "json.hpp"
+#include "llama.h"
+
+namespace rnllama {
+
+// Prompt used when the caller gives none. Real text rather than a repeated token,
+// so that prefill and generation run on the token statistics of actual use.
+static const char *bench_default_prompt =
+    "The history of the printing press begins in the fifteenth century, when Johannes Gutenberg "
+    "combined movable metal type, oil-based inks and a wooden screw press adapted from those used "
+    "to make wine. Within fifty years presses were at work in more than two hundred European towns, "
+    "and the price of books fell so far that pamphlets, calendars and broadsheets reached readers "
+    "who had never owned a manuscript. Scholars argue about how much the press caused and how much "
+    "it merely accelerated: literacy was already rising, paper mills had spread from Spain and Italy, "
+    "and merchants needed standardized contracts and accounts. What is clear is that identical copies "
+    "changed how knowledge was checked. A reader in Venice and a reader in Antwerp could point to the "
+    "same page and line, errors could be listed in errata sheets, and later editions could correct them.\n";
+
+struct llama_rn_bench_params
+{
+    int n_prompt = 512;
+    int n_gen = 128;   // tokens generated per sequence, the first one comes from the prefill
+    int n_reps = 3;    // warm runs of each configuration
+    bool cold = true;  // report the first run of each configuration apart instead of discarding it
+    std::string prompt; // repeated or cut to n_prompt tokens, bench_default_prompt if empty
+
+    // swept values, every combination is run; an empty list keeps the base context value
+    std::vector<int> n_threads;
+    std::vector<int> n_batch;
+    std::vector<int> n_ubatch;
+    std::vector<int> n_parallel;
+};
+
+struct llama_rn_bench_run
+{
+    double t_prompt_ms = 0;
+    double t_first_ms = 0;          // time to first token: prefill and sampling the first token
+    double t_gen_ms = 0;            // from the first token to the last one
+    std::vector<double> t_token_ms; // inter-token latency of each generation step
+    int n_prompt = 0;
+    int n_gen = 0;                  // tokens generated after the first, over all sequences
+};
+
+static llama_token bench_argmax(const float *logits, int n_vocab)
+{
+    return (llama_token) (std::max_element(logits, logits + n_vocab) - logits);
+}
+
+// nearest-rank percentile of sorted values
+static double bench_percentile(const std::vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+    const size_t rank = (size_t) std::ceil(p / 100.0 * sorted.size());
+    return sorted[std::min(sorted.size(), std::max((size_t) 1, rank)) - 1];
+}
+
+static nlohmann::ordered_json bench_latency(std::vector<double> values)
+{
+    std::sort(values.begin(), values.end());
+    return {
+        {"p50", bench_percentile(values, 50)},
+        {"p90", bench_percentile(values, 90)},
+        {"p99", bench_percentile(values, 99)},
+    };
+}
+
+static nlohmann::ordered_json bench_mean_std(const std::vector<double> &values)
+{
+    double avg = 0;
+    double var = 0;
+    for (double v : values)
+    {
+        avg += v;
+    }
+    avg /= std::max((size_t) 1, values.size());
+    for (double v : values)
+    {
+        var += (v - avg) * (v - avg);
+    }
+    return {
+        {"avg", avg},
+        {"std", values.size() > 1 ? std::sqrt(var / (values.size() - 1)) : 0.0},
+    };
+}
+
+// The prompt is decoded on sequence 0 and shared with the other sequences, which
+// then generate greedily in lockstep, one token each per llama_decode. They all
+// follow the same continuation, the cost of a step does not depend on the tokens.
+static int bench_run_once(llama_context *ctx, const std::vector<llama_token> &prompt, int n_gen, int n_parallel,
+                          llama_batch &batch, llama_rn_bench_run &run)
+{
+    const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+    const size_t n_batch = llama_n_batch(ctx);
+    llama_kv_cache_clear(ctx);
+
+    const int64_t t_start = llama_time_us();
+    for (size_t i = 0; i < prompt.size(); i += n_batch)
+    {
+        ::llama_batch_clear(batch);
+        for (size_t j = i; j < std::min(prompt.size(), i + n_batch); j++)
+        {
+            ::llama_batch_add(batch, prompt[j], j, {0}, j == prompt.size() - 1);
+        }
+        const int ret = llama_decode(ctx, batch);
+        if (ret != 0)
+        {
+            return ret;
+        }
+    }
+    const int64_t t_prompt = llama_time_us();
+    std::vector<llama_token> next(n_parallel, bench_argmax(llama_get_logits_ith(ctx, batch.n_tokens - 1), n_vocab));
+    const int64_t t_first = llama_time_us();
+    for (int s = 1; s < n_parallel; s++)
+    {
+        llama_kv_cache_seq_cp(ctx, 0, s, -1, -1);
+    }
+
+    int64_t t_last = t_first;
+    run.t_token_ms.clear();
+    for (int i = 1; i < n_gen; i++)
+    {
+        ::llama_batch_clear(batch);
+        for (int s = 0; s < n_parallel; s++)
+        {
+            ::llama_batch_add(batch, next[s], prompt.size() + i - 1, {s}, true);
+        }
+        const int ret = llama_decode(ctx, batch);
+        if (ret != 0)
+        {
+            return ret;
+        }
+        for (int s = 0; s < n_parallel; s++)
+        {
+            next[s] = bench_argmax(llama_get_logits_ith(ctx, s), n_vocab);
+        }
+        const int64_t t_now = llama_time_us();
+        run.t_token_ms.push_back((t_now - t_last) / 1e3);
+        t_last = t_now;
+    }
+
+    run.t_prompt_ms = (t_prompt - t_start) / 1e3;
+    run.t_first_ms = (t_first - t_start) / 1e3;
+    run.t_gen_ms = (t_last - t_first) / 1e3;
+    run.n_prompt = prompt.size();
+    run.n_gen = (n_gen - 1) * n_parallel;
+    return 0;
+}
+
+static bool bench_abort(void *data)
+{
+    return ((const std::atomic<bool> *) data)->load();
+}
+
+// Runs every configuration of the sweep on a context of its own, created from
+// cparams with the swept values and sized for the run, so the caller's KV cache is
+// left alone. The cold run is the first decode on that fresh context: compute
+// buffers and KV cache are touched for the first time, the weights are usually
+// resident already. Each configuration decodes on a threadpool of its n_threads,
+// with the cores, priority and polling of cpuparams, as the context does. Setting
+// interrupted stops the suite, within one graph computation, and returns the
+// configurations completed so far.
+static nlohmann::ordered_json bench_suite(llama_model *model, llama_context_params cparams, const cpu_params &cpuparams,
+                                          const llama_rn_bench_params &params, std::atomic<bool> &interrupted)
+{
+    nlohmann::ordered_json result;
+    char model_desc[128];
+    llama_model_desc(model, model_desc, sizeof(model_desc));
+    result["model"] = model_desc;
+    result["model_size"] = llama_model_size(model);
+    result["model_n_params"] = llama_model_n_params(model);
+
+    const int n_prompt = std::max(1, params.n_prompt);
+    const int n_gen = std::max(1, params.n_gen);
+    const std::string text = params.prompt.empty() ? bench_default_prompt : params.prompt;
+    std::vector<llama_token> text_tokens;
+    text_tokens.resize(text.size() + 2);
+    const int n_text = llama_tokenize(model, text.c_str(), text.size(), text_tokens.data(), text_tokens.size(), false, false);
+    text_tokens.resize(std::max(0, n_text));
+    if (text_tokens.empty())
+    {
+        result["error"] = "the prompt has no tokens";
+        return result;
+    }
+    std::vector<llama_token> prompt;
+    if (llama_add_bos_token(model))
+    {
+        prompt.push_back(llama_token_bos(model));
+    }
+    while ((int) prompt.size() < n_prompt)
+    {
+        prompt.push_back(text_tokens[(prompt.size() - llama_add_bos_token(model)) % text_tokens.size()]);
+    }
+    prompt.resize(n_prompt);
+    result["n_prompt"] = n_prompt;
+    result["n_gen"] = n_gen;
+    result["n_reps"] = params.n_reps;
+
+    const std::vector<int> threads = params.n_threads.empty() ? std::vector<int>{(int) cparams.n_threads} : params.n_threads;
+    const std::vector<int> batches = params.n_batch.empty() ? std::vector<int>{(int) cparams.n_batch} : params.n_batch;
+    const std::vector<int> ubatches = params.n_ubatch.empty() ? std::vector<int>{(int) cparams.n_ubatch} : params.n_ubatch;
+    const std::vector<int> parallels = params.n_parallel.empty() ? std::vector<int>{1} : params.n_parallel;
+
+    nlohmann::ordered_json results = nlohmann::ordered_json::array();
+    bool stopped = false;
+    for (int n_threads : threads)
+    for (int n_batch : batches)
+    for (int n_ubatch : ubatches)
+    for (int n_parallel : parallels)
+    {
+        if (interrupted || stopped)
+        {
+            stopped = true;
+            break;
+        }
+        if (n_threads < 1 || n_ubatch < 1 || n_ubatch > n_batch || n_parallel < 1 || n_parallel > n_batch)
+        {
+            continue;
+        }
+        llama_context_params bench_cparams = cparams;
+        bench_cparams.n_ctx = n_prompt + n_parallel * n_gen;
+        bench_cparams.n_batch = n_batch;
+        bench_cparams.n_ubatch = n_ubatch;
+        bench_cparams.n_seq_max = n_parallel;
+        bench_cparams.n_threads = n_threads;
+        bench_cparams.n_threads_batch = n_threads;
+        bench_cparams.embeddings = false;
+        bench_cparams.abort_callback = bench_abort;
+        bench_cparams.abort_callback_data = &interrupted;
+        llama_context *ctx = llama_new_context_with_model(model, bench_cparams);
+        if (ctx == nullptr)
+        {
+            result["error"] = "failed to create a context";
+            stopped = true;
+            break;
+        }
+        // without a pool every decode would start and join its own threads
+        lm_ggml_threadpool_params tpp = lm_ggml_threadpool_params_from_cpu_params(cpuparams);
+        tpp.n_threads = n_threads;
+        lm_ggml_threadpool *threadpool = lm_ggml_threadpool_new(&tpp);
+        if (threadpool != nullptr)
+        {
+            llama_attach_threadpool(ctx, threadpool, nullptr);
+        }
+        llama_batch batch = llama_batch_init(std::max(n_batch, n_parallel), 0, n_parallel);
+
+        nlohmann::ordered_json item;
+        item["n_threads"] = n_threads;
+        item["n_batch"] = n_batch;
+        item["n_ubatch"] = n_ubatch;
+        item["n_parallel"] = n_parallel;
+
+        std::vector<double> pp_tps, tg_tps, ttft_ms, itl_ms;
+        for (int rep = 0; rep <= params.n_reps; rep++)
+        {
+            llama_rn_bench_run run;
+            if (bench_run_once(ctx, prompt, n_gen, n_parallel, batch, run) != 0)
+            {
+                if (!interrupted)
+                {
+                    result["error"] = "llama_decode() failed";
+                }
+                stopped = true;
+                break;
+            }
+            const double run_pp_tps = run.n_prompt / (run.t_prompt_ms / 1e3);
+            const double run_tg_tps = run.n_gen > 0 ? run.n_gen / (run.t_gen_ms / 1e3) : 0;
+            if (rep == 0)
+            {
+                // the first run of a context, a warmup unless it is reported
+                if (params.cold)
+                {
+                    item["cold"] = {
+                        {"ttft_ms", run.t_first_ms},
+                        {"pp_tps", run_pp_tps},
+                        {"tg_tps", run_tg_tps},
+                        {"itl_ms", bench_latency(run.t_token_ms)},
+                    };
+                }
+                continue;
+            }
+            pp_tps.push_back(run_pp_tps);
+            tg_tps.push_back(run_tg_tps);
+            ttft_ms.push_back(run.t_first_ms);
+            itl_ms.insert(itl_ms.end(), run.t_token_ms.begin(), run.t_token_ms.end());
+        }
+        if (!pp_tps.empty())
+        {
+            item["warm"] = {
+                {"pp_tps", bench_mean_std(pp_tps)},
+                {"tg_tps", bench_mean_std(tg_tps)},
+                {"ttft_ms", bench_latency(ttft_ms)},
+                {"itl_ms", bench_latency(itl_ms)},
+            };
+        }
+        if (!stopped || interrupted)
+        {
+            results.push_back(item);
+        }
+
+        llama_batch_free(batch);
+        llama_free(ctx);
+        if (threadpool != nullptr)
+        {
+            lm_ggml_threadpool_free(threadpool);
+        }
+    }
+    result["results"] = results;
+    result["interrupted"] = (bool) interrupted;
+    return result;
+}
+
+}
+
+#endif /* RNLLAMA_BENCH_H */
@@ -0,0 +1,195 @@
+#ifndef RNLLAMA_CONTEXT_SHIFT_H
+#define RNLLAMA_CONTEXT_SHIFT_H
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "llama.h"
+
+namespace rnllama {
+
+struct token_span
+{
+    size_t pos_a = 0; // start in the indexed sequence
+    size_t pos_b = 0; // start in the scanned sequence
+    size_t n = 0;
+};
+
+// Suffix automaton of a token sequence. Built in O(n) and scanned in O(m), so the
+// context shift planner can find the longest common substring of two contexts
+// without the O(n·m) table. Transitions live in one hash map keyed by
+// (state, token) with a per-state edge list so that states can be cloned.
+struct token_suffix_automaton
+{
+    struct state
+    {
+        int len = 0;
+        int link = -1;
+        int first_end = -1; // end of the first occurrence in the indexed sequence
+        int edges = -1;     // head of the edge list
+    };
+
+    std::vector<state> states;
+    std::vector<llama_token> edge_token;
+    std::vector<int> edge_target;
+    std::vector<int> edge_next;
+    std::unordered_map<uint64_t, int> edge_index;
+
+    token_suffix_automaton(const llama_token *tokens, size_t n_tokens)
+    {
+        states.reserve(2 * n_tokens + 1);
+        edge_token.reserve(3 * n_tokens);
+        edge_target.reserve(3 * n_tokens);
+        edge_next.reserve(3 * n_tokens);
+        edge_index.reserve(3 * n_tokens);
+
+        states.push_back(state());
+        int last = 0;
+        for (size_t i = 0; i < n_tokens; i++)
+        {
+            const llama_token t = tokens[i];
+            const int cur = (int) states.size();
+            states.push_back(state());
+            states[cur].len = states[last].len + 1;
+            states[cur].first_end = (int) i;
+
+            int p = last;
+            while (p != -1 && findEdge(p, t) < 0)
+            {
+                addEdge(p, t, cur);
+                p = states[p].link;
+            }
+            if (p == -1)
+            {
+                states[cur].link = 0;
+            }
+            else
+            {
+                const int q = edge_target[findEdge(p, t)];
+                if (states[p].len + 1 == states[q].len)
+                {
+                    states[cur].link = q;
+                }
+                else
+                {
+                    const int clone = (int) states.size();
+                    states.push_back(state());
+                    states[clone].len = states[p].len + 1;
+                    states[clone].link = states[q].link;
+                    states[clone].first_end = states[q].first_end;
+                    for (int e = states[q].edges; e >= 0; e = edge_next[e])
+                    {
+                        addEdge(clone, edge_token[e], edge_target[e]);
+                    }
+                    int e;
+                    while (p != -1 && (e = findEdge(p, t)) >= 0 && edge_target[e] == q)
+                    {
+                        edge_target[e] = clone;
+                        p = states[p].link;
+                    }
+                    states[q].link = clone;
+                    states[cur].link = clone;
+                }
+            }
+            last = cur;
+        }
+    }
+
+    // Longest run of `tokens` that also occurs in the indexed sequence. Among runs of
+    // equal length the one ending first in `tokens` wins, pos_a is its first occurrence.
+    token_span longestCommon(const llama_token *tokens, size_t n_tokens) const
+    {
+        token_span best;
+        int v = 0;
+        size_t l = 0;
+        for (size_t j = 0; j < n_tokens; j++)
+        {
+            int e;
+            while (v != 0 && findEdge(v, tokens[j]) < 0)
+            {
+                v = states[v].link;
+                l = states[v].len;
+            }
+            if ((e = findEdge(v, tokens[j])) >= 0)
+            {
+                v = edge_target[e];
+                l++;
+            }
+            if (l > best.n)
+            {
+                best.n = l;
+                best.pos_a = states[v].first_end + 1 - l;
+                best.pos_b = j + 1 - l;
+            }
+        }
+        return best;
+    }
+
+private:
+    static uint64_t edgeKey(int s, llama_token t)
+    {
+        return ((uint64_t) (uint32_t) s << 32) | (uint32_t) t;
+    }
+
+    int findEdge(int s, llama_token t) const
+    {
+        auto it = edge_index.find(edgeKey(s, t));
+        return it == edge_index.end() ? -1 : it->second;
+    }
+
+    void addEdge(int s, llama_token t, int target)
+    {
+        const int e = (int) edge_token.size();
+        edge_token.push_back(t);
+        edge_target.push_back(target);
+        edge_next.push_back(states[s].edges);
+        states[s].edges = e;
+        edge_index[edgeKey(s, t)] = e;
+    }
+};
+
+// First index of seq[0, n) in target, -1 if absent (Knuth–Morris–Pratt).
+static int arr_find_index_of(const std::vector<llama_token> &target, const llama_token *seq, size_t n)
+{
+    if (n == 0)
+    {
+        return 0;
+    }
+    if (target.size() < n)
+    {
+        return -1;
+    }
+    std::vector<size_t> fail(n, 0);
+    for (size_t i = 1, k = 0; i < n; i++)
+    {
+        while (k > 0 && seq[i] != seq[k])
+        {
+            k = fail[k - 1];
+        }
+        if (seq[i] == seq[k])
+        {
+            k++;
+        }
+        fail[i] = k;
+    }
+    for (size_t i = 0, k = 0; i < target.size(); i++)
+    {
+        while (k > 0 && target[i] != seq[k])
+        {
+            k = fail[k - 1];
+        }
+        if (target[i] == seq[k])
+        {
+            k++;
+        }
+        if (k == n)
+        {
+            return (int) (i + 1 - n);
+        }
+    }
+    return -1;
+}
+
+}
+
+#endif /* RNLLAMA_CONTEXT_SHIFT_H */
@@ -0,0 +1,334 @@
+#ifndef RNLLAMA_CONVERSATION_STORE_H
+#define RNLLAMA_CONVERSATION_STORE_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <unistd.h>
+#include <zlib.h>
+#include "llama.h"
+
+namespace rnllama {
+
+// Snapshots of the KV sequence of each conversation (llama_state_seq_get_data),
+// keyed by an id chosen by the caller, so that a conversation resumed after others
+// used the context is restored with a copy instead of a prefill. Snapshots stay in
+// RAM up to n_bytes_max; beyond that the least recently used ones are spilled to
+// zlib-compressed files in spill_dir, or dropped when there is none.
+//
+// The store has a mutex of its own, only held for bookkeeping: compression and file
+// I/O happen in trim and prefetch without it, so that the callers holding the
+// context's slots_mutex (put, get) never wait on them.
+struct llama_rn_conversation_store
+{
+    typedef std::shared_ptr<const std::vector<uint8_t>> state_ptr;
+
+    struct entry
+    {
+        std::vector<llama_token> tokens; // tokens in the snapshot, kept in RAM when spilled
+        state_ptr state;                 // nullptr when spilled
+        std::string path;                // spill file, empty when in RAM
+        int64_t t_last_used = 0;
+        bool is_spilling = false;        // state is being written to a file by trim
+    };
+
+    size_t n_bytes_max = 0; // 0 disables the store
+    std::string spill_dir;
+    std::atomic<size_t> n_bytes{0}; // states in RAM
+    std::atomic<size_t> n_files{0}; // spill files written
+    std::atomic<size_t> n_spilled{0};
+    std::atomic<size_t> n_loaded{0}; // spilled snapshots read back
+
+    ~llama_rn_conversation_store()
+    {
+        clear();
+    }
+
+    bool enabled() const
+    {
+        return n_bytes_max > 0;
+    }
+
+    // Replace the conversation's snapshot. RAM is brought back within the budget by
+    // the next trim.
+    void put(const std::string &id, std::vector<llama_token> tokens, std::vector<uint8_t> state, int64_t now)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        entry &e = entries[id];
+        release(e);
+        e.tokens = std::move(tokens);
+        e.state = std::make_shared<const std::vector<uint8_t>>(std::move(state));
+        e.t_last_used = now;
+        n_bytes += e.state->size();
+    }
+
+    // The conversation's tokens and its state, state nullptr while spilled (see
+    // prefetch). false when unknown.
+    bool get(const std::string &id, int64_t now, std::vector<llama_token> &tokens, state_ptr &state)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(id);
+        if (it == entries.end())
+        {
+            return false;
+        }
+        tokens = it->second.tokens;
+        state = it->second.state;
+        it->second.t_last_used = now;
+        return true;
+    }
+
+    // Read a spilled conversation back into RAM, then trim around it. false when it
+    // is unknown or its file is unreadable, which drops it.
+    bool prefetch(const std::string &id, int64_t now)
+    {
+        std::string path;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = entries.find(id);
+            if (it == entries.end())
+            {
+                return false;
+            }
+            it->second.t_last_used = now;
+            if (it->second.path.empty())
+            {
+                return true;
+            }
+            path = it->second.path;
+        }
+        std::vector<uint8_t> state;
+        const bool ok = unspill(path, state);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = entries.find(id);
+            // replaced or removed meanwhile: that did away with the file
+            if (it == entries.end() || it->second.path != path)
+            {
+                return it != entries.end();
+            }
+            if (!ok)
+            {
+                release(it->second);
+                entries.erase(it);
+            }
+            else
+            {
+                it->second.path.clear();
+                it->second.state = std::make_shared<const std::vector<uint8_t>>(std::move(state));
+                n_bytes += it->second.state->size();
+                stale_files.push_back(path);
+                n_loaded++;
+            }
+        }
+        // make room around the loaded state, which stays over budget alone if it must
+        trim(ok ? id : std::string());
+        return ok;
+    }
+
+    // Spill or drop the least recently used states in RAM, except keep's, until
+    // within the budget, and delete the files of replaced snapshots.
+    void trim(const std::string &keep = std::string())
+    {
+        while (true)
+        {
+            std::string id;
+            state_ptr state;
+            std::vector<std::string> files;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                files.swap(stale_files);
+                if (n_bytes > n_bytes_max)
+                {
+                    std::unordered_map<std::string, entry>::iterator lru = entries.end();
+                    for (auto it = entries.begin(); it != entries.end(); ++it)
+                    {
+                        if (it->first != keep && it->second.state && !it->second.is_spilling &&
+                            (lru == entries.end() || it->second.t_last_used < lru->second.t_last_used))
+                        {
+                            lru = it;
+                        }
+                    }
+                    if (lru != entries.end())
+                    {
+                        id = lru->first;
+                        state = lru->second.state;
+                        lru->second.is_spilling = true;
+                    }
+                }
+            }
+            remove_files(files);
+            if (!state)
+            {
+                return;
+            }
+            std::string path;
+            const bool ok = spill(*state, path);
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = entries.find(id);
+            if (it == entries.end() || it->second.state != state)
+            {
+                // replaced or removed meanwhile
+                if (ok)
+                {
+                    stale_files.push_back(path);
+                }
+                if (it != entries.end())
+                {
+                    it->second.is_spilling = false;
+                }
+                continue;
+            }
+            entry &e = it->second;
+            e.is_spilling = false;
+            if (ok)
+            {
+                n_bytes -= e.state->size();
+                e.state.reset();
+                e.path = path;
+                n_spilled++;
+            }
+            else
+            {
+                release(e);
+                entries.erase(it);
+            }
+        }
+    }
+
+    bool remove(const std::string &id)
+    {
+        std::vector<std::string> files;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = entries.find(id);
+            if (it == entries.end())
+            {
+                return false;
+            }
+            release(it->second);
+            entries.erase(it);
+            files.swap(stale_files);
+        }
+        remove_files(files);
+        return true;
+    }
+
+    void clear()
+    {
+        std::vector<std::string> files;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto &it : entries)
+            {
+                release(it.second);
+            }
+            entries.clear();
+            files.swap(stale_files);
+        }
+        remove_files(files);
+    }
+
+private:
+    std::mutex mutex;
+    std::unordered_map<std::string, entry> entries;
+    std::vector<std::string> stale_files; // spill files to delete outside the mutex
+
+    // free the entry's RAM and queue its spill file for deletion
+    void release(entry &e)
+    {
+        if (e.state)
+        {
+            n_bytes -= e.state->size();
+            e.state.reset();
+        }
+        if (!e.path.empty())
+        {
+            stale_files.push_back(e.path);
+            e.path.clear();
+        }
+    }
+
+    static void remove_files(const std::vector<std::string> &files)
+    {
+        for (const std::string &file : files)
+        {
+            std::remove(file.c_str());
+        }
+    }
+
+    // file: uint64 state size, uint64 compressed size, compressed state
+    bool spill(const std::vector<uint8_t> &state, std::string &path)
+    {
+        if (spill_dir.empty())
+        {
+            return false;
+        }
+        uLongf n_compressed = compressBound(state.size());
+        std::vector<uint8_t> compressed(n_compressed);
+        // the fastest level: KV data is mostly entropy, the point is to skip runs of zeroes
+        if (compress2(compressed.data(), &n_compressed, state.data(), state.size(), Z_BEST_SPEED) != Z_OK)
+        {
+            return false;
+        }
+        // a unique name: contexts may be given the same spill_dir
+        path = spill_dir + "/conversation-XXXXXX";
+        const int fd = mkstemp(&path[0]);
+        if (fd < 0)
+        {
+            return false;
+        }
+        FILE *fp = fdopen(fd, "wb");
+        if (fp == nullptr)
+        {
+            close(fd);
+            std::remove(path.c_str());
+            return false;
+        }
+        n_files++;
+        const uint64_t header[2] = {state.size(), n_compressed};
+        const bool ok = std::fwrite(header, sizeof(header), 1, fp) == 1 &&
+                        std::fwrite(compressed.data(), 1, n_compressed, fp) == n_compressed;
+        if (std::fclose(fp) != 0 || !ok)
+        {
+            std::remove(path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    static bool unspill(const std::string &path, std::vector<uint8_t> &state)
+    {
+        FILE *fp = std::fopen(path.c_str(), "rb");
+        if (fp == nullptr)
+        {
+            return false;
+        }
+        uint64_t header[2];
+        std::vector<uint8_t> compressed;
+        bool ok = std::fread(header, sizeof(header), 1, fp) == 1;
+        if (ok)
+        {
+            compressed.resize(header[1]);
+            ok = std::fread(compressed.data(), 1, compressed.size(), fp) == compressed.size();
+        }
+        std::fclose(fp);
+        if (!ok)
+        {
+            return false;
+        }
+        state.resize(header[0]);
+        uLongf n_state = state.size();
+        return uncompress(state.data(), &n_state, compressed.data(), compressed.size()) == Z_OK && n_state == state.size();
+    }
+};
+
+}
+
+#endif /* RNLLAMA_CONVERSATION_STORE_H */
@@ -0,0 +1,347 @@
+#ifndef RNLLAMA_CPU_H
+#define RNLLAMA_CPU_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sched.h>
+#include "common.h"
+#include "ggml.h"
+
+namespace rnllama {
+
+struct llama_rn_core
+{
+    int id = 0;
+    uint32_t max_freq_khz = 0; // cpufreq/cpuinfo_max_freq, 0 when unknown
+    uint32_t capacity = 0;     // cpu_capacity (1024 for the fastest core), 0 when unknown
+    double score = 0;          // relative speed the threads are chosen by
+};
+
+// Thread counts and cores for single-token generation and for batches (prefill).
+// ggml splits an op evenly and waits for every thread at each barrier, so a set of
+// cores runs as fast as its slowest one times its size: the sets maximize that.
+struct llama_rn_cpu_plan
+{
+    int n_threads = 0;
+    int n_threads_batch = 0;
+    std::vector<int> cores;
+    std::vector<int> cores_batch;
+    std::vector<llama_rn_core> topology;
+    bool measured = false; // scores are benchmark results, not capacities or frequencies
+    bool loaded = false;   // read from the saved profile
+};
+
+static inline bool read_sysfs_uint(const std::string &path, uint32_t &value)
+{
+    std::ifstream file(path);
+    unsigned long v;
+    if (!(file >> v))
+    {
+        return false;
+    }
+    value = (uint32_t) v;
+    return true;
+}
+
+// "0-3,6" -> 0 1 2 3 6
+static inline std::vector<int> parse_cpu_list(const std::string &list)
+{
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ','))
+    {
+        int first;
+        int last;
+        const int n = std::sscanf(range.c_str(), "%d-%d", &first, &last);
+        if (n < 1)
+        {
+            continue;
+        }
+        for (int cpu = first; cpu <= (n == 2 ? last : first); cpu++)
+        {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+// CPUs the process may run on, its cpuset on Android: pinning a thread to another
+// core fails. Empty when unknown.
+static inline std::vector<int> allowed_cpus()
+{
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &set))
+            {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    return cpus;
+}
+
+// Online cores the process may run on (all of them with allowed empty) and what
+// sysfs tells of their speed; sysfs_root is "/sys" outside of tests
+static inline std::vector<llama_rn_core> read_cpu_topology(const std::string &sysfs_root, const std::vector<int> &allowed)
+{
+    const std::string cpu_dir = sysfs_root + "/devices/system/cpu";
+    std::vector<int> ids;
+    std::ifstream online(cpu_dir + "/online");
+    std::string list;
+    if (std::getline(online, list))
+    {
+        ids = parse_cpu_list(list);
+    }
+    if (ids.empty())
+    {
+        const int n_cpu = (int) std::thread::hardware_concurrency();
+        for (int i = 0; i < n_cpu; i++)
+        {
+            ids.push_back(i);
+        }
+    }
+    if (!allowed.empty())
+    {
+        std::vector<int> online_allowed;
+        for (int id : ids)
+        {
+            if (std::find(allowed.begin(), allowed.end(), id) != allowed.end())
+            {
+                online_allowed.push_back(id);
+            }
+        }
+        ids = online_allowed.empty() ? allowed : online_allowed;
+    }
+    std::vector<llama_rn_core> cores;
+    for (int id : ids)
+    {
+        llama_rn_core core;
+        core.id = id;
+        const std::string dir = cpu_dir + "/cpu" + std::to_string(id);
+        read_sysfs_uint(dir + "/cpufreq/cpuinfo_max_freq", core.max_freq_khz);
+        read_sysfs_uint(dir + "/cpu_capacity", core.capacity);
+        cores.push_back(core);
+    }
+    return cores;
+}
+
+// Q4_0 x Q8_0 dot products per microsecond on one core, the kernel of quantized
+// matmuls, measured on a thread pinned to the core. 0 when it cannot be pinned.
+static inline double benchmark_core(int core)
+{
+    double score = 0;
+    std::thread thread([core, &score]() {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(core, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) != 0)
+        {
+            return;
+        }
+        // 32 rows of 2048 columns, the weights stay in L2 like a tile of a matmul
+        const int n_cols = 2048;
+        const int n_rows = 32;
+        std::vector<float> values((size_t) n_cols * n_rows);
+        for (size_t i = 0; i < values.size(); i++)
+        {
+            values[i] = (float) ((i * 2654435761u) % 1000) / 500.0f - 1.0f;
+        }
+        std::vector<uint8_t> weights(lm_ggml_row_size(LM_GGML_TYPE_Q4_0, n_cols) * n_rows);
+        std::vector<uint8_t> activations(lm_ggml_row_size(LM_GGML_TYPE_Q8_0, n_cols));
+        lm_ggml_quantize_chunk(LM_GGML_TYPE_Q4_0, values.data(), weights.data(), 0, n_rows, n_cols, nullptr);
+        lm_ggml_quantize_chunk(LM_GGML_TYPE_Q8_0, values.data(), activations.data(), 0, 1, n_cols, nullptr);
+        const lm_ggml_vec_dot_t vec_dot = lm_ggml_get_type_traits(LM_GGML_TYPE_Q4_0)->vec_dot;
+        const size_t row_size = lm_ggml_row_size(LM_GGML_TYPE_Q4_0, n_cols);
+
+        // the first pass wakes the core up from its lowest frequency
+        float sum = 0;
+        for (int pass = 0; pass < 2; pass++)
+        {
+            const auto t_start = std::chrono::steady_clock::now();
+            long n_dots = 0;
+            double elapsed_us = 0;
+            while (elapsed_us < 10000)
+            {
+                for (int row = 0; row < n_rows; row++)
+                {
+                    float s;
+                    vec_dot(n_cols, &s, 0, weights.data() + row * row_size, 0, activations.data(), 0, 1);
+                    sum += s;
+                }
+                n_dots += n_rows;
+                elapsed_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t_start).count();
+            }
+            score = n_dots / elapsed_us;
+        }
+        // keep the loop from being optimized away
+        if (sum == 12345.0f)
+        {
+            score += 1e-9;
+        }
+    });
+    thread.join();
+    return score;
+}
+
+// Sizes maximizing n * (score of the n-th fastest core): for batches over every
+// core, for generation over at most 4 cores within 80% of the fastest, since a
+// single token is bound by memory bandwidth and by barrier waits on the slowest.
+static inline void choose_threads(llama_rn_cpu_plan &plan)
+{
+    std::vector<llama_rn_core> sorted = plan.topology;
+    std::stable_sort(sorted.begin(), sorted.end(), [](const llama_rn_core &a, const llama_rn_core &b) { return a.score > b.score; });
+    const double fastest = sorted.empty() ? 0 : sorted[0].score;
+    int n_batch = 1;
+    int n_gen = 1;
+    for (int n = 1; n <= (int) sorted.size(); n++)
+    {
+        const double throughput = n * sorted[n - 1].score;
+        if (throughput > n_batch * sorted[n_batch - 1].score)
+        {
+            n_batch = n;
+        }
+        if (n <= 4 && sorted[n - 1].score >= 0.8 * fastest && throughput > n_gen * sorted[n_gen - 1].score)
+        {
+            n_gen = n;
+        }
+    }
+    plan.n_threads = n_gen;
+    plan.n_threads_batch = n_batch;
+    plan.cores.clear();
+    plan.cores_batch.clear();
+    for (int i = 0; i < n_batch && i < (int) sorted.size(); i++)
+    {
+        if (i < n_gen)
+        {
+            plan.cores.push_back(sorted[i].id);
+        }
+        plan.cores_batch.push_back(sorted[i].id);
+    }
+}
+
+// Score every allowed core with measure (benchmark_core on a device). When a core
+// cannot be measured, all are scored by sysfs capacity, else maximum frequency, else alike.
+static inline llama_rn_cpu_plan calibrate_cpu(const std::string &sysfs_root, const std::function<double(int)> &measure,
+                                              const std::vector<int> &allowed = allowed_cpus())
+{
+    llama_rn_cpu_plan plan;
+    plan.topology = read_cpu_topology(sysfs_root, allowed);
+    plan.measured = !plan.topology.empty();
+    for (llama_rn_core &core : plan.topology)
+    {
+        core.score = measure ? measure(core.id) : 0;
+        plan.measured = plan.measured && core.score > 0;
+    }
+    if (!plan.measured)
+    {
+        for (llama_rn_core &core : plan.topology)
+        {
+            core.score = core.capacity > 0 ? core.capacity : core.max_freq_khz > 0 ? core.max_freq_khz : 1;
+        }
+    }
+    choose_threads(plan);
+    return plan;
+}
+
+// Identifies the device in the saved profile: a profile from other cores is ignored
+static inline std::string cpu_profile_key(const std::vector<llama_rn_core> &topology)
+{
+    std::string key = "cpu";
+    for (const llama_rn_core &core : topology)
+    {
+        key += " " + std::to_string(core.id) + ":" + std::to_string(core.max_freq_khz) + ":" + std::to_string(core.capacity);
+    }
+    return key;
+}
+
+// Profile file: the key line, then one line per core: id score
+static inline bool load_cpu_profile(const std::string &path, llama_rn_cpu_plan &plan)
+{
+    std::ifstream file(path);
+    std::string key;
+    if (!std::getline(file, key) || key != cpu_profile_key(plan.topology))
+    {
+        return false;
+    }
+    for (llama_rn_core &core : plan.topology)
+    {
+        int id;
+        if (!(file >> id >> core.score) || id != core.id || core.score <= 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static inline void save_cpu_profile(const std::string &path, const llama_rn_cpu_plan &plan)
+{
+    std::ofstream file(path);
+    file << cpu_profile_key(plan.topology) << "\n";
+    for (const llama_rn_core &core : plan.topology)
+    {
+        file << core.id << " " << core.score << "\n";
+    }
+}
+
+// Benchmark the cores once per device: the scores are kept in profile_path (if not
+// empty) and read back by later contexts.
+static inline llama_rn_cpu_plan plan_threads(const std::string &sysfs_root, const std::string &profile_path,
+                                             const std::function<double(int)> &measure = benchmark_core,
+                                             const std::vector<int> &allowed = allowed_cpus())
+{
+    llama_rn_cpu_plan plan;
+    plan.topology = read_cpu_topology(sysfs_root, allowed);
+    if (!profile_path.empty() && load_cpu_profile(profile_path, plan))
+    {
+        plan.measured = true;
+        plan.loaded = true;
+        choose_threads(plan);
+        return plan;
+    }
+    plan = calibrate_cpu(sysfs_root, measure, allowed);
+    if (!profile_path.empty() && plan.measured)
+    {
+        save_cpu_profile(profile_path, plan);
+    }
+    return plan;
+}
+
+static inline void set_cpu_params(cpu_params &params, int n_threads, const std::vector<int> &cores)
+{
+    params.n_threads = n_threads;
+    std::fill(params.cpumask, params.cpumask + LM_GGML_MAX_N_THREADS, false);
+    for (int core : cores)
+    {
+        if (core < LM_GGML_MAX_N_THREADS)
+        {
+            params.cpumask[core] = true;
+        }
+    }
+    params.mask_valid = !cores.empty();
+}
+
+// cpu_params of the plan, the masks apply to threadpools built from them
+static inline void apply_cpu_plan(const llama_rn_cpu_plan &plan, gpt_params &params)
+{
+    set_cpu_params(params.cpuparams, plan.n_threads, plan.cores);
+    set_cpu_params(params.cpuparams_batch, plan.n_threads_batch, plan.cores_batch);
+}
+
+}
+
+#endif /* RNLLAMA_CPU_H */
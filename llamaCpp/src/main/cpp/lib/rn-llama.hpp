@@ -1,11 +1,33 @@
 #ifndef RNLLAMA_H
 #define RNLLAMA_H
 
+#include <algorithm>
 #include <sstream>
+#include <cctype>
 #include <iostream>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
 #include "common.h"
 #include "llama.h"
 #include "sampling.h"
+#include "rn-beam-search.hpp"
+#include "rn-bench.hpp"
+#include "rn-context-shift.hpp"
+#include "rn-cpu.hpp"
+#include "rn-memory.hpp"
+#include "rn-model-registry.hpp"
+#include "rn-conversation-store.hpp"
+#include "rn-ngram-cache.hpp"
+#include "rn-planner.hpp"
+#include "rn-prefix-cache.hpp"
+#include "rn-profiler.hpp"
+#include "rn-session.hpp"
+#include "rn-stop-matcher.hpp"
+#include "rn-stream.hpp"
+#include "rn-timing.hpp"
 
 namespace rnllama {
 
@@ -59,12 +81,6 @@ static bool rnllama_verbose = false;
 #define LOG_WARNING(MSG, ...) log("WARNING", __func__, __LINE__, MSG, ##__VA_ARGS__)
 #define LOG_INFO(MSG, ...) log("INFO", __func__, __LINE__, MSG, ##__VA_ARGS__)
 
-enum stop_type
-{
-    STOP_FULL,
-    STOP_PARTIAL,
-};
-
 // completion token output with probabilities
 struct completion_token_output
 {
@@ -76,48 +92,45 @@ struct completion_token_output
 
     std::vector<token_prob> probs;
     llama_token tok;
+
+    // bytes of the token's piece in the slot's generated_text
+    size_t text_pos = 0;
+    size_t text_len = 0;
 };
 
-static size_t common_part(const std::vector<llama_token> &a, const std::vector<llama_token> &b)
+// a chunk of a streamed completion, see llama_rn_stream
+struct completion_stream_event
 {
-    size_t i;
-    for (i = 0; i < a.size() && i < b.size() && a[i] == b[i]; i++)
-    {
-    }
-    return i;
-}
+    int index = 0; // completion of an n-best request, -1 for prompt progress
+    std::string text;
+    std::vector<completion_token_output> probs; // tokens whose text is sent in full with this chunk
+
+    size_t prompt_n = 0;
+    size_t prompt_total = 0;
+    double prompt_ms = 0.0;
+};
 
-static bool ends_with(const std::string &str, const std::string &suffix)
+// a chunk of a document embedded by llama_rn_context::embedDocument
+struct document_chunk
 {
-    return str.size() >= suffix.size() &&
-           0 == str.compare(str.size() - suffix.size(), suffix.size(), suffix);
-}
+    size_t token_start = 0; // [token_start, token_end) of the document's tokens
+    size_t token_end = 0;
+    size_t text_start = 0;  // [text_start, text_end) bytes of the document's text
+    size_t text_end = 0;
+};
 
-static size_t find_partial_stop_string(const std::string &stop,
-                                       const std::string &text)
+static size_t common_part(const std::vector<llama_token> &a, const std::vector<llama_token> &b)
 {
-    if (!text.empty() && !stop.empty())
+    size_t i;
+    for (i = 0; i < a.size() && i < b.size() && a[i] == b[i]; i++)
     {
-        const char text_last_char = text.back();
-        for (int64_t char_index = stop.size() - 1; char_index >= 0; char_index--)
-        {
-            if (stop[char_index] == text_last_char)
-            {
-                const std::string current_partial = stop.substr(0, char_index + 1);
-                if (ends_with(text, current_partial))
-                {
-                    return text.size() - char_index - 1;
-                }
-            }
-        }
     }
-    return std::string::npos;
+    return i;
 }
 
 // format incomplete utf-8 multibyte character for output
-static std::string tokens_to_output_formatted_string(const llama_context *ctx, const llama_token token)
+static std::string piece_to_output_formatted_string(std::string out)
 {
-    std::string out = token == -1 ? "" : llama_token_to_piece(ctx, token);
     // if the size is 1 and first bit is 1, meaning it's a partial character
     //   (size > 1 meaning it's already a known token)
     if (out.size() == 1 && (out[0] & 0x80) == 0x80)
@@ -130,6 +143,11 @@ static std::string tokens_to_output_formatted_string(const llama_context *ctx, c
     return out;
 }
 
+static std::string tokens_to_output_formatted_string(const llama_context *ctx, const llama_token token)
+{
+    return piece_to_output_formatted_string(token == -1 ? "" : llama_token_to_piece(ctx, token));
+}
+
 template <class Iter>
 static std::string tokens_to_str(llama_context *ctx, Iter begin, Iter end)
 {
@@ -142,28 +160,98 @@ static std::string tokens_to_str(llama_context *ctx, Iter begin, Iter end)
 }
 
 
-struct llama_rn_context
+enum slot_state
+{
+    SLOT_STATE_IDLE,
+    SLOT_STATE_PROCESSING,
+};
+
+struct llama_rn_slot;
+
+// A completion decoded by the context's worker thread (see startStream): the text of
+// the request slot and of its forks is pushed in chunks, the owner drains them in
+// batches and reads the slots' results once the queue is closed.
+struct llama_rn_stream
+{
+    std::vector<llama_rn_slot *> slots; // the request slot, then its forks
+    llama_rn_spsc_queue<completion_stream_event> queue;
+    // the worker found no room for a round, the owner wakes it after draining
+    std::atomic<bool> is_throttled{false};
+
+    // bytes of generated_text and entries of generated_token_probs already pushed, per slot
+    std::vector<size_t> sent_counts;
+    std::vector<size_t> sent_token_probs_indices;
+    size_t sent_prompt_done = 0;
+
+    explicit llama_rn_stream(size_t capacity) : queue(capacity)
+    {
+    }
+};
+
+// A single completion request. Every slot decodes into its own sequence
+// (seq_id == id) of the llama_context shared by all slots.
+struct llama_rn_slot
 {
-    bool is_predicting = false;
-    bool is_interrupted = false;
-    bool has_next_token = false;
+    int id = 0;
+    int n_ctx = 0; // share of the context window available to this slot
+    slot_state state = SLOT_STATE_IDLE;
+    int64_t t_last_used = -1;
+
+    std::atomic<bool> is_interrupted{false};
+    std::atomic<bool> has_next_token{false};
+    bool is_generating = false; // the scheduler still has to sample tokens for this slot
     std::string generated_text;
     std::vector<completion_token_output> generated_token_probs;
 
+    // tokens sampled by the scheduler that doCompletion has not returned yet
+    std::deque<completion_token_output> pending;
+
     size_t num_prompt_tokens = 0;
     size_t num_tokens_predicted = 0;
     size_t n_past = 0;
     size_t n_remain = 0;
+    size_t n_restored = 0; // prompt tokens restored from the prefix cache
+
+    // doCompletion also returns between prompt chunks, with tok == -1, so that the
+    // owner can report n_prompt_done out of n_prompt_processed
+    bool report_progress = false;
+
+    // n-best completions: slots that continue this slot's prompt once it is decoded,
+    // each sampling on its own (see acquireForks)
+    std::vector<llama_rn_slot *> forks;
+
+    // set before loadPrompt to decode with beam search instead of sampling, one beam
+    // in the slot's sequence and one in each fork's (see beamSearch)
+    std::unique_ptr<llama_rn_beam_search> beam_search;
+
+    // set by startStream while the worker thread decodes the request
+    std::unique_ptr<llama_rn_stream> stream;
+
+    // the sequence is restored from and snapshotted into the conversation store
+    std::string conversation_id;
 
+    std::vector<llama_token> prompt_tokens;
     std::vector<llama_token> embd;
+    std::vector<float> embedding;
 
-    gpt_params params;
+    // index of the slot's last token in the batch being decoded (-1 = no logits requested)
+    int32_t i_batch = -1;
+    int32_t n_eval = 0;
 
-    llama_model *model = nullptr;
-    llama_context *ctx = nullptr;
+    gpt_params params;
     gpt_sampler *ctx_sampling = nullptr;
-  
-    int n_ctx;
+
+    // speculative decoding: tokens proposed after the last sampled token, verified by
+    // the next target decode. draft_q holds the proposal distribution of each token,
+    // empty when the proposal is deterministic.
+    std::vector<llama_token> draft;
+    std::vector<std::vector<llama_token_data>> draft_q;
+    std::vector<llama_token> embd_draft; // tokens in the draft model's KV cache
+    gpt_sampler *ctx_sampling_draft = nullptr;
+    std::mt19937 rng;
+    llama_rn_ngram_index lookup; // n-grams of embd for prompt lookup decoding
+    size_t n_drafted = 0;
+    size_t n_draft_accepted = 0;
 
     bool truncated = false;
     bool stopped_eos = false;
@@ -172,594 +260,2472 @@ struct llama_rn_context
     std::string stopping_word;
     bool incomplete = false;
 
-    ~llama_rn_context()
+    llama_rn_stop_matcher stop_matcher;
+    bool stop_token_triggers = false; // also stop on the tokenization of the stop words
+
+    // llama_perf_context is shared by every slot, so timings are tracked per request
+    int64_t t_start_prompt = 0;
+    int64_t t_start_generation = 0;
+    double t_prompt_processing = 0.0; // ms
+    double t_token_generation = 0.0;  // ms
+    size_t n_prompt_processed = 0;
+    size_t n_decoded = 0;
+    // snapshot taken by doCompletion, safe to read by the owner without the lock
+    size_t n_prompt_done = 0;
+    double t_prompt_elapsed = 0.0; // ms
+    // time to first token, from loadPrompt to the first sampled token (ms)
+    double t_first_token = 0.0;
+    // time between a token and the previous one, as the owner can see them: a
+    // token waits for the decodes of the other slots batched with it, and the
+    // tokens of an accepted draft come at once
+    int64_t t_last_token = 0;
+    llama_rn_latency_histogram token_latency;
+    int64_t t_stop_match_us = 0;
+    double t_marshal_ms = 0.0; // spent by the owner converting the output, see drainCompletion
+
+    ~llama_rn_slot()
     {
-        if (ctx)
-        {
-            llama_free(ctx);
-            ctx = nullptr;
-        }
-        if (model)
-        {
-            llama_free_model(model);
-            model = nullptr;
-        }
         if (ctx_sampling != nullptr)
         {
             gpt_sampler_free(ctx_sampling);
         }
+        if (ctx_sampling_draft != nullptr)
+        {
+            gpt_sampler_free(ctx_sampling_draft);
+        }
     }
 
     void rewind()
     {
         is_interrupted = false;
-        params.antiprompt.clear();
-        params.sparams.grammar.clear();
+        has_next_token = false;
+        is_generating = false;
         num_prompt_tokens = 0;
         num_tokens_predicted = 0;
         generated_text = "";
-        generated_text.reserve(params.n_ctx);
+        generated_text.reserve(n_ctx);
         generated_token_probs.clear();
+        pending.clear();
+        embedding.clear();
         truncated = false;
         stopped_eos = false;
         stopped_word = false;
         stopped_limit = false;
         stopping_word = "";
         incomplete = false;
+        stop_token_triggers = false;
         n_remain = 0;
         n_past = 0;
+        n_restored = 0;
+        report_progress = false;
+        forks.clear();
+        beam_search.reset();
+        conversation_id.clear();
+        i_batch = -1;
+        n_eval = 0;
+        t_start_prompt = 0;
+        t_start_generation = 0;
+        t_prompt_processing = 0.0;
+        t_token_generation = 0.0;
+        n_prompt_processed = 0;
+        n_decoded = 0;
+        n_prompt_done = 0;
+        t_prompt_elapsed = 0.0;
+        t_first_token = 0.0;
+        t_last_token = 0;
+        token_latency.clear();
+        t_stop_match_us = 0;
+        t_marshal_ms = 0.0;
+        draft.clear();
+        draft_q.clear();
+        n_drafted = 0;
+        n_draft_accepted = 0;
         params.sparams.n_prev = n_ctx;
     }
 
-    bool initSampling() {
-        if (ctx_sampling != nullptr) {
-            gpt_sampler_free(ctx_sampling);
+    // has tokens in embd that are not in the KV cache yet and nobody is waiting on them
+    bool isReady() const
+    {
+        return state == SLOT_STATE_PROCESSING && is_generating && has_next_token && !is_interrupted &&
+               pending.empty() && n_past < embd.size();
+    }
+};
+
+struct llama_rn_context
+{
+    // bench() and the slots cannot share the KV cache, so it runs exclusively
+    std::atomic<bool> is_predicting{false};
+    std::atomic<bool> is_interrupted{false};
+
+    gpt_params params;
+
+    llama_model *model = nullptr;
+    llama_context *ctx = nullptr;
+    // this context's LoRA adapters, loaded on the shared model and freed with the context
+    std::vector<llama_lora_adapter_container> lora_adapters;
+
+    int n_ctx;
+    // memory plan the parameters were chosen by, n_ctx == 0 when none was made
+    llama_rn_plan plan;
+    // cores the threads were chosen by, n_threads == 0 when set by the caller
+    llama_rn_cpu_plan cpu_plan;
+
+    // text of every vocabulary token, so detokenizing on the hot path is a copy
+    std::string vocab_pieces;
+    std::vector<uint32_t> vocab_piece_offsets;
+
+    // continuous batching: every active slot is advanced by the same llama_decode call
+    std::vector<std::unique_ptr<llama_rn_slot>> slots;
+    std::atomic<int> n_processing{0};
+    std::mutex slots_mutex;
+    llama_batch batch = {};
+    bool is_decoding = false; // updateSlots is inside llama_decode, see abortDecode
+
+    // KV snapshots of previously decoded prompts, shared by all slots (guarded by slots_mutex)
+    llama_rn_prefix_cache prefix_cache;
+    // KV snapshot of each conversation after its last request, with a lock of its own
+    llama_rn_conversation_store conversations;
+    // model and KV layout, written in session files to reject those of another context
+    uint64_t fingerprint = 0;
+
+    // optional small model proposing up to params.n_draft tokens per step, each slot
+    // drafts into the sequence of the same id
+    llama_model *model_draft = nullptr;
+    llama_context *ctx_draft = nullptr;
+    llama_batch batch_draft = {};
+    float draft_p_min = 0.75f; // stop drafting below this draft probability
+
+    // prompt lookup decoding: drafts copied from earlier occurrences of the last
+    // n-gram in the slot's own tokens, falling back to counts from past completions
+    llama_rn_ngram_cache lookup_cache;
+    std::string lookup_cache_path;
+
+    // decodes streamed completions, one round of every stream at a time
+    llama_rn_worker worker;
+
+    // long-lived workers for single-token decodes and for batches (one pool when their
+    // parameters match), paused while idle so they stop polling
+    lm_ggml_threadpool *threadpool = nullptr;
+    lm_ggml_threadpool *threadpool_batch = nullptr;
+
+    // node timings of the target model's graphs between startProfiler and stopProfiler,
+    // which hands it over for the results (guarded by slots_mutex)
+    std::unique_ptr<llama_rn_profiler> profiler;
+
+    ~llama_rn_context()
+    {
+        // streams end once interrupted, the worker must be gone before the slots
+        interrupt();
+        worker.stop();
+        slots.clear();
+        if (batch.token != nullptr)
+        {
+            llama_batch_free(batch);
+        }
+        if (batch_draft.token != nullptr)
+        {
+            llama_batch_free(batch_draft);
+        }
+        if (ctx_draft)
+        {
+            llama_free(ctx_draft);
+            ctx_draft = nullptr;
+        }
+        if (model_draft)
+        {
+            llama_rn_model_registry::instance().release(model_draft);
+            model_draft = nullptr;
+        }
+        if (ctx)
+        {
+            llama_free(ctx);
+            ctx = nullptr;
+        }
+        if (!lora_adapters.empty())
+        {
+            std::lock_guard<std::mutex> lock(llama_rn_model_registry::instance().adapter_mutex);
+            for (llama_lora_adapter_container &adapter : lora_adapters)
+            {
+                llama_lora_adapter_free(adapter.adapter);
+            }
+            lora_adapters.clear();
+        }
+        if (model)
+        {
+            llama_rn_model_registry::instance().release(model);
+            model = nullptr;
+        }
+        // the contexts are gone, nothing computes on the pools anymore
+        if (threadpool_batch)
+        {
+            lm_ggml_threadpool_free(threadpool_batch);
+            threadpool_batch = nullptr;
+        }
+        if (threadpool)
+        {
+            lm_ggml_threadpool_free(threadpool);
+            threadpool = nullptr;
         }
-        ctx_sampling = gpt_sampler_init(model, params.sparams);
-        return ctx_sampling != nullptr;
     }
 
     bool loadModel(gpt_params &params_)
     {
         params = params_;
-        llama_init_result result = llama_init_from_gpt_params(params);
+        params.n_parallel = std::max(1, params.n_parallel);
+        postprocess_cpu_params(params.cpuparams, nullptr);
+        postprocess_cpu_params(params.cpuparams_batch, &params.cpuparams);
+        if (plan.n_ctx > 0)
+        {
+            const double mb = 1024.0 * 1024.0;
+            LOG_INFO("memory plan: n_ctx %d, n_ubatch %d, cache %s/%s, flash_attn %d, mmap %d, mlock %d%s",
+                     plan.n_ctx, plan.n_ubatch, plan.type_k.c_str(), plan.type_v.c_str(), plan.flash_attn,
+                     plan.use_mmap, plan.use_mlock, plan.fits ? "" : " (over budget)");
+            LOG_INFO("memory plan: weights %.1f MB, KV %.1f MB, compute %.1f MB, output %.1f MB, caches %.1f MB, total %.1f MB of %.1f MB budget, %.1f MB available",
+                     plan.n_bytes_weights / mb, plan.n_bytes_kv / mb, plan.n_bytes_compute / mb, plan.n_bytes_output / mb,
+                     plan.n_bytes_caches / mb, plan.total() / mb, plan.n_bytes_budget / mb, plan.n_bytes_available / mb);
+        }
+        if (cpu_plan.n_threads > 0)
+        {
+            std::string scores;
+            for (const llama_rn_core &core : cpu_plan.topology)
+            {
+                char score[32];
+                snprintf(score, sizeof(score), " %d:%.4g", core.id, core.score);
+                scores += score;
+            }
+            LOG_INFO("threads: %d for generation, %d for batches, core scores%s (%s)", cpu_plan.n_threads,
+                     cpu_plan.n_threads_batch, scores.c_str(),
+                     cpu_plan.loaded ? "saved" : cpu_plan.measured ? "measured" : "from sysfs");
+        }
+        bool shared = false;
+        llama_init_result result = initSharedModel(params, shared);
         model = result.model;
         ctx = result.context;
+        lora_adapters = result.lora_adapters;
         if (model == nullptr)
         {
            LOG_ERROR("unable to load model: %s", params_.model.c_str());
            return false;
         }
+        if (shared)
+        {
+            LOG_INFO("%s: model already loaded, shared by %d contexts", __func__, llama_rn_model_registry::instance().refs(model));
+        }
         n_ctx = llama_n_ctx(ctx);
-        return true;
-    }
+        llama_set_abort_callback(ctx, abortDecode, this);
+        if (!params.vocab_only)
+        {
+            createThreadpools();
+        }
 
-    bool validateModelChatTemplate() const {
-        llama_chat_message chat[] = {{"user", "test"}};
+        const int n_vocab = llama_n_vocab(model);
+        vocab_piece_offsets.resize(n_vocab + 1);
+        for (llama_token tok = 0; tok < n_vocab; tok++)
+        {
+            vocab_piece_offsets[tok] = vocab_pieces.size();
+            vocab_pieces += llama_token_to_piece(ctx, tok);
+        }
+        vocab_piece_offsets[n_vocab] = vocab_pieces.size();
+        fingerprint = session_fingerprint(ctx);
 
-        std::vector<char> model_template(2048, 0); // longest known template is about 1200 bytes
-        std::string template_key = "tokenizer.chat_template";
-        int32_t res = llama_model_meta_val_str(model, template_key.c_str(), model_template.data(), model_template.size());
+        const int n_ctx_slot = n_ctx / params.n_parallel;
+        for (int i = 0; i < params.n_parallel; i++)
+        {
+            llama_rn_slot *slot = new llama_rn_slot();
+            slot->id = i;
+            slot->n_ctx = n_ctx_slot;
+            slot->params = params;
+            slots.push_back(std::unique_ptr<llama_rn_slot>(slot));
+        }
+        batch = llama_batch_init(std::max(params.n_batch, params.n_parallel), 0, 1);
+        LOG_INFO("%s: n_parallel: %d, n_ctx per slot: %d", __func__, params.n_parallel, n_ctx_slot);
 
-        return res >= 0;
+        if (!params.model_draft.empty() && !params.embedding && !params.vocab_only)
+        {
+            loadDraftModel();
+        }
+        return true;
     }
 
-    void truncatePrompt(std::vector<llama_token> &prompt_tokens) {
-        const int n_left = n_ctx - params.n_keep;
-        const int n_block_size = n_left / 2;
-        const int erased_blocks = (prompt_tokens.size() - params.n_keep - n_block_size) / n_block_size;
-
-        // Keep n_keep tokens at start of prompt (at most n_ctx - 4)
-        std::vector<llama_token> new_tokens(prompt_tokens.begin(), prompt_tokens.begin() + params.n_keep);
-
-        new_tokens.insert(new_tokens.end(), prompt_tokens.begin() + params.n_keep + erased_blocks * n_block_size, prompt_tokens.end());
+    // The model of params.model from the registry, loaded once for the contexts of the
+    // same file and model parameters, and a context of its own on it. A model already
+    // loaded is not warmed up again, its weights are in memory.
+    static llama_init_result initSharedModel(gpt_params &params_init, bool &shared)
+    {
+        llama_init_result result;
+        llama_rn_model_registry &registry = llama_rn_model_registry::instance();
+        llama_model *shared_model = registry.acquire(params_init.model, llama_model_params_from_gpt_params(params_init), shared);
+        if (shared_model == nullptr)
+        {
+            return result;
+        }
+        if (shared)
+        {
+            params_init.warmup = false;
+        }
+        {
+            std::unique_lock<std::mutex> lock(registry.adapter_mutex, std::defer_lock);
+            if (!params_init.lora_adapters.empty())
+            {
+                lock.lock();
+            }
+            result = llama_init_from_model(shared_model, params_init);
+        }
+        if (result.context == nullptr)
+        {
+            registry.release(shared_model);
+        }
+        return result;
+    }
 
-        LOG_VERBOSE("input truncated, n_ctx: %d, n_keep: %d, n_left: %d, new_tokens: %s, num_prompt_tokens: %d",
-            n_ctx,
-            params.n_keep,
-            n_left,
-            tokens_to_str(ctx, new_tokens.cbegin(), new_tokens.cend()).c_str(),
-            new_tokens.size()
-        );
+    // Without pools attached every llama_decode starts and joins its own threads.
+    // Failing to create them only keeps it that way.
+    void createThreadpools()
+    {
+        lm_ggml_threadpool_params tpp = lm_ggml_threadpool_params_from_cpu_params(params.cpuparams);
+        lm_ggml_threadpool_params tpp_batch = lm_ggml_threadpool_params_from_cpu_params(params.cpuparams_batch);
+        // the first decode on a pool resumes it
+        tpp.paused = true;
+        tpp_batch.paused = true;
+        threadpool = lm_ggml_threadpool_new(&tpp);
+        if (threadpool != nullptr && !lm_ggml_threadpool_params_match(&tpp, &tpp_batch))
+        {
+            threadpool_batch = lm_ggml_threadpool_new(&tpp_batch);
+            if (threadpool_batch == nullptr)
+            {
+                lm_ggml_threadpool_free(threadpool);
+                threadpool = nullptr;
+            }
+        }
+        if (threadpool == nullptr)
+        {
+            LOG_WARNING("failed to create threadpools, threads are started per decode", "");
+            return;
+        }
+        llama_attach_threadpool(ctx, threadpool, threadpool_batch);
+        LOG_INFO("%s: %d threads (prio %d, poll %u) for generation, %d threads (prio %d, poll %u) for batches%s", __func__,
+                 tpp.n_threads, tpp.prio, tpp.poll, tpp_batch.n_threads, tpp_batch.prio, tpp_batch.poll,
+                 threadpool_batch ? "" : ", shared");
+    }
 
-        truncated = true;
-        prompt_tokens = new_tokens;
+    // Stop the pool a decode of n_tokens does not use from polling, or both pools
+    // with n_tokens == 0 once idle. A paused pool resumes on its next decode.
+    void pauseThreadpools(int n_tokens)
+    {
+        if (threadpool_batch == nullptr)
+        {
+            if (threadpool != nullptr && n_tokens == 0)
+            {
+                lm_ggml_threadpool_pause(threadpool);
+            }
+            return;
+        }
+        if (n_tokens != 1)
+        {
+            lm_ggml_threadpool_pause(threadpool);
+        }
+        if (n_tokens <= 1)
+        {
+            lm_ggml_threadpool_pause(threadpool_batch);
+        }
     }
 
-    void loadPrompt()
+    // Time every node computed on the CPU from now on (see lm_ggml_profile_callback),
+    // with perf counters if counters; graphs are computed as usual otherwise. Keeps at
+    // most max_trace_events per-thread events for writeTrace, 0 keeps only the totals.
+    void startProfiler(bool counters, size_t max_trace_events)
     {
-        std::vector<llama_token> prompt_tokens = ::llama_tokenize(ctx, params.prompt, true, true);
-        num_prompt_tokens = prompt_tokens.size();
+        std::lock_guard<std::mutex> lock(slots_mutex);
+        profiler.reset(new llama_rn_profiler(counters, max_trace_events));
+        llama_set_profile_callback(ctx, llama_rn_profiler::callback, profiler.get(), counters);
+    }
 
-        // LOG tokens
-        std::stringstream ss;
-        ss << "\n" << __func__ << ": prompt_tokens = ";
-        for (auto& token : prompt_tokens) {
-            ss << token << " ";
+    // The profiler with its results, owned by the caller so that a startProfiler in
+    // the meantime cannot free it. nullptr when not profiling.
+    std::unique_ptr<llama_rn_profiler> stopProfiler()
+    {
+        std::lock_guard<std::mutex> lock(slots_mutex);
+        if (profiler)
+        {
+            llama_set_profile_callback(ctx, nullptr, nullptr, false);
         }
-        LOG_INFO("%s\n", ss.str().c_str());
+        return std::move(profiler);
+    }
 
-        if (params.n_keep < 0)
+    // Under slots_mutex: a decode may grow the output buffer
+    llama_rn_memory_report memoryReport()
+    {
+        llama_rn_memory_report report;
+        std::lock_guard<std::mutex> lock(slots_mutex);
+        report_model_memory(model, params.model, report.model_bytes, report.model_mapped, report.model_resident);
+        report.model_refs = std::max(1, llama_rn_model_registry::instance().refs(model));
+        report.context = llama_get_context_memory(ctx);
+        report.kv_cells_used = llama_get_kv_cache_used_cells(ctx);
+        report.kv_cells = llama_n_ctx(ctx);
+        if (ctx_draft != nullptr)
         {
-            params.n_keep = (int)num_prompt_tokens;
+            size_t draft_mapped;
+            report_model_memory(model_draft, params.model_draft, report.draft_model_bytes, draft_mapped, report.draft_model_resident);
+            report.draft_context_bytes = context_memory_total(llama_get_context_memory(ctx_draft));
         }
-        params.n_keep = std::min(n_ctx - 4, params.n_keep);
+        report.prefix_cache_bytes = prefix_cache.n_bytes;
+        report.conversation_bytes = conversations.n_bytes.load();
+        report.lookup_cache_bytes = lookup_cache.n_bytes;
+        report.process = read_process_memory();
+        return report;
+    }
 
-        // if input prompt is too big, truncate like normal
-        if (num_prompt_tokens >= (size_t) n_ctx)
+    // A draft model that fails to load or does not share the target vocabulary
+    // only disables speculation.
+    void loadDraftModel()
+    {
+        gpt_params params_draft = params;
+        params_draft.model = params.model_draft;
+        params_draft.n_gpu_layers = params.n_gpu_layers_draft;
+        params_draft.lora_adapters.clear();
+        if (params.draft_cpuparams.n_threads > 0)
+        {
+            params_draft.cpuparams = params.draft_cpuparams;
+            params_draft.cpuparams_batch = params.draft_cpuparams_batch;
+        }
+        bool shared = false;
+        llama_init_result result = initSharedModel(params_draft, shared);
+        model_draft = result.model;
+        ctx_draft = result.context;
+        if (model_draft == nullptr || ctx_draft == nullptr)
+        {
+            LOG_ERROR("unable to load draft model: %s", params.model_draft.c_str());
+            unloadDraftModel();
+            return;
+        }
+        if (llama_vocab_type(model_draft) != llama_vocab_type(model) ||
+            llama_n_vocab(model_draft) != llama_n_vocab(model) ||
+            llama_token_bos(model_draft) != llama_token_bos(model) ||
+            llama_token_eos(model_draft) != llama_token_eos(model))
+        {
+            LOG_ERROR("draft model vocab does not match the target model, speculative decoding disabled", "");
+            unloadDraftModel();
+            return;
+        }
+        if (threadpool != nullptr && params.draft_cpuparams.n_threads <= 0)
         {
-            truncatePrompt(prompt_tokens);
-            num_prompt_tokens = prompt_tokens.size();
+            // drafting alternates with the target's decodes on the same threads
+            llama_attach_threadpool(ctx_draft, threadpool, threadpool_batch);
+        }
+        batch_draft = llama_batch_init(std::max(params.n_batch, params.n_parallel), 0, 1);
+        LOG_INFO("%s: draft model: %s, n_draft: %d", __func__, params.model_draft.c_str(), params.n_draft);
+    }
 
-            LM_GGML_ASSERT(num_prompt_tokens < (size_t) n_ctx);
+    // n_max: longest n-gram matched, 0 disables lookup. cache_path: file keeping the
+    // n-gram cache across sessions, empty to not keep one.
+    void initLookup(int n_max, const std::string &cache_path)
+    {
+        for (auto &slot : slots)
+        {
+            slot->lookup.clear();
+            slot->lookup.n_max = std::max(0, n_max);
+            slot->lookup.n_min = std::min(slot->lookup.n_min, slot->lookup.n_max);
+        }
+        lookup_cache_path = n_max > 0 ? cache_path : "";
+        lookup_cache.n = lookup_cache_path.empty() ? 0 : n_max;
+        if (lookup_cache.enabled() && lookup_cache.load(lookup_cache_path))
+        {
+            LOG_INFO("%s: loaded %zu n-grams (%zu bytes) from %s", __func__, lookup_cache.counts.size(), lookup_cache.n_bytes,
+                     lookup_cache_path.c_str());
         }
+    }
 
-        // do Context Shift , may be buggy! TODO: Verify functionality
-        if(!params.embedding){
-            purge_missing_tokens(ctx, embd, prompt_tokens, params.n_predict, params.n_ctx);
+    bool saveLookupCache()
+    {
+        std::lock_guard<std::mutex> lock(slots_mutex);
+        if (!lookup_cache.enabled())
+        {
+            return false;
         }
+        return lookup_cache.save(lookup_cache_path);
+    }
 
-        // push the prompt into the sampling context (do not apply grammar)
-        for (auto & token : prompt_tokens)
+    void unloadDraftModel()
+    {
+        if (ctx_draft)
         {
-           gpt_sampler_accept(ctx_sampling, token, false);
+            llama_free(ctx_draft);
+            ctx_draft = nullptr;
         }
-        // compare the evaluated prompt with the new prompt
-        n_past = params.embedding? 0 :  common_part(embd, prompt_tokens);
-        LOG_INFO("%s:        n_past: %zu", __func__,  n_past);
-        LOG_INFO("%s:        embd size: %zu", __func__,  embd.size());
-        LOG_INFO("%s:        prompt_tokens size: %zu", __func__,  prompt_tokens.size());
-        embd = prompt_tokens;
-        if (n_past == num_prompt_tokens)
+        if (model_draft)
         {
-            // we have to evaluate at least 1 token to generate logits.
-            n_past--;
+            llama_rn_model_registry::instance().release(model_draft);
+            model_draft = nullptr;
         }
+    }
 
-        // since #3228 we now have to manually manage the KV cache
-        llama_kv_cache_seq_rm(ctx, 0, n_past, -1);
+    void appendTokenPiece(std::string &out, llama_token tok) const
+    {
+        if (tok >= 0 && (size_t) tok + 1 < vocab_piece_offsets.size())
+        {
+            out.append(vocab_pieces, vocab_piece_offsets[tok], vocab_piece_offsets[tok + 1] - vocab_piece_offsets[tok]);
+        }
+    }
 
-        LOG_VERBOSE("prompt ingested, n_past: %d, cached: %s, to_eval: %s",
-            n_past,
-            tokens_to_str(ctx, embd.cbegin(), embd.cbegin() + n_past).c_str(),
-            tokens_to_str(ctx, embd.cbegin() + n_past, embd.cend()).c_str()
-        );
+    std::string tokenPiece(llama_token tok) const
+    {
+        std::string out;
+        appendTokenPiece(out, tok);
+        return out;
+    }
+
+    bool validateModelChatTemplate() const {
+        llama_chat_message chat[] = {{"user", "test"}};
 
-        has_next_token = true;
+        std::vector<char> model_template(2048, 0); // longest known template is about 1200 bytes
+        std::string template_key = "tokenizer.chat_template";
+        int32_t res = llama_model_meta_val_str(model, template_key.c_str(), model_template.data(), model_template.size());
+
+        return res >= 0;
     }
 
-    void beginCompletion()
+    bool isPredicting() const
     {
-        // number of tokens to keep when resetting context
-        n_remain = params.n_predict;
-        llama_perf_context_reset(ctx);
-        is_predicting = true;
+        return is_predicting || n_processing > 0;
     }
 
-    completion_token_output nextToken()
+    // Stops everything on the context: every slot and the jobs that take the whole
+    // cache. Requests are stopped one at a time with interruptSlot.
+    void interrupt()
     {
-        completion_token_output result;
-        result.tok = -1;
+        is_interrupted = true;
+        for (auto &slot : slots)
+        {
+            slot->is_interrupted = true;
+        }
+    }
+
+    // Stop the request of slot_id, the slot and its forks, from any thread: the other
+    // requests sharing the context keep decoding. Takes effect at the next scheduler
+    // step. False when the slot is idle.
+    bool interruptSlot(int slot_id)
+    {
+        std::lock_guard<std::mutex> lock(slots_mutex);
+        if (slot_id < 0 || slot_id >= (int) slots.size() || slots[slot_id]->state != SLOT_STATE_PROCESSING)
+        {
+            return false;
+        }
+        llama_rn_slot &slot = *slots[slot_id];
+        slot.is_interrupted = true;
+        for (llama_rn_slot *fork : slot.forks)
+        {
+            fork->is_interrupted = true;
+        }
+        // a stream waiting for room in its queue ends without being drained
+        worker.wake();
+        return true;
+    }
 
-        // this truncation should never trigger with good context shifting
-        if (embd.size() >= (size_t)params.n_ctx)
+    // Polled by the CPU backend between graph nodes: a batch whose slots were all
+    // interrupted is abandoned mid-graph instead of being computed to the end.
+    static bool abortDecode(void *data)
+    {
+        const llama_rn_context *llama = (const llama_rn_context *) data;
+        if (!llama->is_decoding)
+        {
+            return false;
+        }
+        for (const auto &slot : llama->slots)
         {
+            if (slot->n_eval > 0 && !slot->is_interrupted)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
 
-            const int n_left    = n_past - params.n_keep - 1;
-            const int n_discard = n_left/2;
+    // Reserve an idle slot for a new request, preferring the one whose cached
+    // tokens share the longest prefix with the prompt. Returns nullptr when busy.
+    llama_rn_slot *acquireSlot(const std::string &prompt)
+    {
+        std::vector<llama_token> prompt_tokens = ::llama_tokenize(ctx, prompt, true, true);
 
-            llama_kv_cache_seq_rm (ctx, 0, params.n_keep + 1            , params.n_keep + n_discard + 1);
-            llama_kv_cache_seq_add(ctx, 0, params.n_keep + 1 + n_discard, n_past, -n_discard);
+        std::lock_guard<std::mutex> lock(slots_mutex);
+        if (is_predicting)
+        {
+            return nullptr;
+        }
+        llama_rn_slot *best = nullptr;
+        size_t best_lcp = 0;
+        for (auto &slot : slots)
+        {
+            if (slot->state != SLOT_STATE_IDLE)
+            {
+                continue;
+            }
+            const size_t lcp = params.embedding ? 0 : common_part(slot->embd, prompt_tokens);
+            if (best == nullptr || lcp > best_lcp ||
+                (lcp == best_lcp && slot->t_last_used < best->t_last_used))
+            {
+                best = slot.get();
+                best_lcp = lcp;
+            }
+        }
+        if (best == nullptr)
+        {
+            return nullptr;
+        }
+        best->state = SLOT_STATE_PROCESSING;
+        best->params = params;
+        best->params.prompt = prompt;
+        best->rewind();
+        best->prompt_tokens = prompt_tokens;
+        n_processing++;
+        LOG_VERBOSE("slot %d acquired, cached prefix: %zu", best->id, best_lcp);
+        return best;
+    }
+
+    // Reserve n idle slots as forks of slot, for n-best completions of its prompt.
+    // Forks are configured like slot (with seeds of their own) and stay out of the
+    // scheduler until forkSlots hands them the decoded prompt. Returns false, reserving
+    // nothing, when fewer than n slots are idle.
+    bool acquireForks(llama_rn_slot &slot, int n)
+    {
+        std::lock_guard<std::mutex> lock(slots_mutex);
+        std::vector<llama_rn_slot *> idle;
+        for (auto &other : slots)
+        {
+            if (other->state == SLOT_STATE_IDLE)
+            {
+                idle.push_back(other.get());
+            }
+        }
+        if ((int) idle.size() < n)
+        {
+            return false;
+        }
+        // the cached tokens of the least recently used slots are the least likely to be reused
+        std::sort(idle.begin(), idle.end(), [](const llama_rn_slot *a, const llama_rn_slot *b) {
+            return a->t_last_used < b->t_last_used;
+        });
+        for (int i = 0; i < n; i++)
+        {
+            llama_rn_slot *fork = idle[i];
+            fork->state = SLOT_STATE_PROCESSING;
+            fork->params = slot.params;
+            fork->params.sparams.seed = slot.params.sparams.seed + i + 1;
+            fork->rewind();
+            fork->prompt_tokens = slot.prompt_tokens;
+            fork->stop_token_triggers = slot.stop_token_triggers;
+            slot.forks.push_back(fork);
+            n_processing++;
+        }
+        LOG_VERBOSE("slot %d acquired %d forks", slot.id, n);
+        return true;
+    }
+
+    // Continue the slot's decoded prompt in each of its forks. The KV cells are
+    // shared, not copied (seq_cp adds the fork's sequence to them), and every fork
+    // samples its first token from the slot's prompt logits. Samplers are not cloned:
+    // a clone would share the slot's random state, so the forks' samplers, seeded
+    // differently, are fed the same prompt. Called with slots_mutex held.
+    void forkSlots(llama_rn_slot &slot)
+    {
+        const int64_t t_now = llama_time_us();
+        for (llama_rn_slot *fork : slot.forks)
+        {
+            if (fork->is_interrupted)
+            {
+                continue;
+            }
+            llama_kv_cache_seq_rm(ctx, fork->id, 0, -1);
+            llama_kv_cache_seq_cp(ctx, slot.id, fork->id, 0, slot.n_past);
+            fork->embd.assign(slot.embd.begin(), slot.embd.begin() + slot.n_past);
+            fork->n_past = slot.n_past;
+            fork->lookup.clear();
+            for (llama_token tok : fork->embd)
+            {
+                gpt_sampler_accept(fork->ctx_sampling, tok, false);
+            }
+
+            fork->num_prompt_tokens = slot.num_prompt_tokens;
+            fork->truncated = slot.truncated;
+            fork->n_restored = slot.n_restored;
+            fork->n_prompt_processed = slot.n_prompt_processed;
+            fork->t_start_prompt = slot.t_start_prompt;
+            fork->t_prompt_processing = slot.t_prompt_processing;
+            fork->t_start_generation = t_now;
+            fork->is_generating = true;
+            fork->has_next_token = true;
+
+            const completion_token_output result = sampleToken(*fork, slot.i_batch);
+            gpt_sampler_accept(fork->ctx_sampling, result.tok, true);
+            pushToken(*fork, result);
+        }
+    }
+
+    void startBeams(llama_rn_slot &slot)
+    {
+        std::vector<llama_seq_id> seq_ids(1, slot.id);
+        for (const llama_rn_slot *fork : slot.forks)
+        {
+            seq_ids.push_back(fork->id);
+        }
+        llama_rn_beam_search &search = *slot.beam_search;
+        search.init(ctx, seq_ids, slot.n_past, search.params);
+        search.expand(ctx, [this, &slot](size_t) { return llama_get_logits_ith(ctx, slot.i_batch); },
+                      [this](llama_token tok) { return llama_token_is_eog(model, tok); },
+                      [this](llama_token tok) { return tokenPiece(tok); }, slot.n_ctx);
+        slot.is_generating = false;
+    }
+
+    // Run the beam search of a slot whose prompt doCompletion has decoded: every step
+    // is one llama_decode of the last token of all live beams, under slots_mutex so
+    // that other slots keep going between steps. The slot and its forks keep only the
+    // prompt in their sequences afterwards. Returns the best beams, best first.
+    std::vector<llama_rn_beam> beamSearch(llama_rn_slot &slot)
+    {
+        llama_rn_beam_search &search = *slot.beam_search;
+        if (slot.t_start_generation == 0)
+        {
+            return std::vector<llama_rn_beam>(); // the prompt was not decoded
+        }
+        while (!search.is_done && !slot.is_interrupted)
+        {
+            std::lock_guard<std::mutex> lock(slots_mutex);
+            search.fillBatch(batch);
+            slot.n_eval = batch.n_tokens; // interrupting the slot aborts the decode, see abortDecode
+            llama_kv_cache_update(ctx);
+            is_decoding = true;
+            const int ret = llama_decode(ctx, batch);
+            is_decoding = false;
+            slot.n_eval = 0;
+            if (ret != 0)
+            {
+                if (ret != 2)
+                {
+                    LOG_ERROR("failed to eval beams, slot: %d, n_beams: %d", slot.id, batch.n_tokens);
+                }
+                break;
+            }
+            search.expand(ctx, [this](size_t i) { return llama_get_logits_ith(ctx, i); },
+                          [this](llama_token tok) { return llama_token_is_eog(model, tok); },
+                          [this](llama_token tok) { return tokenPiece(tok); }, slot.n_ctx);
+            slot.n_decoded++;
+            slot.t_token_generation = (llama_time_us() - slot.t_start_generation) / 1e3;
+        }
+
+        std::lock_guard<std::mutex> lock(slots_mutex);
+        const size_t n_prompt = search.n_prompt;
+        slot.embd.resize(n_prompt);
+        slot.n_past = n_prompt;
+        llama_kv_cache_seq_rm(ctx, slot.id, n_prompt, -1);
+        for (llama_rn_slot *fork : slot.forks)
+        {
+            fork->embd = slot.embd;
+            fork->n_past = n_prompt;
+            llama_kv_cache_seq_rm(ctx, fork->id, n_prompt, -1);
+        }
+        std::vector<llama_rn_beam> results = search.results();
+        if (!results.empty())
+        {
+            slot.generated_text = results[0].text;
+            slot.num_tokens_predicted = results[0].tokens.size();
+        }
+        return results;
+    }
+
+    void releaseSlot(llama_rn_slot &slot)
+    {
+        {
+            std::lock_guard<std::mutex> lock(slots_mutex);
+            // sampled tokens that never went through llama_decode are not in the KV cache
+            slot.embd.resize(std::min(slot.embd.size(), slot.n_past));
+            if (!slot.params.embedding)
+            {
+                lookup_cache.update(slot.embd);
+                saveConversation(slot);
+            }
+            slot.pending.clear();
+            slot.has_next_token = false;
+            slot.is_generating = false;
+            slot.t_last_used = llama_time_us();
+            slot.state = SLOT_STATE_IDLE;
+            if (--n_processing == 0)
+            {
+                pauseThreadpools(0);
+            }
+        }
+        // spilling compresses and writes files, the slots go on meanwhile
+        if (conversations.enabled())
+        {
+            conversations.trim();
+        }
+    }
+
+    bool initSampling(llama_rn_slot &slot) {
+        if (slot.ctx_sampling != nullptr) {
+            gpt_sampler_free(slot.ctx_sampling);
+        }
+        slot.ctx_sampling = gpt_sampler_init(model, slot.params.sparams);
+        slot.rng.seed(slot.params.sparams.seed);
+        if (slot.ctx_sampling_draft != nullptr) {
+            gpt_sampler_free(slot.ctx_sampling_draft);
+            slot.ctx_sampling_draft = nullptr;
+        }
+        if (model_draft != nullptr) {
+            // proposals only have to be likely, the target sampler enforces penalties and grammar;
+            // a top-10 softmax gives greedy drafting a confidence to stop on
+            gpt_sampler_params sparams_draft = slot.params.sparams;
+            sparams_draft.grammar.clear();
+            sparams_draft.penalty_last_n = 0;
+            sparams_draft.n_probs = 10;
+            slot.ctx_sampling_draft = gpt_sampler_init(model_draft, sparams_draft);
+        }
+        return slot.ctx_sampling != nullptr;
+    }
+
+    void truncatePrompt(llama_rn_slot &slot, std::vector<llama_token> &prompt_tokens) {
+        const int n_left = slot.n_ctx - slot.params.n_keep;
+        const int n_block_size = n_left / 2;
+        const int erased_blocks = (prompt_tokens.size() - slot.params.n_keep - n_block_size) / n_block_size;
+
+        // Keep n_keep tokens at start of prompt (at most n_ctx - 4)
+        std::vector<llama_token> new_tokens(prompt_tokens.begin(), prompt_tokens.begin() + slot.params.n_keep);
+
+        new_tokens.insert(new_tokens.end(), prompt_tokens.begin() + slot.params.n_keep + erased_blocks * n_block_size, prompt_tokens.end());
+
+        LOG_VERBOSE("input truncated, n_ctx: %d, n_keep: %d, n_left: %d, new_tokens: %s, num_prompt_tokens: %d",
+            slot.n_ctx,
+            slot.params.n_keep,
+            n_left,
+            tokens_to_str(ctx, new_tokens.cbegin(), new_tokens.cend()).c_str(),
+            new_tokens.size()
+        );
+
+        slot.truncated = true;
+        prompt_tokens = new_tokens;
+    }
+
+    void loadPrompt(llama_rn_slot &slot)
+    {
+        std::vector<llama_token> prompt_tokens = slot.prompt_tokens;
+        slot.num_prompt_tokens = prompt_tokens.size();
+
+        // LOG tokens
+        std::stringstream ss;
+        ss << "\n" << __func__ << ": prompt_tokens = ";
+        for (auto& token : prompt_tokens) {
+            ss << token << " ";
+        }
+        LOG_INFO("%s\n", ss.str().c_str());
+
+        if (slot.params.n_keep < 0)
+        {
+            slot.params.n_keep = (int)slot.num_prompt_tokens;
+        }
+        slot.params.n_keep = std::min(slot.n_ctx - 4, slot.params.n_keep);
+
+        // if input prompt is too big, truncate like normal
+        if (slot.num_prompt_tokens >= (size_t) slot.n_ctx)
+        {
+            truncatePrompt(slot, prompt_tokens);
+            slot.num_prompt_tokens = prompt_tokens.size();
+
+            LM_GGML_ASSERT(slot.num_prompt_tokens < (size_t) slot.n_ctx);
+        }
+
+        // push the prompt into the sampling context (do not apply grammar)
+        for (auto & token : prompt_tokens)
+        {
+           gpt_sampler_accept(slot.ctx_sampling, token, false);
+        }
+
+        if (!slot.params.embedding)
+        {
+            prefetchConversation(slot, prompt_tokens);
+        }
+
+        std::lock_guard<std::mutex> lock(slots_mutex);
+
+        if (!slot.params.embedding)
+        {
+            restoreConversation(slot, prompt_tokens);
+        }
+
+        // do Context Shift , may be buggy! TODO: Verify functionality
+        if(!slot.params.embedding){
+            purge_missing_tokens(ctx, slot.id, slot.embd, prompt_tokens, slot.params.n_predict, slot.n_ctx);
+        }
+
+        // compare the evaluated prompt with the new prompt
+        slot.n_past = slot.params.embedding? 0 :  common_part(slot.embd, prompt_tokens);
+        if (!slot.params.embedding)
+        {
+            restorePrefix(slot, prompt_tokens);
+        }
+        LOG_INFO("%s: slot %d n_past: %zu", __func__, slot.id, slot.n_past);
+        LOG_INFO("%s:        embd size: %zu", __func__,  slot.embd.size());
+        LOG_INFO("%s:        prompt_tokens size: %zu", __func__,  prompt_tokens.size());
+        slot.embd = prompt_tokens;
+        slot.lookup.clear();
+        if (slot.n_past == slot.num_prompt_tokens)
+        {
+            // we have to evaluate at least 1 token to generate logits.
+            slot.n_past--;
+        }
+
+        // since #3228 we now have to manually manage the KV cache
+        llama_kv_cache_seq_rm(ctx, slot.id, slot.n_past, -1);
+
+        LOG_VERBOSE("prompt ingested, n_past: %d, cached: %s, to_eval: %s",
+            slot.n_past,
+            tokens_to_str(ctx, slot.embd.cbegin(), slot.embd.cbegin() + slot.n_past).c_str(),
+            tokens_to_str(ctx, slot.embd.cbegin() + slot.n_past, slot.embd.cend()).c_str()
+        );
+
+        slot.n_prompt_processed = slot.embd.size() - slot.n_past;
+        slot.t_start_prompt = llama_time_us();
+        slot.is_generating = true;
+        slot.has_next_token = true;
+    }
+
+    // Read the slot's conversation back from its spill file when restoreConversation
+    // is going to use it, before loadPrompt takes slots_mutex. The slot's tokens are
+    // its owner's until loadPrompt is done.
+    void prefetchConversation(llama_rn_slot &slot, const std::vector<llama_token> &prompt_tokens)
+    {
+        if (slot.conversation_id.empty() || !conversations.enabled())
+        {
+            return;
+        }
+        std::vector<llama_token> tokens;
+        llama_rn_conversation_store::state_ptr state;
+        if (!conversations.get(slot.conversation_id, llama_time_us(), tokens, state) || state ||
+            common_part(tokens, prompt_tokens) <= common_part(slot.embd, prompt_tokens))
+        {
+            return;
+        }
+        if (!conversations.prefetch(slot.conversation_id, llama_time_us()))
+        {
+            LOG_WARNING("slot %d: conversation %s could not be read back", slot.id, slot.conversation_id.c_str());
+        }
+    }
+
+    // Replace the slot's sequence with the snapshot of its conversation when that
+    // shares more of the prompt than the slot's own tokens (the conversation moved
+    // to another slot, or the slot served other conversations since). Called with
+    // slots_mutex held, so only a snapshot in RAM is used, see prefetchConversation.
+    void restoreConversation(llama_rn_slot &slot, const std::vector<llama_token> &prompt_tokens)
+    {
+        if (slot.conversation_id.empty() || !conversations.enabled())
+        {
+            return;
+        }
+        std::vector<llama_token> tokens;
+        llama_rn_conversation_store::state_ptr state;
+        if (!conversations.get(slot.conversation_id, llama_time_us(), tokens, state))
+        {
+            return;
+        }
+        const size_t n_shared = common_part(slot.embd, prompt_tokens);
+        const size_t n_tokens = common_part(tokens, prompt_tokens);
+        if (n_tokens <= n_shared)
+        {
+            return;
+        }
+        if (!state)
+        {
+            LOG_WARNING("slot %d: conversation %s was spilled again, the prompt is decoded", slot.id, slot.conversation_id.c_str());
+            return;
+        }
+        if (llama_state_seq_set_data(ctx, state->data(), state->size(), slot.id) == 0)
+        {
+            LOG_WARNING("slot %d: failed to restore conversation %s", slot.id, slot.conversation_id.c_str());
+            llama_kv_cache_seq_rm(ctx, slot.id, 0, -1);
+            slot.embd.clear();
+            slot.n_past = 0;
+            return;
+        }
+        // loadPrompt trims the sequence to the part shared with the prompt
+        slot.embd = tokens;
+        slot.n_restored = n_tokens - n_shared;
+        LOG_INFO("%s: slot %d restored %zu tokens of conversation %s", __func__, slot.id, n_tokens, slot.conversation_id.c_str());
+    }
+
+    // Snapshot the slot's sequence into its conversation. Called with slots_mutex
+    // held, once the slot's tokens are trimmed to the KV cache: only copies the
+    // state, releaseSlot trims the store once the lock is released.
+    void saveConversation(llama_rn_slot &slot)
+    {
+        if (slot.conversation_id.empty() || !conversations.enabled() || slot.embd.empty())
+        {
+            return;
+        }
+        std::vector<uint8_t> state(llama_state_seq_get_size(ctx, slot.id));
+        state.resize(llama_state_seq_get_data(ctx, state.data(), state.size(), slot.id));
+        conversations.put(slot.conversation_id, slot.embd, std::move(state), llama_time_us());
+        LOG_VERBOSE("slot %d saved %zu tokens of conversation %s, store size: %zu bytes", slot.id, slot.embd.size(), slot.conversation_id.c_str(), conversations.n_bytes.load());
+    }
+
+    struct session_checkpoint
+    {
+        size_t n_tokens = 0;  // tokens in the session file
+        size_t n_added = 0;   // tokens in the appended record
+        size_t n_written = 0; // bytes
+        bool rewritten = false; // the file was started over
+    };
+
+    // Save the first slot into the session file at path (see rn-session.hpp): the
+    // records matching the slot's tokens are kept and one record with the rest is
+    // appended, so only the KV cells decoded since the last checkpoint are written.
+    // Only reading the cells holds slots_mutex.
+    bool checkpointSession(const std::string &path, uint32_t flags, session_checkpoint &out, std::string &error)
+    {
+        session_index index;
+        FILE *fp = std::fopen(path.c_str(), "rb");
+        if (fp != nullptr)
+        {
+            if (!session_read_index(fp, fingerprint, index))
+            {
+                index = session_index();
+            }
+            std::fclose(fp);
+        }
+        std::vector<llama_token> tokens;
+        std::vector<uint8_t> state;
+        size_t n_keep = 0;
+        size_t n_from = 0;
+        {
+            std::lock_guard<std::mutex> lock(slots_mutex);
+            const llama_rn_slot &slot = *slots[0];
+            tokens.assign(slot.embd.begin(), slot.embd.begin() + std::min(slot.embd.size(), (size_t) slot.n_past));
+            const size_t n_shared = common_part(index.tokens, tokens);
+            while (n_keep < index.records.size() && index.records[n_keep].n_tokens_end <= n_shared)
+            {
+                n_keep++;
+            }
+            n_from = n_keep > 0 ? index.records[n_keep - 1].n_tokens_end : 0;
+            if (n_keep == index.records.size() && n_from == tokens.size() && index.header_end > 0)
+            {
+                out.n_tokens = tokens.size();
+                return true;
+            }
+            state.resize(llama_state_seq_get_size_range(ctx, 0, n_from, tokens.size()));
+            state.resize(llama_state_seq_get_data_range(ctx, state.data(), state.size(), 0, n_from, tokens.size()));
+        }
+        // cells are selected by position: after a context shift they no longer match the tokens
+        uint32_t n_cells = 0;
+        if (state.size() >= sizeof(n_cells))
+        {
+            memcpy(&n_cells, state.data(), sizeof(n_cells));
+        }
+        if (n_cells != tokens.size() - n_from)
+        {
+            error = "KV cache positions do not match the session tokens";
+            return false;
+        }
+        out.n_written = session_append(path, fingerprint, index, n_keep, tokens.data() + n_from, tokens.size() - n_from, state, flags);
+        if (out.n_written == 0)
+        {
+            error = "Failed to write session";
+            return false;
+        }
+        out.n_tokens = tokens.size();
+        out.n_added = tokens.size() - n_from;
+        out.rewritten = index.header_end == 0;
+        LOG_VERBOSE("%s: kept %zu records, appended %zu tokens in %zu bytes", __func__, n_keep, out.n_added, out.n_written);
+        return true;
+    }
+
+    // Load a session file into the first slot, the other slots are cleared like by
+    // llama_state_load_file. Both formats are read from a mapping of the file, so the
+    // KV data is copied once, from the page cache into the cache tensors. Called
+    // while no completion runs.
+    bool loadSession(const std::string &path, std::string &error)
+    {
+        session_mapping mapping(path);
+        if (mapping.data == nullptr)
+        {
+            error = "Failed to open session";
+            return false;
+        }
+        uint32_t magic = 0;
+        if (mapping.size >= sizeof(magic))
+        {
+            memcpy(&magic, mapping.data, sizeof(magic));
+        }
+        std::lock_guard<std::mutex> lock(slots_mutex);
+        llama_kv_cache_clear(ctx);
+        for (auto &slot : slots)
+        {
+            slot->embd.clear();
+            slot->n_past = 0;
+        }
+        const bool ok = magic == SESSION_MAGIC ? restoreSession(path, mapping, error) : restoreStateFile(mapping, error);
+        if (!ok)
+        {
+            llama_kv_cache_clear(ctx);
+            slots[0]->embd.clear();
+            slots[0]->n_past = 0;
+        }
+        return ok;
+    }
+
+    // checkpointSession format: uncompressed records go to the KV cache straight
+    // from the mapping, the others are decoded from it
+    bool restoreSession(const std::string &path, const session_mapping &mapping, std::string &error)
+    {
+        session_index index;
+        FILE *fp = std::fopen(path.c_str(), "rb");
+        const bool valid = fp != nullptr && session_read_index(fp, fingerprint, index);
+        if (fp != nullptr)
+        {
+            std::fclose(fp);
+        }
+        if (!valid)
+        {
+            error = "Session was saved with another model or KV cache layout";
+            return false;
+        }
+        if (index.tokens.size() > (size_t) slots[0]->n_ctx)
+        {
+            error = "Session does not fit in the context";
+            return false;
+        }
+        std::vector<uint8_t> state;
+        for (const session_record &record : index.records)
+        {
+            // the file may have changed since it was indexed
+            if (record.end_offset > (long) mapping.size)
+            {
+                error = "Failed to load session";
+                return false;
+            }
+            const uint8_t *payload = mapping.data + record.payload_offset;
+            if (record.flags == 0)
+            {
+                if (record.n_payload != record.n_state ||
+                    llama_state_seq_add_data(ctx, payload, record.n_payload, 0) != record.n_payload)
+                {
+                    error = "Failed to load session";
+                    return false;
+                }
+                continue;
+            }
+            if (!session_decode(payload, record.n_payload, record, state) ||
+                llama_state_seq_add_data(ctx, state.data(), state.size(), 0) != state.size())
+            {
+                error = "Failed to load session";
+                return false;
+            }
+        }
+        slots[0]->embd = index.tokens;
+        slots[0]->n_past = index.tokens.size();
+        return true;
+    }
+
+    // llama_state_save_file format: u32 magic, u32 version, u32 n_tokens, tokens, state
+    bool restoreStateFile(const session_mapping &mapping, std::string &error)
+    {
+        uint32_t header[3];
+        if (mapping.size < sizeof(header))
+        {
+            error = "Failed to load session";
+            return false;
+        }
+        memcpy(header, mapping.data, sizeof(header));
+        if (header[0] != LLAMA_SESSION_MAGIC || header[1] != LLAMA_SESSION_VERSION)
+        {
+            error = "Unknown session file version";
+            return false;
+        }
+        const size_t n_header = sizeof(header) + (size_t) header[2] * sizeof(llama_token);
+        // the tokens go to slot 0, within its share of the context
+        if (header[2] > (uint32_t) slots[0]->n_ctx || n_header > mapping.size)
+        {
+            error = "Session does not fit in the context";
+            return false;
+        }
+        const size_t n_state = mapping.size - n_header;
+        if (llama_state_set_data(ctx, mapping.data + n_header, n_state) != n_state)
+        {
+            error = "Failed to load session";
+            return false;
+        }
+        std::vector<llama_token> &embd = slots[0]->embd;
+        embd.resize(header[2]);
+        memcpy(embd.data(), mapping.data + sizeof(header), header[2] * sizeof(llama_token));
+        slots[0]->n_past = embd.size();
+        return true;
+    }
+
+    // Replace the slot's sequence with a cached snapshot when it covers more of
+    // the prompt than the tokens already in the slot. Called with slots_mutex held.
+    void restorePrefix(llama_rn_slot &slot, const std::vector<llama_token> &prompt_tokens)
+    {
+        if (!prefix_cache.enabled())
+        {
+            return;
+        }
+        const llama_rn_prefix_cache::match match = prefix_cache.find(prompt_tokens);
+        if (match.snapshot == nullptr || match.n_tokens < slot.n_past + prefix_cache.n_min_tokens)
+        {
+            return;
+        }
+        const std::vector<uint8_t> &state = match.snapshot->state;
+        if (llama_state_seq_set_data(ctx, state.data(), state.size(), slot.id) == 0)
+        {
+            LOG_WARNING("slot %d: failed to restore cached prefix of %zu tokens", slot.id, match.snapshot->depth);
+            slot.embd.clear();
+            slot.n_past = 0;
+            return;
+        }
+        prefix_cache.touch(match.snapshot, llama_time_us());
+        // the snapshot may extend past the shared prefix, the caller trims the sequence to n_past
+        slot.n_restored = match.n_tokens - slot.n_past;
+        slot.n_past = match.n_tokens;
+        LOG_INFO("%s: slot %d restored %zu cached prompt tokens", __func__, slot.id, match.n_tokens);
+    }
+
+    // Snapshot the slot's sequence once its prompt is fully decoded, unless the
+    // cache can already provide the whole prompt. Called with slots_mutex held.
+    void cachePrefix(llama_rn_slot &slot)
+    {
+        if (!prefix_cache.enabled() || slot.n_past < prefix_cache.n_min_tokens)
+        {
+            return;
+        }
+        const std::vector<llama_token> tokens(slot.embd.begin(), slot.embd.begin() + slot.n_past);
+        if (prefix_cache.find(tokens).n_tokens >= tokens.size())
+        {
+            return;
+        }
+        std::vector<uint8_t> state(llama_state_seq_get_size(ctx, slot.id));
+        if (state.size() > prefix_cache.n_bytes_max)
+        {
+            return;
+        }
+        state.resize(llama_state_seq_get_data(ctx, state.data(), state.size(), slot.id));
+        prefix_cache.insert(tokens, std::move(state), llama_time_us());
+        LOG_VERBOSE("slot %d cached %zu prompt tokens, cache size: %zu bytes", slot.id, tokens.size(), prefix_cache.n_bytes);
+    }
+
+    void beginCompletion(llama_rn_slot &slot)
+    {
+        // number of tokens to keep when resetting context
+        slot.n_remain = slot.params.n_predict;
+
+        std::vector<std::vector<llama_token>> token_words;
+        if (slot.stop_token_triggers)
+        {
+            for (const std::string &word : slot.params.antiprompt)
+            {
+                token_words.push_back(::llama_tokenize(ctx, word, false, true));
+            }
+        }
+        slot.stop_matcher.init(slot.params.antiprompt, token_words);
+    }
+
+    // this truncation should never trigger with good context shifting
+    void contextShift(llama_rn_slot &slot)
+    {
+        const int n_left    = slot.n_past - slot.params.n_keep - 1;
+        const int n_discard = n_left/2;
+
+        llama_kv_cache_seq_rm (ctx, slot.id, slot.params.n_keep + 1            , slot.params.n_keep + n_discard + 1);
+        llama_kv_cache_seq_add(ctx, slot.id, slot.params.n_keep + 1 + n_discard, slot.n_past, -n_discard);
+
+        for (size_t i = slot.params.n_keep + 1 + n_discard; i < slot.embd.size(); i++)
+        {
+            slot.embd[i - n_discard] = slot.embd[i];
+        }
+        slot.embd.resize(slot.embd.size() - n_discard);
+        slot.lookup.clear();
+
+        slot.n_past -= n_discard;
+
+        LOG_VERBOSE("input truncated, n_ctx: %d, n_keep: %d, n_left: %d, new_tokens: %s",
+            slot.n_ctx,
+            slot.params.n_keep,
+            n_left
+        );
+    }
+
+    // One scheduler step, called with slots_mutex held: the next token of every
+    // generating slot (plus its draft) and as many pending prompt tokens as fit in
+    // n_batch go into a single llama_decode. Returns false if there was nothing to decode.
+    bool updateSlots()
+    {
+        draftTokens();
+
+        llama_batch_clear(&batch);
+        const int n_batch = std::max(params.n_batch, params.n_parallel);
+        const int n_ubatch = std::max(1, std::min(params.n_ubatch, n_batch));
+
+        // generating slots first, so that long prompts do not stall token streams
+        for (int pass = 0; pass < 2; pass++)
+        {
+            // prompts only fill up the ubatch the generating tokens end in, so every step
+            // is a single graph compute: progress is reported and interrupts are seen per ubatch
+            const int n_limit = pass == 0 ? n_batch : std::min(n_batch, (batch.n_tokens / n_ubatch + 1) * n_ubatch);
+            for (auto &slot_ptr : slots)
+            {
+                llama_rn_slot &slot = *slot_ptr;
+                if (!slot.isReady() || slot.n_eval > 0)
+                {
+                    continue;
+                }
+                const bool is_generating = slot.embd.size() - slot.n_past == 1;
+                if (is_generating != (pass == 0))
+                {
+                    continue;
+                }
+                if (slot.embd.size() >= (size_t) slot.n_ctx)
+                {
+                    slot.draft.clear();
+                    slot.draft_q.clear();
+                    contextShift(slot);
+                }
+                const int n_eval = std::min((int) (slot.embd.size() - slot.n_past), n_limit - batch.n_tokens);
+                if (n_eval <= 0)
+                {
+                    continue;
+                }
+                const bool is_last = slot.n_past + n_eval == slot.embd.size();
+                for (int i = 0; i < n_eval; i++)
+                {
+                    llama_batch_add(&batch, slot.embd[slot.n_past + i], slot.n_past + i, {slot.id}, is_last && i == n_eval - 1);
+                }
+                slot.n_eval = n_eval;
+                slot.i_batch = is_last ? batch.n_tokens - 1 : -1;
+
+                // the draft is verified by the logits that follow the slot's last token
+                const size_t n_draft = std::min(slot.draft.size(), (size_t) std::max(0, n_batch - batch.n_tokens));
+                slot.draft.resize(n_draft);
+                slot.draft_q.resize(std::min(slot.draft_q.size(), n_draft));
+                for (size_t i = 0; i < n_draft; i++)
+                {
+                    llama_batch_add(&batch, slot.draft[i], slot.n_past + n_eval + i, {slot.id}, true);
+                }
+                slot.n_eval += n_draft;
+            }
+        }
+
+        if (batch.n_tokens == 0)
+        {
+            return false;
+        }
+
+        // pending K-shifts touch every sequence, apply them before the decode becomes abortable
+        llama_kv_cache_update(ctx);
+        pauseThreadpools(batch.n_tokens);
+        is_decoding = true;
+        const int ret = llama_decode(ctx, batch);
+        is_decoding = false;
+
+        for (auto &slot_ptr : slots)
+        {
+            llama_rn_slot &slot = *slot_ptr;
+            if (slot.n_eval == 0)
+            {
+                continue;
+            }
+            const int32_t n_eval = slot.n_eval;
+            slot.n_eval = 0;
+            if (ret == 2)
+            {
+                // aborted: the KV cells past n_past are dropped when the slot is reused
+                LOG_INFO("decode aborted, slot: %d, n_eval: %d, n_past: %zu", slot.id, n_eval, slot.n_past);
+                slot.is_generating = false;
+                slot.draft.clear();
+                slot.draft_q.clear();
+                continue;
+            }
+            if (ret != 0)
+            {
+                LOG_ERROR("failed to eval, slot: %d, n_eval: %d, n_past: %d, n_threads: %d, embd: %s",
+                    slot.id,
+                    n_eval,
+                    slot.n_past,
+                    params.cpuparams.n_threads,
+                    tokens_to_str(ctx, slot.embd.cbegin() + slot.n_past, slot.embd.cend()).c_str()
+                );
+                slot.is_generating = false;
+                slot.draft.clear();
+                slot.draft_q.clear();
+                continue;
+            }
+            slot.n_past += n_eval;
+            if (!slot.draft.empty())
+            {
+                processDraft(slot);
+                slot.i_batch = -1;
+            }
+            else if (slot.i_batch >= 0)
+            {
+                processToken(slot, n_eval == 1);
+                slot.i_batch = -1;
+            }
+        }
+        return ret == 0;
+    }
+
+    // sample the slot's next token from the logits at slot.i_batch
+    void processToken(llama_rn_slot &slot, bool tg)
+    {
+        const int64_t t_now = llama_time_us();
+        if (slot.t_start_generation == 0)
+        {
+            slot.t_start_generation = t_now;
+            slot.t_prompt_processing = (t_now - slot.t_start_prompt) / 1e3;
+            if (!slot.params.embedding)
+            {
+                cachePrefix(slot);
+            }
+            if (slot.params.n_predict != 0 && !slot.beam_search)
+            {
+                forkSlots(slot);
+            }
+        }
+        else
+        {
+            slot.n_decoded++;
+            slot.t_token_generation = (t_now - slot.t_start_generation) / 1e3;
+        }
+
+        completion_token_output result;
+        result.tok = -1;
+
+        if (slot.params.embedding)
+        {
+            const int n_embd = llama_n_embd(model);
+            const float *data = llama_pooling_type(ctx) == LLAMA_POOLING_TYPE_NONE
+                ? llama_get_embeddings_ith(ctx, slot.i_batch)
+                : llama_get_embeddings_seq(ctx, slot.id);
+            if (data)
+            {
+                slot.embedding.assign(data, data + n_embd);
+            }
+        }
+
+        if (slot.beam_search)
+        {
+            // the beams start from the prompt logits, beamSearch decodes them from here
+            startBeams(slot);
+            return;
+        }
+
+        if (slot.params.n_predict == 0)
+        {
+            slot.is_generating = false;
+            result.tok = llama_token_eos(model);
+            slot.pending.push_back(result);
+            return;
+        }
+
+        // out of user input, sample next token
+        result = sampleToken(slot, slot.i_batch);
+        gpt_sampler_accept(slot.ctx_sampling, result.tok, true);
+        if (tg) {
+            slot.num_tokens_predicted++;
+        }
+        pushToken(slot, result);
+    }
+
+    // Verify the slot's draft with the logits of its last token and of every drafted
+    // token: drafts are accepted in order (rejection sampling against the target
+    // distribution), the first rejected one is replaced by a token sampled from the
+    // residual distribution, and a fully accepted draft earns one extra token.
+    void processDraft(llama_rn_slot &slot)
+    {
+        const size_t n_draft = slot.draft.size();
+        // only the accepted drafts stay in the KV cache
+        slot.n_past -= n_draft;
+        slot.n_drafted += n_draft;
+
+        for (size_t k = 0; k <= n_draft && slot.is_generating; k++)
+        {
+            completion_token_output result = sampleToken(slot, slot.i_batch + k);
+            const bool accepted = k < n_draft && acceptDraft(slot, k, result);
+            gpt_sampler_accept(slot.ctx_sampling, result.tok, true);
+            slot.num_tokens_predicted++;
+            slot.n_decoded++;
+            pushToken(slot, result);
+            if (!accepted)
+            {
+                break;
+            }
+            slot.n_past++;
+            slot.n_draft_accepted++;
+        }
+        llama_kv_cache_seq_rm(ctx, slot.id, slot.n_past, -1);
+        slot.t_token_generation = (llama_time_us() - slot.t_start_generation) / 1e3;
+
+        slot.draft.clear();
+        slot.draft_q.clear();
+    }
+
+    completion_token_output sampleToken(llama_rn_slot &slot, int32_t idx)
+    {
+        completion_token_output result;
+        result.tok = gpt_sampler_sample(slot.ctx_sampling, ctx, idx);
+
+        const llama_token_data_array *cur_p = gpt_sampler_get_candidates(slot.ctx_sampling);
+        const size_t n_probs = std::max(0, slot.params.sparams.n_probs);
+        for (size_t i = 0; i < std::min(cur_p->size, n_probs); ++i)
+        {
+            result.probs.push_back({cur_p->data[i].id, cur_p->data[i].p});
+        }
+        return result;
+    }
+
+    // Decide on draft token k given the target sample in result (candidates of the
+    // target sampler still hold p). Greedy sampling accepts exact matches; otherwise
+    // the draft is kept with probability min(1, p/q) and a rejection resamples from
+    // max(0, p - q).
+    bool acceptDraft(llama_rn_slot &slot, size_t k, completion_token_output &result)
+    {
+        const llama_token tok = slot.draft[k];
+        if (slot.params.sparams.temp <= 0)
+        {
+            return result.tok == tok;
+        }
+
+        const llama_token_data_array *cur_p = gpt_sampler_get_candidates(slot.ctx_sampling);
+        const std::vector<llama_token_data> *q = k < slot.draft_q.size() && !slot.draft_q[k].empty() ? &slot.draft_q[k] : nullptr;
+        auto q_of = [q, tok](llama_token id) -> float {
+            if (q == nullptr)
+            {
+                return id == tok ? 1.0f : 0.0f;
+            }
+            for (const llama_token_data &data : *q)
+            {
+                if (data.id == id)
+                {
+                    return data.p;
+                }
+            }
+            return 0.0f;
+        };
+
+        float p_tok = 0.0f;
+        for (size_t i = 0; i < cur_p->size; i++)
+        {
+            if (cur_p->data[i].id == tok)
+            {
+                p_tok = cur_p->data[i].p;
+                break;
+            }
+        }
+        std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+        const float q_tok = q_of(tok);
+        if (p_tok > 0.0f && (q_tok <= p_tok || uniform(slot.rng) * q_tok <= p_tok))
+        {
+            result.tok = tok;
+            return true;
+        }
+
+        std::vector<float> residual(cur_p->size);
+        float sum = 0.0f;
+        for (size_t i = 0; i < cur_p->size; i++)
+        {
+            residual[i] = std::max(0.0f, cur_p->data[i].p - q_of(cur_p->data[i].id));
+            sum += residual[i];
+        }
+        if (sum > 0.0f)
+        {
+            std::discrete_distribution<size_t> dist(residual.begin(), residual.end());
+            result.tok = cur_p->data[dist(slot.rng)].id;
+        }
+        return false;
+    }
+
+    // add a sampled token to the context and the slot's output queue
+    void pushToken(llama_rn_slot &slot, const completion_token_output &result)
+    {
+        const int64_t t_now = llama_time_us();
+        if (slot.t_last_token == 0)
+        {
+            slot.t_first_token = (t_now - slot.t_start_prompt) / 1e3;
+        }
+        else
+        {
+            slot.token_latency.add((t_now - slot.t_last_token) / 1e3);
+        }
+        slot.t_last_token = t_now;
+
+        slot.embd.push_back(result.tok);
+        slot.pending.push_back(result);
+        // decrement remaining sampling budget
+        --slot.n_remain;
+
+        if (!slot.embd.empty() && slot.embd.back() == llama_token_eos(model))
+        {
+            // stopping_word = llama_token_to_piece(ctx, embd.back());
+            slot.is_generating = false;
+            slot.stopped_eos = true;
+            LOG_VERBOSE("eos token found", "");
+            return;
+        }
+
+        // the stop word itself is cut from the text by doCompletion
+        const int64_t t_stop_start = llama_time_us();
+        const bool is_stop = slot.stop_matcher.feedToken(result.tok);
+        slot.t_stop_match_us += llama_time_us() - t_stop_start;
+        if (is_stop)
+        {
+            slot.is_generating = false;
+            return;
+        }
+
+        slot.is_generating = slot.params.n_predict == -1 || slot.n_remain != 0;
+    }
+
+    bool canSpeculate(const llama_rn_slot &slot) const
+    {
+        return slot.params.n_draft > 0 && !slot.params.embedding && slot.params.n_predict != 0 &&
+               slot.params.sparams.grammar.empty() && slot.params.sparams.mirostat == 0;
+    }
+
+    // most tokens a draft for the slot may propose this step
+    int draftLimit(const llama_rn_slot &slot) const
+    {
+        int n_max = slot.params.n_draft;
+        if (slot.params.n_predict != -1)
+        {
+            // verification emits one token more than the accepted draft
+            n_max = std::min(n_max, (int) slot.n_remain - 1);
+        }
+        return std::min(n_max, slot.n_ctx - (int) slot.embd.size() - 1);
+    }
 
-            for (size_t i = params.n_keep + 1 + n_discard; i < embd.size(); i++)
+    // Propose draft tokens for every slot about to generate: prompt lookup first,
+    // then the draft model. Slots using the draft model draft together, one draft
+    // decode per proposed position.
+    void draftTokens()
+    {
+        std::vector<llama_rn_slot *> drafting;
+        for (auto &slot_ptr : slots)
+        {
+            llama_rn_slot &slot = *slot_ptr;
+            // the first token is sampled from the prompt logits, drafting starts after it
+            if (!slot.isReady() || slot.n_eval > 0 || slot.embd.size() - slot.n_past != 1 || slot.t_start_generation == 0 ||
+                !slot.draft.empty() || !canSpeculate(slot) || draftLimit(slot) <= 0)
             {
-                embd[i - n_discard] = embd[i];
+                continue;
+            }
+            if (lookupDraft(slot))
+            {
+                continue;
+            }
+            if (ctx_draft != nullptr && slot.ctx_sampling_draft != nullptr &&
+                syncDraft(slot) && sampleDraft(slot, batch_draft.n_tokens - 1))
+            {
+                drafting.push_back(&slot);
             }
-            embd.resize(embd.size() - n_discard);
-
-            n_past -= n_discard;
-
-            LOG_VERBOSE("input truncated, n_ctx: %d, n_keep: %d, n_left: %d, new_tokens: %s",
-                params.n_ctx,
-                params.n_keep,
-                n_left
-            );
         }
 
-        bool tg = true;
-        while (n_past < embd.size())
+        while (!drafting.empty())
         {
-            int n_eval = (int)embd.size() - n_past;
-            tg = n_eval == 1;
-            if (n_eval > params.n_batch)
+            llama_batch_clear(&batch_draft);
+            for (llama_rn_slot *slot : drafting)
             {
-                n_eval = params.n_batch;
+                llama_batch_add(&batch_draft, slot->draft.back(), slot->embd.size() + slot->draft.size() - 1, {slot->id}, true);
             }
-            if (llama_decode(ctx, llama_batch_get_one(&embd[n_past], n_eval, n_past, 0)))
+            if (llama_decode(ctx_draft, batch_draft) != 0)
             {
-                LOG_ERROR("failed to eval, n_eval: %d, n_past: %d, n_threads: %d, embd: %s",
-                    n_eval,
-                    n_past,
-                    params.cpuparams.n_threads,
-                    tokens_to_str(ctx, embd.cbegin() + n_past, embd.cend()).c_str()
-                );
-                has_next_token = false;
-                return result;
+                LOG_ERROR("failed to eval draft, n_tokens: %d", batch_draft.n_tokens);
+                for (llama_rn_slot *slot : drafting)
+                {
+                    llama_kv_cache_seq_rm(ctx_draft, slot->id, slot->embd.size(), -1);
+                    slot->embd_draft.resize(slot->embd.size());
+                }
+                break;
             }
-            n_past += n_eval;
-            
-            if(is_interrupted) {
-                LOG_INFO("Decoding Interrupted");
-                embd.resize(n_past);
-                has_next_token = false;
-                return result;
+            std::vector<llama_rn_slot *> next;
+            for (size_t i = 0; i < drafting.size(); i++)
+            {
+                llama_rn_slot *slot = drafting[i];
+                slot->embd_draft.push_back(slot->draft.back());
+                if (sampleDraft(*slot, i))
+                {
+                    next.push_back(slot);
+                }
             }
+            drafting.swap(next);
         }
+    }
 
-        if (params.n_predict == 0)
+    // deterministic proposal from the slot's own tokens or the n-gram cache
+    bool lookupDraft(llama_rn_slot &slot)
+    {
+        if (slot.lookup.n_max <= 0)
         {
-            has_next_token = false;
-            result.tok = llama_token_eos(model);
-            return result;
+            return false;
         }
-
+        slot.draft = slot.lookup.draft(slot.embd, draftLimit(slot));
+        if (slot.draft.empty())
         {
-            // out of user input, sample next token
-            std::vector<llama_token_data> candidates;
-            candidates.reserve(llama_n_vocab(model));
-
-            result.tok = gpt_sampler_sample(ctx_sampling, ctx, -1);
-            
-            llama_token_data_array cur_p = *gpt_sampler_get_candidates(ctx_sampling);
+            slot.draft = lookup_cache.draft(slot.embd, draftLimit(slot));
+        }
+        slot.draft_q.clear();
+        return !slot.draft.empty();
+    }
 
-            const int32_t n_probs = params.sparams.n_probs;
-            
-            
-            if (params.sparams.temp <= 0 && n_probs > 0)
+    // Bring the draft model's sequence up to date with embd, leaving the logits of
+    // the slot's last token at the end of batch_draft.
+    bool syncDraft(llama_rn_slot &slot)
+    {
+        size_t n_common = common_part(slot.embd_draft, slot.embd);
+        if (n_common == slot.embd.size())
+        {
+            n_common--;
+        }
+        // a fork finds its prompt in the draft sequence of the slot it was forked from
+        for (const auto &other : slots)
+        {
+            const size_t n_other = std::min(common_part(other->embd_draft, slot.embd), slot.embd.size() - 1);
+            if (other.get() != &slot && n_other > n_common)
             {
-                // For llama_sample_token_greedy we need to sort candidates
-                llama_sampler_init_softmax();
+                llama_kv_cache_seq_rm(ctx_draft, slot.id, 0, -1);
+                llama_kv_cache_seq_cp(ctx_draft, other->id, slot.id, 0, n_other);
+                slot.embd_draft.assign(slot.embd.begin(), slot.embd.begin() + n_other);
+                n_common = n_other;
             }
-            
+        }
+        llama_kv_cache_seq_rm(ctx_draft, slot.id, n_common, -1);
+        slot.embd_draft.resize(n_common);
 
-            for (size_t i = 0; i < std::min(cur_p.size, (size_t)n_probs); ++i)
+        const int n_batch = std::max(params.n_batch, params.n_parallel);
+        while (slot.embd_draft.size() < slot.embd.size())
+        {
+            llama_batch_clear(&batch_draft);
+            const size_t n_past = slot.embd_draft.size();
+            const size_t n_eval = std::min((size_t) n_batch, slot.embd.size() - n_past);
+            for (size_t i = 0; i < n_eval; i++)
             {
-                result.probs.push_back({cur_p.data[i].id, cur_p.data[i].p});
+                llama_batch_add(&batch_draft, slot.embd[n_past + i], n_past + i, {slot.id}, n_past + i == slot.embd.size() - 1);
             }
-
-            gpt_sampler_accept(ctx_sampling, result.tok, true);
-            if (tg) {
-                num_tokens_predicted++;
+            if (llama_decode(ctx_draft, batch_draft) != 0)
+            {
+                LOG_ERROR("failed to eval draft prompt, slot: %d, n_eval: %zu", slot.id, n_eval);
+                llama_kv_cache_seq_rm(ctx_draft, slot.id, n_past, -1);
+                return false;
             }
+            slot.embd_draft.insert(slot.embd_draft.end(), slot.embd.begin() + n_past, slot.embd.begin() + n_past + n_eval);
         }
+        return true;
+    }
 
-        // add it to the context
-        embd.push_back(result.tok);
-        // decrement remaining sampling budget
-        --n_remain;
-
-        if (!embd.empty() && embd.back() == llama_token_eos(model))
+    // Sample one draft token from the draft logits at idx. Returns true if the slot
+    // should keep drafting.
+    bool sampleDraft(llama_rn_slot &slot, int32_t idx)
+    {
+        const llama_token tok = gpt_sampler_sample(slot.ctx_sampling_draft, ctx_draft, idx);
+        const llama_token_data_array *cur_p = gpt_sampler_get_candidates(slot.ctx_sampling_draft);
+        if (cur_p->data[cur_p->selected].p < draft_p_min)
         {
-            // stopping_word = llama_token_to_piece(ctx, embd.back());
-            has_next_token = false;
-            stopped_eos = true;
-            LOG_VERBOSE("eos token found", "");
-            return result;
+            return false;
         }
-
-        has_next_token = params.n_predict == -1 || n_remain != 0;
-        return result;
+        slot.draft.push_back(tok);
+        if (slot.params.sparams.temp > 0)
+        {
+            slot.draft_q.emplace_back(cur_p->data, cur_p->data + cur_p->size);
+        }
+        return (int) slot.draft.size() < draftLimit(slot) && tok != llama_token_eos(model);
     }
 
-    size_t findStoppingStrings(const std::string &text, const size_t last_token_size,
-                               const stop_type type)
+    // Wait for the slot's next token. Whichever caller finds its own slot without
+    // a token runs the next scheduler step on behalf of all slots.
+    completion_token_output nextToken(llama_rn_slot &slot)
     {
-        size_t stop_pos = std::string::npos;
-        for (const std::string &word : params.antiprompt)
+        const size_t n_past_prev = slot.n_past;
+        while (slot.pending.empty() && slot.is_generating && !slot.is_interrupted)
         {
-            size_t pos;
-            if (type == STOP_FULL)
-            {
-                const size_t tmp = word.size() + last_token_size;
-                const size_t from_pos = text.size() > tmp ? text.size() - tmp : 0;
-                pos = text.find(word, from_pos);
-            }
-            else
+            if (!updateSlots() && slot.pending.empty())
             {
-                pos = find_partial_stop_string(word, text);
+                break;
             }
-            if (pos != std::string::npos &&
-                (stop_pos == std::string::npos || pos < stop_pos))
+            if (slot.report_progress && slot.pending.empty() && slot.n_past != n_past_prev)
             {
-                if (type == STOP_FULL)
-                {
-                    stopping_word = word;
-                    stopped_word = true;
-                    has_next_token = false;
-                }
-                stop_pos = pos;
+                break;
             }
         }
-        return stop_pos;
+
+        completion_token_output result;
+        result.tok = -1;
+        if (!slot.pending.empty())
+        {
+            result = slot.pending.front();
+            slot.pending.pop_front();
+        }
+        else if (slot.is_interrupted)
+        {
+            LOG_INFO("Decoding Interrupted");
+        }
+        slot.has_next_token = !slot.pending.empty() || (slot.is_generating && !slot.is_interrupted);
+        return result;
     }
 
-    completion_token_output doCompletion()
+    completion_token_output doCompletion(llama_rn_slot &slot)
     {
-        const completion_token_output token_with_probs = nextToken();
+        std::lock_guard<std::mutex> lock(slots_mutex);
+
+        completion_token_output token_with_probs = nextToken(slot);
 
-        const std::string token_text = token_with_probs.tok == -1 ? "" : llama_token_to_piece(ctx, token_with_probs.tok);
-        generated_text += token_text;
+        if (slot.t_start_generation == 0)
+        {
+            slot.n_prompt_done = slot.n_prompt_processed - std::min(slot.n_prompt_processed, slot.embd.size() - slot.n_past);
+            slot.t_prompt_elapsed = (llama_time_us() - slot.t_start_prompt) / 1e3;
+        }
+        else
+        {
+            slot.n_prompt_done = slot.n_prompt_processed;
+            slot.t_prompt_elapsed = slot.t_prompt_processing;
+        }
+        token_with_probs.text_pos = slot.generated_text.size();
+        appendTokenPiece(slot.generated_text, token_with_probs.tok);
+        token_with_probs.text_len = slot.generated_text.size() - token_with_probs.text_pos;
 
-        if (params.sparams.n_probs > 0)
+        if (slot.params.sparams.n_probs > 0 && token_with_probs.tok != -1)
         {
-            generated_token_probs.push_back(token_with_probs);
+            slot.generated_token_probs.push_back(token_with_probs);
         }
 
         // check if there is incomplete UTF-8 character at the end
-        for (unsigned i = 1; i < 5 && i <= generated_text.size(); ++i) {
-            unsigned char c = generated_text[generated_text.size() - i];
+        for (unsigned i = 1; i < 5 && i <= slot.generated_text.size(); ++i) {
+            unsigned char c = slot.generated_text[slot.generated_text.size() - i];
             if ((c & 0xC0) == 0x80) {
                 // continuation byte: 10xxxxxx
                 continue;
             }
             if ((c & 0xE0) == 0xC0) {
                 // 2-byte character: 110xxxxx ...
-                incomplete = i < 2;
+                slot.incomplete = i < 2;
             } else if ((c & 0xF0) == 0xE0) {
                 // 3-byte character: 1110xxxx ...
-                incomplete = i < 3;
+                slot.incomplete = i < 3;
             } else if ((c & 0xF8) == 0xF0) {
                 // 4-byte character: 11110xxx ...
-                incomplete = i < 4;
+                slot.incomplete = i < 4;
             }
             // else 1-byte character or invalid byte
             break;
         }
 
-        if (incomplete && !has_next_token)
+        if (slot.incomplete && !slot.has_next_token && token_with_probs.tok != -1)
+        {
+            slot.has_next_token = true;
+            slot.is_generating = true;
+            slot.n_remain++;
+        }
+
+        if (!slot.has_next_token && slot.n_remain == 0)
         {
-            has_next_token = true;
-            n_remain++;
+            slot.stopped_limit = true;
         }
 
-        if (!has_next_token && n_remain == 0)
+        const int64_t t_stop_start = llama_time_us();
+        const llama_rn_stop_matcher::match stop = slot.stop_matcher.feedText(slot.generated_text);
+        slot.t_stop_match_us += llama_time_us() - t_stop_start;
+        if (stop.word >= 0)
         {
-            stopped_limit = true;
+            slot.generated_text.erase(stop.pos);
+            slot.stopping_word = slot.params.antiprompt[stop.word];
+            slot.stopped_word = true;
+            slot.has_next_token = false;
         }
 
-        LOG_VERBOSE("next token, token: %s, token_text: %s, has_next_token: %d, n_remain: %d, num_tokens_predicted: %d, stopped_eos: %d, stopped_word: %d, stopped_limit: %d, stopping_word: %s",
+        LOG_VERBOSE("next token, slot: %d, token: %s, token_text: %s, has_next_token: %d, n_remain: %d, num_tokens_predicted: %d, stopped_eos: %d, stopped_word: %d, stopped_limit: %d, stopping_word: %s",
+            slot.id,
             llama_token_to_piece(ctx, token_with_probs.tok),
             tokens_to_output_formatted_string(ctx, token_with_probs.tok).c_str(),
-            has_next_token,
-            n_remain,
-            num_tokens_predicted,
-            stopped_eos,
-            stopped_word,
-            stopped_limit,
-            stopping_word.c_str()
+            slot.has_next_token.load(),
+            slot.n_remain,
+            slot.num_tokens_predicted,
+            slot.stopped_eos,
+            slot.stopped_word,
+            slot.stopped_limit,
+            slot.stopping_word.c_str()
         );
         return token_with_probs;
     }
 
-    std::vector<float> getEmbedding()
+    // Decode the slot's completion, and those of its forks, on the worker thread
+    // instead of the caller's: loadPrompt must have been called, the text is read
+    // from slot.stream->queue until it is closed.
+    void startStream(llama_rn_slot &slot, size_t capacity)
     {
-        static const int n_embd = llama_n_embd(llama_get_model(ctx));
-        if (!params.embedding)
+        slot.stream.reset(new llama_rn_stream(capacity));
+        llama_rn_stream &stream = *slot.stream;
+        stream.slots.assign(1, &slot);
+        stream.slots.insert(stream.slots.end(), slot.forks.begin(), slot.forks.end());
+        stream.sent_counts.assign(stream.slots.size(), 0);
+        stream.sent_token_probs_indices.assign(stream.slots.size(), 0);
+        slot.report_progress = true;
+        llama_rn_stream *stream_ptr = &stream;
+        worker.post([this, stream_ptr] { return stepStream(*stream_ptr); });
+    }
+
+    // Abandon the slot's stream, e.g. when its owner stops draining: stop its slots,
+    // wait for the worker to close the queue, dropping what it pushed, and release them
+    void cancelStream(llama_rn_slot &slot)
+    {
+        llama_rn_stream &stream = *slot.stream;
+        interruptSlot(slot.id);
+        completion_stream_event event;
+        while (true)
         {
-            LOG_WARNING("embedding disabled, embedding: %s", params.embedding);
-            return std::vector<float>(n_embd, 0.0f);
+            // closed before popping: nothing is pushed after the last pop
+            const bool is_done = stream.queue.isClosed();
+            while (stream.queue.pop(event))
+            {
+            }
+            if (is_done)
+            {
+                break;
+            }
+            worker.wake();
+            stream.queue.wait(1, std::chrono::steady_clock::now() + std::chrono::milliseconds(10));
+        }
+        const std::vector<llama_rn_slot *> stream_slots = stream.slots;
+        slot.stream.reset();
+        for (llama_rn_slot *s : stream_slots)
+        {
+            releaseSlot(*s);
+        }
+    }
+
+    // One round of a stream: a token of every unfinished completion, the text whose
+    // tokens are complete pushed as one chunk per completion
+    job_state stepStream(llama_rn_stream &stream)
+    {
+        bool has_next = false;
+        for (const llama_rn_slot *slot : stream.slots)
+        {
+            has_next |= slot->has_next_token && !slot->is_interrupted;
+        }
+        if (!has_next)
+        {
+            stream.queue.close();
+            return JOB_DONE;
+        }
+        // a round pushes a chunk per slot and the prompt progress at most; the flag is
+        // raised before the check so that a drain in between still wakes the worker
+        stream.is_throttled = true;
+        if (stream.queue.capacity() - stream.queue.size() < stream.slots.size() + 1)
+        {
+            return JOB_BLOCKED;
         }
-        float *data;
-        
-        if(params.pooling_type == 0){
-            data = llama_get_embeddings(ctx);
+        stream.is_throttled = false;
+
+        for (size_t index = 0; index < stream.slots.size(); index++)
+        {
+            llama_rn_slot &slot = *stream.slots[index];
+            if (!slot.has_next_token || slot.is_interrupted)
+            {
+                continue;
+            }
+            const completion_token_output token_with_probs = doCompletion(slot);
+            if (index == 0 && slot.n_prompt_done != stream.sent_prompt_done)
+            {
+                stream.sent_prompt_done = slot.n_prompt_done;
+                completion_stream_event progress;
+                progress.index = -1;
+                progress.prompt_n = slot.n_prompt_done;
+                progress.prompt_total = slot.n_prompt_processed;
+                progress.prompt_ms = slot.t_prompt_elapsed;
+                stream.queue.push(std::move(progress));
+            }
+            if (token_with_probs.tok == -1 || (slot.incomplete && slot.has_next_token))
+            {
+                continue;
+            }
+            // bytes that may still turn into a stop word are held back until the end of the generation
+            size_t &sent_count = stream.sent_counts[index];
+            const size_t n_hold = slot.has_next_token ? slot.stop_matcher.partialLength() : 0;
+            const size_t pos = std::min(sent_count, slot.generated_text.size());
+            const size_t end = slot.generated_text.size() - std::min(n_hold, slot.generated_text.size() - pos);
+            if (end <= pos)
+            {
+                continue;
+            }
+            completion_stream_event chunk;
+            chunk.index = index;
+            chunk.text = slot.generated_text.substr(pos, end - pos);
+            sent_count = end;
+            if (slot.params.sparams.n_probs > 0)
+            {
+                // the tokens whose text is now sent in full, by the byte spans recorded while detokenizing
+                const auto &token_probs = slot.generated_token_probs;
+                size_t &sent_token_probs_index = stream.sent_token_probs_indices[index];
+                size_t probs_end = std::min(sent_token_probs_index, token_probs.size());
+                const size_t probs_pos = probs_end;
+                while (probs_end < token_probs.size() &&
+                       (!slot.has_next_token || token_probs[probs_end].text_pos + token_probs[probs_end].text_len <= end))
+                {
+                    probs_end++;
+                }
+                sent_token_probs_index = probs_end;
+                chunk.probs.assign(token_probs.begin() + probs_pos, token_probs.begin() + probs_end);
+            }
+            stream.queue.push(std::move(chunk));
         }
-        else {
-            data = llama_get_embeddings_seq(ctx, 0);
+        return JOB_RUNNING;
+    }
+
+    std::vector<float> getEmbedding(llama_rn_slot &slot)
+    {
+        static const int n_embd = llama_n_embd(llama_get_model(ctx));
+        if (!slot.params.embedding)
+        {
+            LOG_WARNING("embedding disabled, embedding: %s", slot.params.embedding);
+            return std::vector<float>(n_embd, 0.0f);
         }
-        
-        if(!data) {
+        if (slot.embedding.empty()) {
             return std::vector<float>(n_embd, 0.0f);
         }
-        std::vector<float> embedding(data, data + n_embd), out(data, data + n_embd);
-        llama_embd_normalize(embedding.data(), out.data(), n_embd, params.embd_normalize);
+        std::vector<float> out(n_embd);
+        llama_embd_normalize(slot.embedding.data(), out.data(), n_embd, slot.params.embd_normalize);
         return out;
     }
 
-    std::string bench(int pp, int tg, int pl, int nr)
+    // longest token sequence decodePacked evaluates without truncating it
+    int packedMaxTokens() const
     {
-        if (is_predicting) {
-            LOG_ERROR("cannot benchmark while predicting", "");
-            return std::string("[]");
+        return std::max(1, std::min(std::min(params.n_ubatch, params.n_batch), n_ctx));
+    }
+
+    // Decode many token sequences without going through the slots or the sampler.
+    // Whole sequences are packed into one ubatch as sequences 0..k-1 (pooled outputs
+    // are computed per ubatch, so a sequence is never split) and on_output(i, data)
+    // receives the pooled output of sequence i, or the output of its last token when
+    // pooling is NONE. Sequences longer than packedMaxTokens() are truncated.
+    // Returns false when busy, interrupted or on a decode failure.
+    //
+    // Packed sequences are masked from each other but attention is still computed
+    // over the whole ubatch: 4*T*n_embd per token against 12*n_embd^2 for the matmuls.
+    // Packing stops at n_embd tokens, where attention stays below a third of the work.
+    template <typename F>
+    bool decodePacked(const std::vector<std::vector<llama_token>> &tokens, F on_output)
+    {
+        std::lock_guard<std::mutex> lock(slots_mutex);
+        if (!beginBatchJob())
+        {
+            return false;
         }
 
-        is_predicting = true;
+        const enum llama_pooling_type pooling = llama_pooling_type(ctx);
+        const int n_max = packedMaxTokens();
+        const int n_pack = std::min(n_max, llama_n_embd(model));
+        std::vector<int32_t> i_last; // batch index of the last token of each packed sequence
+
+        bool ok = true;
+        size_t i = 0;
+        while (i < tokens.size() && !is_interrupted)
+        {
+            const size_t i_first = i;
+            llama_batch_clear(&batch);
+            i_last.clear();
+            for (; i < tokens.size(); i++)
+            {
+                const int n_tokens = std::min((int) tokens[i].size(), n_max);
+                if (batch.n_tokens > 0 && batch.n_tokens + n_tokens > n_pack)
+                {
+                    break;
+                }
+                if (n_tokens < (int) tokens[i].size())
+                {
+                    LOG_WARNING("sequence %zu truncated from %zu to %d tokens", i, tokens[i].size(), n_tokens);
+                }
+                const llama_seq_id seq_id = (llama_seq_id) (i - i_first);
+                for (int j = 0; j < n_tokens; j++)
+                {
+                    llama_batch_add(&batch, tokens[i][j], j, {seq_id}, j == n_tokens - 1);
+                }
+                i_last.push_back(n_tokens > 0 ? batch.n_tokens - 1 : -1);
+            }
+            if (batch.n_tokens == 0)
+            {
+                continue;
+            }
+
+            if (llama_decode(ctx, batch) != 0)
+            {
+                LOG_ERROR("llama_decode() failed on packed sequences %zu to %zu", i_first, i);
+                ok = false;
+                break;
+            }
+            for (size_t s = 0; s < i_last.size(); s++)
+            {
+                if (i_last[s] < 0)
+                {
+                    continue;
+                }
+                const float *data = pooling == LLAMA_POOLING_TYPE_NONE
+                    ? llama_get_embeddings_ith(ctx, i_last[s])
+                    : llama_get_embeddings_seq(ctx, (llama_seq_id) s);
+                if (data != nullptr)
+                {
+                    on_output(i_first + s, data);
+                }
+            }
+            llama_kv_cache_clear(ctx);
+        }
+        return endBatchJob() && ok;
+    }
 
-        double pp_avg = 0;
-        double tg_avg = 0;
+    // Called with slots_mutex held: take the whole KV cache for a job that does not
+    // go through the slots, like bench(). Embedding slots always decode their prompt
+    // from scratch, their sequences are dropped so that the job may reuse the ids.
+    bool beginBatchJob()
+    {
+        if (isPredicting())
+        {
+            LOG_ERROR("cannot start a batch job while predicting", "");
+            return false;
+        }
+        is_predicting = true;
+        is_interrupted = false;
+        llama_kv_cache_clear(ctx);
+        for (auto &slot : slots)
+        {
+            slot->embd.clear();
+        }
+        return true;
+    }
 
-        double pp_std = 0;
-        double tg_std = 0;
+    // returns false if the job was interrupted
+    bool endBatchJob()
+    {
+        llama_kv_cache_clear(ctx);
+        pauseThreadpools(0);
+        is_predicting = false;
+        if (is_interrupted)
+        {
+            LOG_INFO("Batch job Interrupted");
+            return false;
+        }
+        return true;
+    }
 
-        // TODO: move batch into llama_rn_context (related https://github.com/mybigday/llama.rn/issues/30)
-        llama_batch batch = llama_batch_init(512, 0, 1);
+    // Embed many texts in as few decodes as possible, see decodePacked. Returns
+    // texts.size() * n_embd floats, or an empty vector on failure.
+    std::vector<float> embedBatch(const std::vector<std::string> &texts)
+    {
+        std::vector<std::vector<llama_token>> tokens;
+        tokens.reserve(texts.size());
+        for (const std::string &text : texts)
+        {
+            tokens.push_back(::llama_tokenize(ctx, text, true, true));
+        }
 
-        for (int i = 0; i < nr; i++)
+        const int n_embd = llama_n_embd(model);
+        std::vector<float> out(texts.size() * n_embd, 0.0f);
+        const int embd_normalize = params.embd_normalize;
+        const bool ok = decodePacked(tokens, [&](size_t i, const float *data)
         {
-            llama_batch_clear(&batch);
+            llama_embd_normalize(data, out.data() + i * n_embd, n_embd, embd_normalize);
+        });
+        return ok ? out : std::vector<float>();
+    }
 
-            const int n_tokens = pp;
+    // Score every document against the query with a cross-encoder (pooling RANK),
+    // packing [BOS] query [EOS] [SEP] document [EOS] pairs into as few decodes as
+    // possible. Pairs are shortened to fit in a ubatch: documents first, then a query
+    // that would leave them less than half of it. Returns one score per document, in
+    // document order, or an empty vector on failure.
+    std::vector<float> rerank(const std::string &query, const std::vector<std::string> &documents)
+    {
+        const size_t n_max = packedMaxTokens();
+        if (n_max <= 4)
+        {
+            LOG_ERROR("a ubatch of %zu tokens cannot hold a query and document pair", n_max);
+            return std::vector<float>();
+        }
+        const size_t n_text_max = n_max - 4;
+        std::vector<llama_token> query_tokens = ::llama_tokenize(ctx, query, false, true);
+        std::vector<std::vector<llama_token>> doc_tokens;
+        doc_tokens.reserve(documents.size());
+        size_t n_doc_longest = 0;
+        for (const std::string &document : documents)
+        {
+            doc_tokens.push_back(::llama_tokenize(ctx, document, false, true));
+            n_doc_longest = std::max(n_doc_longest, doc_tokens.back().size());
+        }
+        const size_t n_doc_min = std::max<size_t>(1, std::min(n_doc_longest, n_text_max / 2));
+        if (query_tokens.size() + n_doc_min > n_text_max)
+        {
+            query_tokens.resize(n_text_max - n_doc_min);
+        }
 
-            for (int i = 0; i < n_tokens; i++)
+        std::vector<std::vector<llama_token>> tokens;
+        tokens.reserve(documents.size());
+        for (std::vector<llama_token> &doc : doc_tokens)
+        {
+            const size_t n_frame = query_tokens.size() + 4;
+            if (n_frame + doc.size() > n_max)
             {
-                llama_batch_add(&batch, 0, i, {0}, false);
+                doc.resize(n_max - n_frame);
             }
-            batch.logits[batch.n_tokens - 1] = 1; // true
+            std::vector<llama_token> pair;
+            pair.reserve(n_frame + doc.size());
+            pair.push_back(llama_token_bos(model));
+            pair.insert(pair.end(), query_tokens.begin(), query_tokens.end());
+            pair.push_back(llama_token_eos(model));
+            pair.push_back(llama_token_sep(model));
+            pair.insert(pair.end(), doc.begin(), doc.end());
+            pair.push_back(llama_token_eos(model));
+            tokens.push_back(pair);
+        }
 
-            llama_kv_cache_clear(ctx);
+        std::vector<float> scores(documents.size(), 0.0f);
+        const bool ok = decodePacked(tokens, [&](size_t i, const float *data)
+        {
+            scores[i] = data[0];
+        });
+        return ok ? scores : std::vector<float>();
+    }
 
-            const int64_t t_pp_start = llama_time_us();
-            if (llama_decode(ctx, batch) != 0)
+    // Byte span in text of every token of its tokenization. Pieces are matched
+    // against the source, allowing for the leading space SPM and WPM pieces carry
+    // and for WPM lowercasing; a token that cannot be matched gets an empty span.
+    std::vector<std::pair<size_t, size_t>> tokenSpans(const std::string &text, const std::vector<llama_token> &tokens) const
+    {
+        std::vector<std::pair<size_t, size_t>> spans;
+        spans.reserve(tokens.size());
+        size_t pos = 0;
+        std::string piece;
+        for (const llama_token tok : tokens)
+        {
+            piece.clear();
+            appendTokenPiece(piece, tok);
+            const size_t k = piece.find_first_not_of(' ');
+            if (k == std::string::npos)
             {
-                LOG_ERROR("llama_decode() failed during prompt", "");
+                const size_t n = std::min(piece.size(), text.size() - pos);
+                spans.push_back(std::make_pair(pos, pos + n));
+                pos += n;
+                continue;
             }
-            const int64_t t_pp_end = llama_time_us();
-            llama_kv_cache_clear(ctx);
+            size_t p = pos;
+            if (!isspace((unsigned char) piece[k]))
+            {
+                while (p < text.size() && isspace((unsigned char) text[p]))
+                {
+                    p++;
+                }
+            }
+            const size_t n = piece.size() - k;
+            bool match = p + n <= text.size();
+            for (size_t j = 0; match && j < n; j++)
+            {
+                match = tolower((unsigned char) text[p + j]) == tolower((unsigned char) piece[k + j]);
+            }
+            if (match)
+            {
+                spans.push_back(std::make_pair(p, p + n));
+                pos = p + n;
+            }
+            else
+            {
+                spans.push_back(std::make_pair(pos, pos));
+            }
+        }
+        return spans;
+    }
 
-            if (is_interrupted) break;
+    // Split text into chunks of n_chunk tokens overlapping by n_overlap and embed each
+    // one, chunk i at embeddings[i * n_embd]. Without late chunking every chunk is
+    // encoded on its own (see decodePacked). With late chunking the document is
+    // encoded once, in windows of a ubatch that overlap by a quarter; every token
+    // takes its output from the window where it sits farthest from an edge and a
+    // chunk is the mean of its tokens, so chunks keep the context around them. Late
+    // chunking needs token outputs, i.e. a context with pooling NONE.
+    bool embedDocument(const std::string &text, int n_chunk, int n_overlap, bool late_chunking,
+                       std::vector<document_chunk> &chunks, std::vector<float> &embeddings)
+    {
+        chunks.clear();
+        embeddings.clear();
+        if (late_chunking && llama_pooling_type(ctx) != LLAMA_POOLING_TYPE_NONE)
+        {
+            LOG_ERROR("late chunking needs token embeddings, the context pools them", "");
+            return false;
+        }
 
-            const int64_t t_tg_start = llama_time_us();
+        const std::vector<llama_token> tokens = ::llama_tokenize(ctx, text, false, false);
+        const std::vector<std::pair<size_t, size_t>> spans = tokenSpans(text, tokens);
+        const bool add_bos = llama_add_bos_token(model);
+        const bool add_eos = llama_add_eos_token(model);
+        const int n_window = std::max(1, packedMaxTokens() - add_bos - add_eos);
+        n_chunk = std::max(1, std::min(n_chunk, n_window));
+        n_overlap = std::max(0, std::min(n_overlap, n_chunk - 1));
+        const size_t n_stride = n_chunk - n_overlap;
 
-            for (int i = 0; i < tg; i++)
+        for (size_t start = 0; start < tokens.size(); start += n_stride)
+        {
+            document_chunk chunk;
+            chunk.token_start = start;
+            chunk.token_end = std::min(tokens.size(), start + n_chunk);
+            chunk.text_start = spans[chunk.token_start].first;
+            chunk.text_end = chunk.text_start;
+            for (size_t t = chunk.token_start; t < chunk.token_end; t++)
             {
-                llama_batch_clear(&batch);
+                chunk.text_end = std::max(chunk.text_end, spans[t].second);
+            }
+            chunks.push_back(chunk);
+            if (chunk.token_end == tokens.size())
+            {
+                break;
+            }
+        }
 
-                for (int j = 0; j < pl; j++)
+        const int n_embd = llama_n_embd(model);
+        const int embd_normalize = params.embd_normalize;
+        embeddings.assign(chunks.size() * n_embd, 0.0f);
+        if (!late_chunking)
+        {
+            std::vector<std::vector<llama_token>> sequences;
+            sequences.reserve(chunks.size());
+            for (const document_chunk &chunk : chunks)
+            {
+                std::vector<llama_token> sequence;
+                if (add_bos)
                 {
-                    llama_batch_add(&batch, 0, i, {j}, true);
+                    sequence.push_back(llama_token_bos(model));
                 }
-
-                if (llama_decode(ctx, batch) != 0)
+                sequence.insert(sequence.end(), tokens.begin() + chunk.token_start, tokens.begin() + chunk.token_end);
+                if (add_eos)
                 {
-                    LOG_ERROR("llama_decode() failed during text generation", "");
+                    sequence.push_back(llama_token_eos(model));
                 }
-                if (is_interrupted) break;
+                sequences.push_back(sequence);
             }
+            return decodePacked(sequences, [&](size_t i, const float *data)
+            {
+                llama_embd_normalize(data, embeddings.data() + i * n_embd, n_embd, embd_normalize);
+            });
+        }
 
-            const int64_t t_tg_end = llama_time_us();
-
-            llama_kv_cache_clear(ctx);
-
-            const double t_pp = (t_pp_end - t_pp_start) / 1000000.0;
-            const double t_tg = (t_tg_end - t_tg_start) / 1000000.0;
-
-            const double speed_pp = pp / t_pp;
-            const double speed_tg = (pl * tg) / t_tg;
+        std::lock_guard<std::mutex> lock(slots_mutex);
+        if (!beginBatchJob())
+        {
+            return false;
+        }
+        const size_t n_window_overlap = tokens.size() > (size_t) n_window ? n_window / 4 : 0;
+        const size_t n_window_stride = n_window - n_window_overlap;
+        std::vector<float> sums(chunks.size() * n_embd, 0.0f);
+        bool ok = true;
+        for (size_t w_start = 0; w_start < tokens.size() && !is_interrupted; w_start += n_window_stride)
+        {
+            const size_t w_end = std::min(tokens.size(), w_start + n_window);
+            const bool is_last = w_end == tokens.size();
+            // tokens whose output is taken from this window: the overlap with each
+            // neighbour is split in half
+            const size_t own_start = w_start == 0 ? 0 : w_start + n_window_overlap / 2;
+            const size_t own_end = is_last ? w_end : w_start + n_window_stride + n_window_overlap / 2;
 
-            pp_avg += speed_pp;
-            tg_avg += speed_tg;
+            llama_batch_clear(&batch);
+            if (add_bos)
+            {
+                llama_batch_add(&batch, llama_token_bos(model), 0, {0}, false);
+            }
+            for (size_t t = w_start; t < w_end; t++)
+            {
+                llama_batch_add(&batch, tokens[t], batch.n_tokens, {0}, t >= own_start && t < own_end);
+            }
+            if (add_eos)
+            {
+                llama_batch_add(&batch, llama_token_eos(model), batch.n_tokens, {0}, false);
+            }
+            if (llama_decode(ctx, batch) != 0)
+            {
+                LOG_ERROR("llama_decode() failed on document window %zu to %zu", w_start, w_end);
+                ok = false;
+                break;
+            }
 
-            pp_std += speed_pp * speed_pp;
-            tg_std += speed_tg * speed_tg;
+            for (size_t t = own_start; t < own_end; t++)
+            {
+                const float *data = llama_get_embeddings_ith(ctx, (int32_t) (t - w_start + add_bos));
+                if (data == nullptr)
+                {
+                    continue;
+                }
+                // chunks overlapping token t
+                const size_t c_first = t < (size_t) n_chunk ? 0 : (t - n_chunk) / n_stride + 1;
+                for (size_t c = c_first; c < chunks.size() && chunks[c].token_start <= t; c++)
+                {
+                    float *sum = sums.data() + c * n_embd;
+                    for (int j = 0; j < n_embd; j++)
+                    {
+                        sum[j] += data[j];
+                    }
+                }
+            }
+            llama_kv_cache_clear(ctx);
+            if (is_last)
+            {
+                break;
+            }
         }
+        for (size_t c = 0; c < chunks.size(); c++)
+        {
+            const float n = (float) (chunks[c].token_end - chunks[c].token_start);
+            float *sum = sums.data() + c * n_embd;
+            for (int j = 0; j < n_embd; j++)
+            {
+                sum[j] /= n;
+            }
+            llama_embd_normalize(sum, embeddings.data() + c * n_embd, n_embd, embd_normalize);
+        }
+        return endBatchJob() && ok;
+    }
 
-        pp_avg /= nr;
-        tg_avg /= nr;
-
-        if (nr > 1) {
-            pp_std = sqrt(pp_std / (nr - 1) - pp_avg * pp_avg * nr / (nr - 1));
-            tg_std = sqrt(tg_std / (nr - 1) - tg_avg * tg_avg * nr / (nr - 1));
-        } else {
-            pp_std = 0;
-            tg_std = 0;
+    // Legacy benchmark: [model desc, model size, n params, pp avg, pp std, tg avg, tg std]
+    // in tokens per second, for one configuration of the suite below
+    std::string bench(int pp, int tg, int pl, int nr)
+    {
+        llama_rn_bench_params bench_params;
+        bench_params.n_prompt = pp;
+        bench_params.n_gen = tg + 1; // the first token comes from the prefill
+        bench_params.n_reps = nr;
+        bench_params.cold = false;
+        bench_params.n_parallel = {pl};
+        const nlohmann::ordered_json result = benchSuite(bench_params);
+        if (!result.contains("results") || result["results"].empty() || !result["results"][0].contains("warm"))
+        {
+            return std::string("[]");
         }
+        const nlohmann::ordered_json &warm = result["results"][0]["warm"];
+        return nlohmann::ordered_json::array({
+            result["model"], result["model_size"], result["model_n_params"],
+            warm["pp_tps"]["avg"], warm["pp_tps"]["std"], warm["tg_tps"]["avg"], warm["tg_tps"]["std"],
+        }).dump();
+    }
 
-        if (is_interrupted) llama_kv_cache_clear(ctx);
+    // Benchmark suite, see bench_suite. It runs on contexts of its own, so the slots
+    // keep their KV cache, but it holds the slots for its whole duration so that
+    // nothing else competes for the CPU.
+    nlohmann::ordered_json benchSuite(const llama_rn_bench_params &bench_params)
+    {
+        std::lock_guard<std::mutex> lock(slots_mutex);
+        if (isPredicting())
+        {
+            LOG_ERROR("cannot benchmark while predicting", "");
+            return {{"error", "Context is busy"}};
+        }
+        is_predicting = true;
+        is_interrupted = false;
+        // the batch cores: a sweep past the generation thread count would crowd onto those
+        nlohmann::ordered_json result = bench_suite(model, llama_context_params_from_gpt_params(params), params.cpuparams_batch,
+                                                    bench_params, is_interrupted);
         is_predicting = false;
-
-        char model_desc[128];
-        llama_model_desc(model, model_desc, sizeof(model_desc));
-        return std::string("[\"") + model_desc + std::string("\",") +
-            std::to_string(llama_model_size(model)) + std::string(",") +
-            std::to_string(llama_model_n_params(model)) + std::string(",") +
-            std::to_string(pp_avg) + std::string(",") +
-            std::to_string(pp_std) + std::string(",") +
-            std::to_string(tg_avg) + std::string(",") +
-            std::to_string(tg_std) +
-            std::string("]");
+        return result;
     }
 
     
 // Context Shifting from KoboldCpp <https://github.com/LostRuins/koboldcpp>
 // Implementation obtained with special permission from @concedo
 
-std::vector<int> longest_common_subseq(const std::vector<int> x, const std::vector<int> y){
-     int m = x.size(), n = y.size();
-
-     //int LCSuff[m+1][n+1];
-     std::vector<std::vector<int>> LCSuff(m+1, std::vector<int>(n+1));
-
-     for (int j = 0; j <= n; j++)
-         LCSuff[0][j] = 0;
-     for (int i = 0; i <= m; i++)
-         LCSuff[i][0] = 0;
-
-     for (int i = 1; i <= m; i++)
-     {
-         for (int j = 1; j <= n; j++)
-         {
-             if (x[i - 1] == y[j - 1])
-                 LCSuff[i][j] = LCSuff[i - 1][j - 1] + 1;
-             else
-                 LCSuff[i][j] = 0;
-         }
-     }
-
-     std::vector<int> longest;
-     for (int i = 1; i <= m; i++)
-     {
-         for (int j = 1; j <= n; j++)
-         {
-             if (LCSuff[i][j] > longest.size())
-             {
-                 auto off1 = ((i - LCSuff[i][j] + 1) - 1);
-                 auto off2 = off1 + LCSuff[i][j];
-                 longest.clear();
-                //  std::vector<int>().swap(longest);
-                 longest = std::vector<int>(x.begin() + off1, x.begin() + off2);
-                // x.substr((i - LCSuff[i][j] + 1) - 1, LCSuff[i][j]);
-             }
-         }
-     }
-     return longest;
- }
-
-bool arr_start_with(const std::vector<int> targetArray, const std::vector<int> searchSeq)
- {
-     int ss = searchSeq.size();
-     if(targetArray.size()<ss)
-     {
-         return false;
-     }
-     for(int i=0;i<ss;++i)
-     {
-         if(targetArray[i]!=searchSeq[i])
-         {
-             return false;
-         }
-     }
-     return true;
- }
-
-int arr_find_index_of(const std::vector<int> targetArray, const std::vector<int> searchSeq)
- {
-     int ss = searchSeq.size();
-     int tas = targetArray.size();
-     if(tas<ss)
-     {
-         return -1;
-     }
-     for(int i=0;i<tas;++i)
-     {
-         int srch = 0;
-         bool fail = false;
-         for(int srch=0;srch<ss;++srch)
-         {
-             if ((i + srch) >= tas || targetArray[i + srch] != searchSeq[srch])
-             {
-                 fail = true;
-                 break;
-             }
-         }
-         if(!fail)
-         {
-             return i;
-         }
-     }
-     return -1;
- }
-
-void purge_missing_tokens(llama_context * ctx, std::vector<int> &current_context_tokens, std::vector<int> &new_context_tokens, const int genamt, const int nctx)
+void purge_missing_tokens(llama_context * ctx, llama_seq_id seq_id, std::vector<int> &current_context_tokens, const std::vector<int> &new_context_tokens, const int genamt, const int nctx)
 {
     //scan from start old and new ctx, until first mismatch found, save as p0
     //check remaining old and new ctx for longest common subseq, which needs to be at 256 tokens
@@ -774,7 +2740,7 @@ void purge_missing_tokens(llama_context * ctx, std::vector<int> &current_context
     int new_tokens_len = new_context_tokens.size();
     bool purge_needed = true;
 
-    for (int i = 0; i < current_context_tokens.size(); ++i)
+    for (int i = 0; i < current_context_tokens.size() && i < new_tokens_len; ++i)
     {
         if (current_context_tokens[i] == new_context_tokens[i])
         {
@@ -802,30 +2768,27 @@ void purge_missing_tokens(llama_context * ctx, std::vector<int> &current_context
     //at least this many tokens need to match, otherwise don't bother trimming
     const int lc_tok_threshold = std::max(std::min((new_tokens_len - trimstart) - (genamt+stack_allowance), (int)(nctx*0.45)), short_fall_threshold - stack_allowance);
 
-    auto curr_ctx_without_memory = std::vector<int>(current_context_tokens.begin() + trimstart, current_context_tokens.end());
-    auto new_ctx_without_memory = std::vector<int>(new_context_tokens.begin() + trimstart, new_context_tokens.end());
+    // the old tail is indexed once, the new tail is scanned against it in linear time
+    const token_suffix_automaton curr_ctx_without_memory(current_context_tokens.data() + trimstart, current_context_tokens.size() - trimstart);
+    const llama_token *new_ctx_without_memory = new_context_tokens.data() + trimstart;
 
-    auto shared = longest_common_subseq(curr_ctx_without_memory, new_ctx_without_memory);
+    const token_span shared = curr_ctx_without_memory.longestCommon(new_ctx_without_memory, new_tokens_len - trimstart);
 
-    if (shared.size() > lc_tok_threshold && arr_start_with(new_ctx_without_memory, shared)) // enough tokens in common
+    if ((int) shared.n > lc_tok_threshold && shared.pos_b == 0) // enough tokens in common, starting right after the memory
     {
-        int found = arr_find_index_of(current_context_tokens,shared);
+        int found = arr_find_index_of(current_context_tokens, new_ctx_without_memory, shared.n);
         if(found>=0 && found > trimstart)
         {
 
             //extract the unwanted tokens out from context and KV
             int diff = found - trimstart;
-            llama_kv_cache_seq_rm(ctx, 0, trimstart, trimstart + diff);
-            llama_kv_cache_seq_add(ctx, 0, trimstart + diff, -1, -diff);
+            llama_kv_cache_seq_rm(ctx, seq_id, trimstart, trimstart + diff);
+            llama_kv_cache_seq_add(ctx, seq_id, trimstart + diff, -1, -diff);
 
-            for (size_t i = trimstart + diff; i < current_context_tokens.size() - 1; i++)
-            {
-                current_context_tokens[i - diff] = current_context_tokens[i];
-            }
+            current_context_tokens.erase(current_context_tokens.begin() + trimstart, current_context_tokens.begin() + found);
 
             LOG_INFO("\n[Context Shifting: Erased %d tokens at position %d]", diff, trimstart + 1);
 
-            current_context_tokens.resize(current_context_tokens.size() - diff);
         }
     }
 
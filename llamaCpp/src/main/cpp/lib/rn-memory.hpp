@@ -0,0 +1,160 @@
+#ifndef RNLLAMA_MEMORY_H
+#define RNLLAMA_MEMORY_H
+
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include "llama.h"
+
+namespace rnllama {
+
+// Memory of the process from /proc/self/status, bytes (0 when not reported)
+struct llama_rn_process_memory
+{
+    size_t rss = 0;      // VmRSS
+    size_t rss_peak = 0; // VmHWM, the high-water mark of rss
+    size_t rss_anon = 0; // RssAnon: heap, the buffers of the contexts
+    size_t rss_file = 0; // RssFile: mapped files, the weights with mmap
+    size_t swap = 0;     // VmSwap (zram on Android)
+    size_t virt = 0;     // VmSize
+};
+
+static llama_rn_process_memory read_process_memory(const std::string &status_path = "/proc/self/status")
+{
+    llama_rn_process_memory memory;
+    FILE *fp = std::fopen(status_path.c_str(), "r");
+    if (fp == nullptr)
+    {
+        return memory;
+    }
+    const struct
+    {
+        const char *key;
+        size_t llama_rn_process_memory::*field;
+    } fields[] = {
+        {"VmRSS:", &llama_rn_process_memory::rss},
+        {"VmHWM:", &llama_rn_process_memory::rss_peak},
+        {"RssAnon:", &llama_rn_process_memory::rss_anon},
+        {"RssFile:", &llama_rn_process_memory::rss_file},
+        {"VmSwap:", &llama_rn_process_memory::swap},
+        {"VmSize:", &llama_rn_process_memory::virt},
+    };
+    char line[256];
+    while (std::fgets(line, sizeof(line), fp) != nullptr)
+    {
+        for (const auto &field : fields)
+        {
+            const size_t n = std::strlen(field.key);
+            if (std::strncmp(line, field.key, n) == 0)
+            {
+                memory.*field.field = (size_t) std::strtoull(line + n, nullptr, 10) * 1024;
+            }
+        }
+    }
+    std::fclose(fp);
+    return memory;
+}
+
+// Address space mapped from a file and the part of it in RAM, bytes
+struct llama_rn_file_mapping
+{
+    size_t mapped = 0;
+    size_t resident = 0;
+};
+
+// Sums the Size and Rss of the mappings of file_path in smaps. Pages of mmapped
+// weights are only read in when touched and may be dropped under memory pressure,
+// so resident can be well below mapped.
+static llama_rn_file_mapping read_file_mapping(const std::string &file_path, const std::string &smaps_path = "/proc/self/smaps")
+{
+    llama_rn_file_mapping mapping;
+    char resolved[PATH_MAX];
+    if (file_path.empty() || realpath(file_path.c_str(), resolved) == nullptr)
+    {
+        return mapping;
+    }
+    const std::string path = resolved;
+    FILE *fp = std::fopen(smaps_path.c_str(), "r");
+    if (fp == nullptr)
+    {
+        return mapping;
+    }
+    char line[PATH_MAX + 128];
+    bool in_file = false;
+    while (std::fgets(line, sizeof(line), fp) != nullptr)
+    {
+        unsigned long long kb;
+        if (std::sscanf(line, "Size: %llu kB", &kb) == 1)
+        {
+            mapping.mapped += in_file ? (size_t) kb * 1024 : 0;
+        }
+        else if (std::sscanf(line, "Rss: %llu kB", &kb) == 1)
+        {
+            mapping.resident += in_file ? (size_t) kb * 1024 : 0;
+        }
+        else
+        {
+            // fields are "Name: value", other lines start a mapping: address range,
+            // perms, offset, dev, inode, then the path
+            const char *space = std::strchr(line, ' ');
+            if (space == nullptr || space == line || space[-1] == ':')
+            {
+                continue;
+            }
+            std::string header = line;
+            while (!header.empty() && (header.back() == '\n' || header.back() == ' '))
+            {
+                header.pop_back();
+            }
+            in_file = header.size() > path.size() && header.compare(header.size() - path.size(), path.size(), path) == 0 &&
+                      header[header.size() - path.size() - 1] == ' ';
+        }
+    }
+    std::fclose(fp);
+    return mapping;
+}
+
+static size_t context_memory_total(const llama_context_memory &memory)
+{
+    return memory.kv_buffers + memory.compute + memory.compute_meta + memory.output;
+}
+
+// Memory of a context and of the process
+struct llama_rn_memory_report
+{
+    size_t model_bytes = 0;    // weights, llama_model_size
+    size_t model_mapped = 0;   // mmapped from the model file
+    size_t model_resident = 0; // in RAM: the resident part of the mapping, all of it without mmap
+    int model_refs = 1;        // contexts sharing the model, its memory counts once across them
+    llama_context_memory context = {};
+    int kv_cells_used = 0;
+    int kv_cells = 0;
+
+    // the draft model and its context, 0 without speculative decoding
+    size_t draft_model_bytes = 0;
+    size_t draft_model_resident = 0;
+    size_t draft_context_bytes = 0;
+
+    // KV states held in RAM by the prefix cache and the conversation store
+    size_t prefix_cache_bytes = 0;
+    size_t conversation_bytes = 0;
+    // n-gram counts of prompt lookup decoding
+    size_t lookup_cache_bytes = 0;
+
+    llama_rn_process_memory process;
+};
+
+// Weights loaded without mmap are all in RAM, in the process heap
+static void report_model_memory(const llama_model *model, const std::string &model_path, size_t &bytes, size_t &mapped, size_t &resident)
+{
+    bytes = llama_model_size(model);
+    const llama_rn_file_mapping mapping = read_file_mapping(model_path);
+    mapped = mapping.mapped;
+    resident = mapping.mapped > 0 ? mapping.resident : bytes;
+}
+
+}
+
+#endif /* RNLLAMA_MEMORY_H */
@@ -0,0 +1,159 @@
+#ifndef RNLLAMA_MODEL_REGISTRY_H
+#define RNLLAMA_MODEL_REGISTRY_H
+
+#include <sys/stat.h>
+#include <cstdio>
+#include <future>
+#include <map>
+#include <mutex>
+#include <string>
+#include "llama.h"
+
+namespace rnllama {
+
+// Models loaded by the contexts of the process, shared by the contexts loading the
+// same file with the same model parameters: the weights are read and held once, each
+// context only adds its KV cache and compute buffers. A model is freed with the
+// last context releasing it.
+struct llama_rn_model_registry
+{
+    struct entry
+    {
+        int refs = 0;
+        std::shared_future<llama_model *> model; // ready once the first acquire loaded it
+    };
+
+    std::mutex mutex;
+    std::map<std::string, entry> entries;
+    std::map<const llama_model *, std::string> keys;
+
+    // LoRA adapters are attached to the model, contexts sharing it load and free theirs
+    // one at a time
+    std::mutex adapter_mutex;
+
+    static llama_rn_model_registry &instance()
+    {
+        static llama_rn_model_registry registry;
+        return registry;
+    }
+
+    // The file by device and inode, so a path and a /proc/self/fd/N link to it are the
+    // same model, with its size and mtime to not reuse a model the file was replaced
+    // under; then the parameters that change what is loaded.
+    static std::string key(const std::string &path, const llama_model_params &mparams)
+    {
+        std::string key;
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0)
+        {
+            key = std::to_string((unsigned long long) st.st_dev) + ":" + std::to_string((unsigned long long) st.st_ino) + ":" +
+                  std::to_string((long long) st.st_size) + ":" + std::to_string((long long) st.st_mtime);
+        }
+        else
+        {
+            key = path;
+        }
+        char buf[128];
+        snprintf(buf, sizeof(buf), "|%d|%d|%d|%d%d%d%d", mparams.n_gpu_layers, (int) mparams.split_mode, mparams.main_gpu,
+                 mparams.vocab_only, mparams.use_mmap, mparams.use_mlock, mparams.check_tensors);
+        key += buf;
+        for (const llama_model_kv_override *kv = mparams.kv_overrides; kv != nullptr && kv->key[0] != 0; kv++)
+        {
+            key += std::string("|") + kv->key + "=";
+            switch (kv->tag)
+            {
+            case LLAMA_KV_OVERRIDE_TYPE_INT:
+                key += "i" + std::to_string((long long) kv->val_i64);
+                break;
+            case LLAMA_KV_OVERRIDE_TYPE_FLOAT:
+                snprintf(buf, sizeof(buf), "f%.17g", kv->val_f64);
+                key += buf;
+                break;
+            case LLAMA_KV_OVERRIDE_TYPE_BOOL:
+                key += kv->val_bool ? "b1" : "b0";
+                break;
+            case LLAMA_KV_OVERRIDE_TYPE_STR:
+                key += std::string("s") + kv->val_str;
+                break;
+            }
+        }
+        return key;
+    }
+
+    // The model of path, loaded by the first caller without holding the registry: the
+    // callers asking for it meanwhile wait for that load. shared is set when the model
+    // was already loaded for another context. nullptr when it fails to load.
+    llama_model *acquire(const std::string &path, const llama_model_params &mparams, bool &shared)
+    {
+        const std::string k = key(path, mparams);
+        std::promise<llama_model *> promise;
+        std::shared_future<llama_model *> model;
+        bool loading = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = entries.find(k);
+            if (it == entries.end())
+            {
+                it = entries.insert(std::make_pair(k, entry())).first;
+                it->second.model = promise.get_future().share();
+                loading = true;
+            }
+            it->second.refs++;
+            model = it->second.model;
+        }
+        shared = !loading;
+        if (loading)
+        {
+            llama_model *loaded = llama_load_model_from_file(path.c_str(), mparams);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (loaded != nullptr)
+            {
+                keys[loaded] = k;
+            }
+            else
+            {
+                // the waiters see the failure, the next acquire tries again
+                entries.erase(k);
+            }
+            promise.set_value(loaded);
+            return loaded;
+        }
+        return model.get();
+    }
+
+    // Frees the model with its last reference, a model not from acquire right away
+    void release(llama_model *model)
+    {
+        if (model == nullptr)
+        {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto key_it = keys.find(model);
+            if (key_it != keys.end())
+            {
+                auto it = entries.find(key_it->second);
+                if (--it->second.refs > 0)
+                {
+                    return;
+                }
+                entries.erase(it);
+                keys.erase(key_it);
+            }
+        }
+        llama_free_model(model);
+    }
+
+    // contexts holding the model, 0 for a model not from acquire
+    int refs(const llama_model *model)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto key_it = keys.find(model);
+        return key_it == keys.end() ? 0 : entries[key_it->second].refs;
+    }
+};
+
+}
+
+#endif /* RNLLAMA_MODEL_REGISTRY_H */
@@ -0,0 +1,264 @@
+#ifndef RNLLAMA_NGRAM_CACHE_H
+#define RNLLAMA_NGRAM_CACHE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "llama.h"
+
+namespace rnllama {
+
+static uint64_t ngram_hash(const llama_token *tokens, int n)
+{
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ (uint64_t) n;
+    for (int i = 0; i < n; i++)
+    {
+        h ^= (uint32_t) tokens[i];
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+    }
+    return h;
+}
+
+// Index of the n-grams of one token sequence (prompt plus generated tokens) for
+// prompt lookup decoding: when the last n tokens occurred before, the tokens that
+// followed that occurrence are proposed as a draft. Positions refer to the indexed
+// sequence, so the index is cleared whenever the sequence is edited anywhere but
+// at its end.
+struct llama_rn_ngram_index
+{
+    int n_min = 2; // a single matching token is too weak a signal
+    int n_max = 0;
+    size_t n_indexed = 0;
+    std::unordered_map<uint64_t, int32_t> last_end; // latest end position of each n-gram
+
+    void clear()
+    {
+        last_end.clear();
+        n_indexed = 0;
+    }
+
+    // index the n-grams ending before position n
+    void update(const std::vector<llama_token> &tokens, size_t n)
+    {
+        for (; n_indexed < n; n_indexed++)
+        {
+            for (int k = n_min; k <= n_max && (size_t) k <= n_indexed + 1; k++)
+            {
+                last_end[ngram_hash(tokens.data() + n_indexed + 1 - k, k)] = (int32_t) n_indexed;
+            }
+        }
+    }
+
+    // continuation of the longest earlier match of the sequence's suffix
+    std::vector<llama_token> draft(const std::vector<llama_token> &tokens, int n_draft)
+    {
+        std::vector<llama_token> result;
+        if (n_max <= 0 || tokens.empty() || n_draft <= 0)
+        {
+            return result;
+        }
+        update(tokens, tokens.size() - 1);
+        for (int k = std::min(n_max, (int) tokens.size() - 1); k >= n_min; k--)
+        {
+            const llama_token *suffix = tokens.data() + tokens.size() - k;
+            auto it = last_end.find(ngram_hash(suffix, k));
+            if (it == last_end.end())
+            {
+                continue;
+            }
+            const size_t end = it->second;
+            if (!std::equal(suffix, suffix + k, tokens.begin() + end + 1 - k))
+            {
+                continue; // hash collision
+            }
+            const size_t n = std::min((size_t) n_draft, tokens.size() - end - 1);
+            result.assign(tokens.begin() + end + 1, tokens.begin() + end + 1 + n);
+            break;
+        }
+        return result;
+    }
+};
+
+// Continuation counts of n-grams seen in previous completions, optionally kept in
+// a file across sessions. Used when the current sequence has no match of its own.
+struct llama_rn_ngram_cache
+{
+    typedef std::unordered_map<llama_token, int32_t> continuations;
+
+    // heap taken by an n-gram and by one of its continuations: the hash node, its
+    // bucket pointer and the value
+    static const size_t n_bytes_ngram = 3 * sizeof(void *) + sizeof(uint64_t) + sizeof(continuations);
+    static const size_t n_bytes_continuation = 3 * sizeof(void *) + 2 * sizeof(int32_t);
+
+    int n = 0;                             // n-gram length, 0 disables the cache
+    size_t n_bytes_max = 16 * 1024 * 1024; // new n-grams and continuations are ignored past this
+    size_t n_bytes = 0;                    // estimated from the counts held
+    int32_t n_count_min = 2;               // continuations seen less often are not proposed
+    std::unordered_map<uint64_t, continuations> counts;
+
+    bool enabled() const
+    {
+        return n > 0;
+    }
+
+    // the continuation count of key and next, nullptr when adding it would exceed n_bytes_max
+    static int32_t *count(std::unordered_map<uint64_t, continuations> &counts, size_t &n_bytes, size_t n_bytes_max,
+                          uint64_t key, llama_token next)
+    {
+        auto it = counts.find(key);
+        if (it == counts.end())
+        {
+            if (n_bytes + n_bytes_ngram + n_bytes_continuation > n_bytes_max)
+            {
+                return nullptr;
+            }
+            it = counts.emplace(key, continuations()).first;
+            n_bytes += n_bytes_ngram;
+        }
+        auto cont = it->second.find(next);
+        if (cont == it->second.end())
+        {
+            if (n_bytes + n_bytes_continuation > n_bytes_max)
+            {
+                return nullptr;
+            }
+            cont = it->second.emplace(next, 0).first;
+            n_bytes += n_bytes_continuation;
+        }
+        return &cont->second;
+    }
+
+    void update(const std::vector<llama_token> &tokens)
+    {
+        if (!enabled())
+        {
+            return;
+        }
+        for (size_t i = n; i < tokens.size(); i++)
+        {
+            int32_t *c = count(counts, n_bytes, n_bytes_max, ngram_hash(tokens.data() + i - n, n), tokens[i]);
+            if (c != nullptr)
+            {
+                (*c)++;
+            }
+        }
+    }
+
+    // follow the dominant continuation of the last n tokens for up to n_draft tokens
+    std::vector<llama_token> draft(const std::vector<llama_token> &tokens, int n_draft) const
+    {
+        std::vector<llama_token> result;
+        if (!enabled() || tokens.size() < (size_t) n)
+        {
+            return result;
+        }
+        std::vector<llama_token> window(tokens.end() - n, tokens.end());
+        while ((int) result.size() < n_draft)
+        {
+            auto it = counts.find(ngram_hash(window.data(), n));
+            if (it == counts.end())
+            {
+                break;
+            }
+            llama_token best = -1;
+            int32_t best_count = 0;
+            int32_t total = 0;
+            for (const auto &cont : it->second)
+            {
+                total += cont.second;
+                if (cont.second > best_count)
+                {
+                    best = cont.first;
+                    best_count = cont.second;
+                }
+            }
+            if (best_count < n_count_min || 2 * best_count <= total)
+            {
+                break;
+            }
+            result.push_back(best);
+            window.erase(window.begin());
+            window.push_back(best);
+        }
+        return result;
+    }
+
+    // a file larger than n_bytes_max is loaded up to it
+    bool load(const std::string &path)
+    {
+        FILE *fp = fopen(path.c_str(), "rb");
+        if (fp == nullptr)
+        {
+            return false;
+        }
+        char magic[4];
+        uint32_t version = 0;
+        int32_t n_file = 0;
+        uint64_t n_keys = 0;
+        bool ok = fread(magic, 1, 4, fp) == 4 && memcmp(magic, "RNNG", 4) == 0 &&
+                  fread(&version, sizeof(version), 1, fp) == 1 && version == 1 &&
+                  fread(&n_file, sizeof(n_file), 1, fp) == 1 && n_file == n &&
+                  fread(&n_keys, sizeof(n_keys), 1, fp) == 1;
+        std::unordered_map<uint64_t, continuations> loaded;
+        size_t n_bytes_loaded = 0;
+        for (uint64_t i = 0; ok && i < n_keys; i++)
+        {
+            uint64_t key = 0;
+            uint32_t n_cont = 0;
+            ok = fread(&key, sizeof(key), 1, fp) == 1 && fread(&n_cont, sizeof(n_cont), 1, fp) == 1;
+            for (uint32_t j = 0; ok && j < n_cont; j++)
+            {
+                int32_t cont[2];
+                ok = fread(cont, sizeof(int32_t), 2, fp) == 2;
+                int32_t *c = ok ? count(loaded, n_bytes_loaded, n_bytes_max, key, cont[0]) : nullptr;
+                if (c != nullptr)
+                {
+                    *c = cont[1];
+                }
+            }
+        }
+        fclose(fp);
+        if (ok)
+        {
+            counts.swap(loaded);
+            n_bytes = n_bytes_loaded;
+        }
+        return ok;
+    }
+
+    bool save(const std::string &path) const
+    {
+        FILE *fp = fopen(path.c_str(), "wb");
+        if (fp == nullptr)
+        {
+            return false;
+        }
+        const uint32_t version = 1;
+        const int32_t n_file = n;
+        const uint64_t n_keys = counts.size();
+        bool ok = fwrite("RNNG", 1, 4, fp) == 4 &&
+                  fwrite(&version, sizeof(version), 1, fp) == 1 &&
+                  fwrite(&n_file, sizeof(n_file), 1, fp) == 1 &&
+                  fwrite(&n_keys, sizeof(n_keys), 1, fp) == 1;
+        for (auto it = counts.begin(); ok && it != counts.end(); ++it)
+        {
+            const uint32_t n_cont = it->second.size();
+            ok = fwrite(&it->first, sizeof(it->first), 1, fp) == 1 && fwrite(&n_cont, sizeof(n_cont), 1, fp) == 1;
+            for (auto cont = it->second.begin(); ok && cont != it->second.end(); ++cont)
+            {
+                const int32_t data[2] = {cont->first, cont->second};
+                ok = fwrite(data, sizeof(int32_t), 2, fp) == 2;
+            }
+        }
+        return fclose(fp) == 0 && ok;
+    }
+};
+
+}
+
+#endif /* RNLLAMA_NGRAM_CACHE_H */
@@ -0,0 +1,325 @@
+#ifndef RNLLAMA_PLANNER_H
+#define RNLLAMA_PLANNER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
+#include "common.h"
+#include "ggml.h"
+
+namespace rnllama {
+
+// Hyperparameters sizing a context, read from the GGUF header without loading tensors
+struct llama_rn_model_info
+{
+    std::string arch;
+    uint32_t n_layer = 0;
+    uint32_t n_embd = 0;
+    uint32_t n_head = 0;
+    uint32_t n_head_kv = 0;
+    uint32_t n_embd_head_k = 0;
+    uint32_t n_embd_head_v = 0;
+    uint32_t n_ff = 0;
+    uint32_t n_vocab = 0;
+    uint32_t n_ctx_train = 0;
+    size_t n_bytes = 0; // file size, resident once the weights are paged in
+
+    // KV cache bytes of one token (all layers) with these cache types
+    size_t kvBytesPerToken(lm_ggml_type type_k, lm_ggml_type type_v) const
+    {
+        return (size_t) n_layer * (lm_ggml_row_size(type_k, (int64_t) n_embd_head_k * n_head_kv) +
+                                   lm_ggml_row_size(type_v, (int64_t) n_embd_head_v * n_head_kv));
+    }
+
+    // Compute buffer of the worst-case graph, as reserved by llama_new_context_with_model:
+    // activations and logits of n_ubatch tokens, the KQ mask over the whole context (and
+    // its F16 copy with flash attention), and without flash attention the attention
+    // scores of every head.
+    size_t computeBytes(int n_ctx, int n_ubatch, bool flash_attn) const
+    {
+        size_t n_bytes_compute = (size_t) n_ubatch * (n_vocab + 2 * n_ff + 4 * n_embd) * sizeof(float);
+        if (flash_attn)
+        {
+            n_bytes_compute += (size_t) n_ubatch * n_ctx * (sizeof(float) + sizeof(lm_ggml_fp16_t));
+        }
+        else
+        {
+            n_bytes_compute += (size_t) n_ubatch * n_ctx * (n_head + 1) * sizeof(float);
+        }
+        return n_bytes_compute;
+    }
+
+    bool read(const std::string &path)
+    {
+        struct lm_gguf_init_params params = {/*.no_alloc =*/ true, /*.ctx =*/ nullptr};
+        struct lm_gguf_context *gguf = lm_gguf_init_from_file(path.c_str(), params);
+        if (gguf == nullptr)
+        {
+            return false;
+        }
+        const int arch_id = lm_gguf_find_key(gguf, "general.architecture");
+        arch = arch_id >= 0 ? lm_gguf_get_val_str(gguf, arch_id) : "";
+        n_layer = readUint(gguf, arch + ".block_count", 0);
+        n_embd = readUint(gguf, arch + ".embedding_length", 0);
+        n_head = readUint(gguf, arch + ".attention.head_count", 1);
+        n_head_kv = readUint(gguf, arch + ".attention.head_count_kv", n_head);
+        n_embd_head_k = readUint(gguf, arch + ".attention.key_length", n_head > 0 ? n_embd / n_head : 0);
+        n_embd_head_v = readUint(gguf, arch + ".attention.value_length", n_embd_head_k);
+        n_ff = readUint(gguf, arch + ".feed_forward_length", 4 * n_embd);
+        n_ctx_train = readUint(gguf, arch + ".context_length", 2048);
+        const int tokens_id = lm_gguf_find_key(gguf, "tokenizer.ggml.tokens");
+        n_vocab = readUint(gguf, arch + ".vocab_size", tokens_id >= 0 ? lm_gguf_get_arr_n(gguf, tokens_id) : 0);
+        lm_gguf_free(gguf);
+
+        struct stat st;
+        n_bytes = stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+        return n_layer > 0 && n_embd > 0;
+    }
+
+private:
+    // integer value, or the largest of a per-layer array
+    static uint32_t readUint(const struct lm_gguf_context *gguf, const std::string &key, uint32_t default_value)
+    {
+        const int id = lm_gguf_find_key(gguf, key.c_str());
+        if (id < 0)
+        {
+            return default_value;
+        }
+        switch (lm_gguf_get_kv_type(gguf, id))
+        {
+            case LM_GGUF_TYPE_UINT32:
+                return lm_gguf_get_val_u32(gguf, id);
+            case LM_GGUF_TYPE_INT32:
+                return std::max(0, lm_gguf_get_val_i32(gguf, id));
+            case LM_GGUF_TYPE_ARRAY:
+            {
+                const enum lm_gguf_type type = lm_gguf_get_arr_type(gguf, id);
+                if (type != LM_GGUF_TYPE_UINT32 && type != LM_GGUF_TYPE_INT32)
+                {
+                    return default_value;
+                }
+                const uint32_t *values = (const uint32_t *) lm_gguf_get_arr_data(gguf, id);
+                uint32_t value = 0;
+                for (int i = 0; i < lm_gguf_get_arr_n(gguf, id); i++)
+                {
+                    value = std::max(value, values[i]);
+                }
+                return value;
+            }
+            default:
+                return default_value;
+        }
+    }
+};
+
+// Memory the system can give without swapping: MemAvailable, or free plus buffers
+// on kernels without it
+static size_t available_memory()
+{
+    FILE *fp = std::fopen("/proc/meminfo", "r");
+    if (fp != nullptr)
+    {
+        char line[128];
+        unsigned long long kb = 0;
+        bool found = false;
+        while (!found && std::fgets(line, sizeof(line), fp) != nullptr)
+        {
+            found = std::sscanf(line, "MemAvailable: %llu kB", &kb) == 1;
+        }
+        std::fclose(fp);
+        if (found)
+        {
+            return (size_t) kb * 1024;
+        }
+    }
+    struct sysinfo info;
+    if (sysinfo(&info) == 0)
+    {
+        return (size_t) (info.freeram + info.bufferram) * info.mem_unit;
+    }
+    return 0;
+}
+
+// gpt_params cache type names (common.cpp keeps its own parser static)
+static lm_ggml_type plan_cache_type(const std::string &name)
+{
+    static const lm_ggml_type types[] = {
+        LM_GGML_TYPE_F32, LM_GGML_TYPE_F16, LM_GGML_TYPE_Q8_0, LM_GGML_TYPE_Q4_0,
+        LM_GGML_TYPE_Q4_1, LM_GGML_TYPE_IQ4_NL, LM_GGML_TYPE_Q5_0, LM_GGML_TYPE_Q5_1,
+    };
+    for (lm_ggml_type type : types)
+    {
+        if (name == lm_ggml_type_name(type))
+        {
+            return type;
+        }
+    }
+    return LM_GGML_TYPE_F16;
+}
+
+// Context parameters fitting a memory budget, with the bytes projected for each part
+struct llama_rn_plan
+{
+    int n_ctx = 0;
+    int n_ubatch = 0;
+    std::string type_k = "f16";
+    std::string type_v = "f16";
+    bool flash_attn = false;
+    bool use_mmap = true;
+    bool use_mlock = false;
+
+    size_t n_bytes_weights = 0; // model and draft model files
+    size_t n_bytes_kv = 0;
+    size_t n_bytes_compute = 0;
+    size_t n_bytes_output = 0;  // logits of the outputs reserved at creation
+    size_t n_bytes_caches = 0;  // prefix and conversation caches at their budgets
+    size_t n_bytes_budget = 0;
+    size_t n_bytes_available = 0;
+    bool fits = false;
+
+    size_t total() const
+    {
+        return n_bytes_weights + n_bytes_kv + n_bytes_compute + n_bytes_output + n_bytes_caches;
+    }
+};
+
+// Choose the largest context up to params.n_ctx (the trained context when 0) that
+// fits in n_bytes_budget, or 3/4 of the available memory when 0. Precision is given
+// up in steps: a smaller physical batch first (not for embeddings), then Q8_0 and
+// Q4_0 KV cache types (quantized V needs flash attention). Cache types set in params
+// are kept as is. When nothing fits, the smallest plan is returned with fits == false.
+static llama_rn_plan plan_context(const gpt_params &params, size_t n_bytes_budget, size_t n_bytes_caches)
+{
+    llama_rn_plan plan;
+    plan.n_bytes_available = available_memory();
+    plan.n_bytes_budget = n_bytes_budget > 0 ? n_bytes_budget : plan.n_bytes_available / 4 * 3;
+    plan.n_bytes_caches = n_bytes_caches;
+
+    llama_rn_model_info model;
+    if (!model.read(params.model))
+    {
+        return plan;
+    }
+    llama_rn_model_info draft;
+    const bool has_draft = !params.model_draft.empty() && draft.read(params.model_draft);
+    plan.n_bytes_weights = model.n_bytes + (has_draft ? draft.n_bytes : 0);
+
+    struct cache_types
+    {
+        const char *k;
+        const char *v;
+    };
+    std::vector<cache_types> candidates;
+    if (!params.cache_type_k.empty() && !params.cache_type_v.empty())
+    {
+        candidates.push_back({params.cache_type_k.c_str(), params.cache_type_v.c_str()});
+    }
+    else
+    {
+        // llama.cpp limits: whole blocks per head for K, flash attention for V
+        const bool quantize_k = model.n_embd_head_k % lm_ggml_blck_size(LM_GGML_TYPE_Q8_0) == 0;
+        const bool quantize_v = quantize_k && model.n_embd_head_k == model.n_embd_head_v && model.arch != "grok";
+        candidates.push_back({"f16", "f16"});
+        if (quantize_k)
+        {
+            candidates.push_back({"q8_0", quantize_v ? "q8_0" : "f16"});
+            candidates.push_back({"q4_0", quantize_v ? "q4_0" : "f16"});
+        }
+    }
+
+    const int n_ctx_step = 256;
+    const int n_ctx_target = params.n_ctx > 0 ? params.n_ctx : (int) model.n_ctx_train;
+    const int n_ctx_min = std::min(n_ctx_target, n_ctx_step);
+    const int n_outputs = std::max(1, params.n_parallel) * (params.n_draft + 1);
+    plan.n_bytes_output = (size_t) model.n_vocab * sizeof(float) * n_outputs;
+    const int n_ubatch_max = std::max(1, std::min(params.n_batch, params.n_ubatch));
+    // embedding models attending both ways need every input in one physical batch
+    const int n_ubatch_min = params.embedding ? n_ubatch_max : std::min(n_ubatch_max, 64);
+
+    bool found = false;
+    for (const cache_types &types : candidates)
+    {
+        const lm_ggml_type type_k = plan_cache_type(types.k);
+        const lm_ggml_type type_v = plan_cache_type(types.v);
+        const bool flash_attn = params.flash_attn || type_v != LM_GGML_TYPE_F16;
+        size_t kv_per_token = model.kvBytesPerToken(type_k, type_v);
+        if (has_draft)
+        {
+            kv_per_token += draft.kvBytesPerToken(type_k, type_v);
+        }
+        for (int n_ubatch = n_ubatch_max; n_ubatch >= n_ubatch_min; n_ubatch /= 2)
+        {
+            // everything but the context-sized parts, then the context these leave room for
+            size_t n_bytes_fixed = plan.n_bytes_weights + plan.n_bytes_output + n_bytes_caches + model.computeBytes(0, n_ubatch, flash_attn);
+            size_t per_token = kv_per_token + model.computeBytes(1, n_ubatch, flash_attn) - model.computeBytes(0, n_ubatch, flash_attn);
+            if (has_draft)
+            {
+                n_bytes_fixed += draft.computeBytes(0, n_ubatch, flash_attn);
+                per_token += draft.computeBytes(1, n_ubatch, flash_attn) - draft.computeBytes(0, n_ubatch, flash_attn);
+            }
+            const size_t n_fit = plan.n_bytes_budget > n_bytes_fixed ? (plan.n_bytes_budget - n_bytes_fixed) / per_token : 0;
+            const int n_ctx = n_fit >= (size_t) n_ctx_target ? n_ctx_target : (int) (n_fit / n_ctx_step * n_ctx_step);
+            // the first plan reaching the target wins, otherwise the one with the most context
+            if (n_ctx >= n_ctx_min && (!found || n_ctx > plan.n_ctx))
+            {
+                found = true;
+                plan.n_ctx = n_ctx;
+                plan.n_ubatch = n_ubatch;
+                plan.type_k = types.k;
+                plan.type_v = types.v;
+                plan.flash_attn = flash_attn;
+                plan.n_bytes_kv = kv_per_token * n_ctx;
+                plan.n_bytes_compute = model.computeBytes(n_ctx, n_ubatch, flash_attn) + (has_draft ? draft.computeBytes(n_ctx, n_ubatch, flash_attn) : 0);
+            }
+            if (found && plan.n_ctx == n_ctx_target)
+            {
+                break;
+            }
+        }
+        if (found && plan.n_ctx == n_ctx_target)
+        {
+            break;
+        }
+    }
+    if (!found)
+    {
+        const cache_types &types = candidates.back();
+        const lm_ggml_type type_k = plan_cache_type(types.k);
+        const lm_ggml_type type_v = plan_cache_type(types.v);
+        plan.n_ctx = n_ctx_min;
+        plan.n_ubatch = n_ubatch_min;
+        plan.type_k = types.k;
+        plan.type_v = types.v;
+        plan.flash_attn = params.flash_attn || type_v != LM_GGML_TYPE_F16;
+        plan.n_bytes_kv = (model.kvBytesPerToken(type_k, type_v) + (has_draft ? draft.kvBytesPerToken(type_k, type_v) : 0)) * plan.n_ctx;
+        plan.n_bytes_compute = model.computeBytes(plan.n_ctx, plan.n_ubatch, plan.flash_attn) +
+                               (has_draft ? draft.computeBytes(plan.n_ctx, plan.n_ubatch, plan.flash_attn) : 0);
+    }
+    plan.fits = found;
+    // mapped weights can be paged out under pressure instead of the process being killed
+    plan.use_mmap = params.use_mmap || !plan.fits;
+    // pinning the weights is only safe with room to spare for the rest of the system
+    plan.use_mlock = params.use_mlock && plan.fits && plan.total() <= plan.n_bytes_available / 2;
+    return plan;
+}
+
+static void apply_plan(const llama_rn_plan &plan, gpt_params &params)
+{
+    params.n_ctx = plan.n_ctx;
+    params.n_ubatch = plan.n_ubatch;
+    params.n_batch = std::max(params.n_batch, plan.n_ubatch);
+    params.cache_type_k = plan.type_k;
+    params.cache_type_v = plan.type_v;
+    params.flash_attn = plan.flash_attn;
+    params.use_mmap = plan.use_mmap;
+    params.use_mlock = plan.use_mlock;
+}
+
+}
+
+#endif /* RNLLAMA_PLANNER_H */
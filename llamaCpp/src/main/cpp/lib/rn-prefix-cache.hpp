@@ -0,0 +1,240 @@
+#ifndef RNLLAMA_PREFIX_CACHE_H
+#define RNLLAMA_PREFIX_CACHE_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
+#include "llama.h"
+
+namespace rnllama {
+
+// Radix tree of token prefixes whose nodes can hold a snapshot of the KV cache
+// of one sequence (llama_state_seq_get_data) right after that prefix was decoded.
+// Any snapshot below the point where a new prompt leaves the tree shares the
+// matched prefix, so restoring it and trimming the sequence skips the prefill.
+struct llama_rn_prefix_cache
+{
+    struct node
+    {
+        std::vector<llama_token> edge; // tokens on the edge from the parent
+        std::map<llama_token, std::unique_ptr<node>> children;
+        node *parent = nullptr;
+        size_t depth = 0;              // prefix length at the end of the edge
+        std::vector<uint8_t> state;    // empty if this prefix has no snapshot
+        int64_t t_last_used = 0;
+    };
+
+    struct match
+    {
+        node *snapshot = nullptr; // node whose state should be restored
+        size_t n_tokens = 0;      // prompt tokens covered by the restored sequence
+    };
+
+    node root;
+    size_t n_bytes = 0;
+    size_t n_bytes_max = 0;       // 0 disables the cache
+    size_t n_min_tokens = 64;     // shorter prefixes are cheaper to decode than to copy
+    size_t n_snapshots = 0;
+
+    bool enabled() const
+    {
+        return n_bytes_max > 0;
+    }
+
+    // Longest prefix of tokens that some snapshot can provide.
+    match find(const std::vector<llama_token> &tokens)
+    {
+        node *cur = &root;
+        node *subtree = &root;
+        size_t i = 0;
+        while (i < tokens.size())
+        {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end())
+            {
+                subtree = cur;
+                break;
+            }
+            node *child = it->second.get();
+            size_t k = 0;
+            while (k < child->edge.size() && i + k < tokens.size() && child->edge[k] == tokens[i + k])
+            {
+                k++;
+            }
+            i += k;
+            subtree = child;
+            if (k < child->edge.size())
+            {
+                break;
+            }
+            cur = child;
+        }
+
+        match result;
+        // every snapshot below the divergence point starts with tokens[0, i)
+        node *best = shallowestSnapshot(subtree);
+        if (best != nullptr && i > 0)
+        {
+            result.snapshot = best;
+            result.n_tokens = i;
+            return result;
+        }
+        // otherwise fall back to the deepest snapshot on the matched path
+        for (node *n = subtree->depth <= i ? subtree : subtree->parent; n != nullptr && n != &root; n = n->parent)
+        {
+            if (!n->state.empty())
+            {
+                result.snapshot = n;
+                result.n_tokens = n->depth;
+                break;
+            }
+        }
+        return result;
+    }
+
+    void touch(node *n, int64_t t_now)
+    {
+        n->t_last_used = t_now;
+    }
+
+    void insert(const std::vector<llama_token> &tokens, std::vector<uint8_t> &&state, int64_t t_now)
+    {
+        if (tokens.empty() || state.size() > n_bytes_max)
+        {
+            return;
+        }
+        node *cur = &root;
+        size_t i = 0;
+        while (i < tokens.size())
+        {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end())
+            {
+                node *leaf = new node();
+                leaf->edge.assign(tokens.begin() + i, tokens.end());
+                leaf->parent = cur;
+                leaf->depth = tokens.size();
+                cur->children[tokens[i]] = std::unique_ptr<node>(leaf);
+                cur = leaf;
+                i = tokens.size();
+                break;
+            }
+            node *child = it->second.get();
+            size_t k = 0;
+            while (k < child->edge.size() && i + k < tokens.size() && child->edge[k] == tokens[i + k])
+            {
+                k++;
+            }
+            if (k < child->edge.size())
+            {
+                split(child, k);
+                child = child->parent;
+            }
+            i += k;
+            cur = child;
+        }
+
+        if (!cur->state.empty())
+        {
+            n_bytes -= cur->state.size();
+            n_snapshots--;
+        }
+        cur->state = std::move(state);
+        cur->t_last_used = t_now;
+        n_bytes += cur->state.size();
+        n_snapshots++;
+
+        while (n_bytes > n_bytes_max)
+        {
+            node *lru = leastRecentlyUsed(&root, nullptr);
+            if (lru == nullptr)
+            {
+                break;
+            }
+            drop(lru);
+        }
+    }
+
+    void clear()
+    {
+        root.children.clear();
+        n_bytes = 0;
+        n_snapshots = 0;
+    }
+
+private:
+    // insert an internal node after the first `at` tokens of n's edge
+    void split(node *n, size_t at)
+    {
+        node *parent = n->parent;
+        std::unique_ptr<node> owned = std::move(parent->children[n->edge[0]]);
+
+        node *mid = new node();
+        mid->edge.assign(n->edge.begin(), n->edge.begin() + at);
+        mid->parent = parent;
+        mid->depth = n->depth - n->edge.size() + at;
+
+        n->edge.erase(n->edge.begin(), n->edge.begin() + at);
+        n->parent = mid;
+        mid->children[n->edge[0]] = std::move(owned);
+        parent->children[mid->edge[0]] = std::unique_ptr<node>(mid);
+    }
+
+    void drop(node *n)
+    {
+        n_bytes -= n->state.size();
+        n_snapshots--;
+        std::vector<uint8_t>().swap(n->state);
+
+        // prune the now useless branch and keep the tree path-compressed
+        while (n != &root && n->state.empty() && n->children.empty())
+        {
+            node *parent = n->parent;
+            parent->children.erase(n->edge[0]);
+            n = parent;
+        }
+        if (n != &root && n->state.empty() && n->children.size() == 1)
+        {
+            std::unique_ptr<node> child = std::move(n->children.begin()->second);
+            child->edge.insert(child->edge.begin(), n->edge.begin(), n->edge.end());
+            child->parent = n->parent;
+            n->parent->children[n->edge[0]] = std::move(child);
+        }
+    }
+
+    static node *shallowestSnapshot(node *n)
+    {
+        if (!n->state.empty())
+        {
+            return n;
+        }
+        node *best = nullptr;
+        for (auto &it : n->children)
+        {
+            node *candidate = shallowestSnapshot(it.second.get());
+            if (candidate != nullptr && (best == nullptr || candidate->depth < best->depth))
+            {
+                best = candidate;
+            }
+        }
+        return best;
+    }
+
+    static node *leastRecentlyUsed(node *n, node *best)
+    {
+        if (!n->state.empty() && (best == nullptr || n->t_last_used < best->t_last_used))
+        {
+            best = n;
+        }
+        for (auto &it : n->children)
+        {
+            best = leastRecentlyUsed(it.second.get(), best);
+        }
+        return best;
+    }
+};
+
+}
+
+#endif /* RNLLAMA_PREFIX_CACHE_H */
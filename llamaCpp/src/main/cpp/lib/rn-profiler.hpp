@@ -0,0 +1,279 @@
+#ifndef RNLLAMA_PROFILER_H
+#define RNLLAMA_PROFILER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "ggml.h"
+#include "json.hpp"
+
+namespace rnllama {
+
+// Time of a group of graph nodes: wall is from the first thread starting a node to
+// the last one finishing it, busy is the sum over threads (wall * n_threads when
+// the work is evenly split, less when threads wait at the barrier)
+struct llama_rn_profile_stat
+{
+    int64_t count = 0;
+    int64_t wall_us = 0;
+    int64_t busy_us = 0;
+    int64_t cycles = 0;       // summed over threads, 0 without perf counters
+    int64_t cache_misses = 0;
+};
+
+// Collects the node timings of every graph computed while it is set on a context
+// (llama_set_profile_callback): aggregated by op, by tensor name and by layer, and
+// the raw events, up to max_trace_events, for a Chrome trace.
+struct llama_rn_profiler
+{
+    struct trace_event
+    {
+        int32_t name; // index in names
+        int32_t ith;
+        int64_t ts;   // us since the profiler started
+        int64_t dur;
+        int64_t cycles;
+        int64_t cache_misses;
+    };
+
+    std::mutex mutex;
+    bool counters = false;     // perf counters were requested
+    bool has_counters = false; // and could be read
+    size_t max_trace_events = 0;
+    int64_t t_start_us = 0;
+    size_t n_graphs = 0;
+    size_t n_dropped = 0; // events over max_trace_events
+    int64_t total_wall_us = 0;
+
+    std::vector<std::string> names; // full node names, the first one per name seen
+    std::vector<std::string> name_ops;
+    std::map<std::string, int32_t> name_ids;
+    std::vector<trace_event> trace;
+
+    std::map<std::string, llama_rn_profile_stat> by_op;
+    std::map<std::string, llama_rn_profile_stat> by_name; // without the layer suffix
+    std::map<int, llama_rn_profile_stat> by_layer;        // -1: nodes outside of a layer
+
+    llama_rn_profiler(bool counters, size_t max_trace_events)
+        : counters(counters), max_trace_events(max_trace_events), t_start_us(lm_ggml_time_us())
+    {
+    }
+
+    static void callback(lm_ggml_cgraph *cgraph, const lm_ggml_profile_event *events, int n_threads, void *data)
+    {
+        static_cast<llama_rn_profiler *>(data)->add(cgraph, events, n_threads);
+    }
+
+    // llama.cpp names a layer's tensors "<name>-<layer>", views append " (view)" and the like
+    static void split_name(const std::string &name, std::string &base, int &layer)
+    {
+        base = name.substr(0, name.find(" ("));
+        layer = -1;
+        const size_t dash = base.rfind('-');
+        if (dash != std::string::npos && dash + 1 < base.size() &&
+            base.find_first_not_of("0123456789", dash + 1) == std::string::npos)
+        {
+            layer = std::atoi(base.c_str() + dash + 1);
+            base.erase(dash);
+        }
+    }
+
+    void add(lm_ggml_cgraph *cgraph, const lm_ggml_profile_event *events, int n_threads)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        const int n_nodes = lm_ggml_graph_n_nodes(cgraph);
+        n_graphs++;
+        for (int i = 0; i < n_nodes; i++)
+        {
+            const lm_ggml_tensor *node = lm_ggml_graph_node(cgraph, i);
+            llama_rn_profile_stat node_stat;
+            int64_t t_first = INT64_MAX;
+            int64_t t_last = 0;
+            for (int ith = 0; ith < n_threads; ith++)
+            {
+                const lm_ggml_profile_event &event = events[(size_t) ith * n_nodes + i];
+                if (event.t_start_us == 0)
+                {
+                    continue;
+                }
+                t_first = std::min(t_first, event.t_start_us);
+                t_last = std::max(t_last, event.t_end_us);
+                node_stat.busy_us += event.t_end_us - event.t_start_us;
+                if (event.cycles >= 0)
+                {
+                    has_counters = true;
+                    node_stat.cycles += event.cycles;
+                }
+                if (event.cache_misses >= 0)
+                {
+                    node_stat.cache_misses += event.cache_misses;
+                }
+            }
+            if (t_last == 0)
+            {
+                continue; // aborted before the node
+            }
+            node_stat.count = 1;
+            node_stat.wall_us = t_last - t_first;
+            total_wall_us += node_stat.wall_us;
+
+            const std::string op = lm_ggml_op_desc(node);
+            std::string base;
+            int layer;
+            split_name(node->name, base, layer);
+            merge(by_op[op], node_stat);
+            merge(by_name[base], node_stat);
+            merge(by_layer[layer], node_stat);
+
+            if (max_trace_events == 0)
+            {
+                continue;
+            }
+            auto it = name_ids.find(node->name);
+            if (it == name_ids.end())
+            {
+                it = name_ids.insert(std::make_pair(std::string(node->name), (int32_t) names.size())).first;
+                names.push_back(node->name);
+                name_ops.push_back(op);
+            }
+            for (int ith = 0; ith < n_threads; ith++)
+            {
+                const lm_ggml_profile_event &event = events[(size_t) ith * n_nodes + i];
+                if (event.t_start_us == 0)
+                {
+                    continue;
+                }
+                if (trace.size() >= max_trace_events)
+                {
+                    n_dropped++;
+                    continue;
+                }
+                trace.push_back({it->second, ith, event.t_start_us - t_start_us, event.t_end_us - event.t_start_us,
+                                 event.cycles, event.cache_misses});
+            }
+        }
+    }
+
+    static void merge(llama_rn_profile_stat &into, const llama_rn_profile_stat &stat)
+    {
+        into.count += stat.count;
+        into.wall_us += stat.wall_us;
+        into.busy_us += stat.busy_us;
+        into.cycles += stat.cycles;
+        into.cache_misses += stat.cache_misses;
+    }
+
+    // the stats of a map, largest wall time first
+    template <typename K>
+    static std::vector<std::pair<K, llama_rn_profile_stat>> sorted(const std::map<K, llama_rn_profile_stat> &stats)
+    {
+        std::vector<std::pair<K, llama_rn_profile_stat>> rows(stats.begin(), stats.end());
+        std::stable_sort(rows.begin(), rows.end(), [](const std::pair<K, llama_rn_profile_stat> &a, const std::pair<K, llama_rn_profile_stat> &b) {
+            return a.second.wall_us > b.second.wall_us;
+        });
+        return rows;
+    }
+
+    void appendRow(std::string &out, const std::string &key, const llama_rn_profile_stat &stat) const
+    {
+        char line[256];
+        snprintf(line, sizeof(line), "%-28s %8lld %10.2f %6.1f %10.2f %9.1f", key.c_str(), (long long) stat.count,
+                 stat.wall_us / 1e3, total_wall_us > 0 ? 100.0 * stat.wall_us / total_wall_us : 0.0, stat.busy_us / 1e3,
+                 stat.count > 0 ? (double) stat.wall_us / stat.count : 0.0);
+        out += line;
+        if (has_counters)
+        {
+            snprintf(line, sizeof(line), " %10.2f %12lld", stat.cycles / 1e6, (long long) stat.cache_misses);
+            out += line;
+        }
+        out += "\n";
+    }
+
+    // plain text tables by op, by tensor name and by layer, largest first; by name
+    // lists at most max_names rows
+    std::string table(size_t max_names = 40)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        char header[256];
+        snprintf(header, sizeof(header), "%-28s %8s %10s %6s %10s %9s%s\n", "", "count", "wall ms", "%", "busy ms", "avg us",
+                 has_counters ? "    Mcycles cache misses" : "");
+        std::string out;
+        char line[128];
+        snprintf(line, sizeof(line), "%zu graphs, %.2f ms\n", n_graphs, total_wall_us / 1e3);
+        out += line;
+
+        out += std::string("\nby op\n") + header;
+        for (const auto &row : sorted(by_op))
+        {
+            appendRow(out, row.first, row.second);
+        }
+        out += std::string("\nby tensor\n") + header;
+        const auto names_sorted = sorted(by_name);
+        for (size_t i = 0; i < names_sorted.size() && i < max_names; i++)
+        {
+            appendRow(out, names_sorted[i].first, names_sorted[i].second);
+        }
+        out += std::string("\nby layer\n") + header;
+        for (const auto &row : by_layer)
+        {
+            appendRow(out, row.first < 0 ? "(none)" : "layer " + std::to_string(row.first), row.second);
+        }
+        return out;
+    }
+
+    // Chrome trace-event JSON (chrome://tracing, Perfetto): a complete event per node
+    // and thread, one track per thread
+    bool writeTrace(const std::string &path, std::string &error)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        FILE *file = fopen(path.c_str(), "wb");
+        if (file == nullptr)
+        {
+            error = "Failed to open trace file " + path;
+            return false;
+        }
+        std::vector<std::string> quoted_names;
+        std::vector<std::string> cat_args;
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            std::string base;
+            int layer;
+            split_name(names[i], base, layer);
+            quoted_names.push_back(nlohmann::json(names[i]).dump());
+            cat_args.push_back(nlohmann::json(name_ops[i]).dump() + ",\"args\":{\"layer\":" + std::to_string(layer));
+        }
+        fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+        for (size_t i = 0; i < trace.size(); i++)
+        {
+            const trace_event &event = trace[i];
+            fprintf(file, "%s\n{\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%lld,\"dur\":%lld,\"name\":%s,\"cat\":%s", i == 0 ? "" : ",",
+                    event.ith, (long long) event.ts, (long long) event.dur, quoted_names[event.name].c_str(),
+                    cat_args[event.name].c_str());
+            if (event.cycles >= 0)
+            {
+                fprintf(file, ",\"cycles\":%lld", (long long) event.cycles);
+            }
+            if (event.cache_misses >= 0)
+            {
+                fprintf(file, ",\"cache_misses\":%lld", (long long) event.cache_misses);
+            }
+            fprintf(file, "}}");
+        }
+        fprintf(file, "\n]}\n");
+        if (fclose(file) != 0)
+        {
+            error = "Failed to write trace file " + path;
+            return false;
+        }
+        return true;
+    }
+};
+
+}
+
+#endif /* RNLLAMA_PROFILER_H */
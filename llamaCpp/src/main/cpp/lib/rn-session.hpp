@@ -0,0 +1,422 @@
+#ifndef RNLLAMA_SESSION_H
+#define RNLLAMA_SESSION_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "ggml.h"
+#include "llama.h"
+
+namespace rnllama {
+
+// Incremental session file of one sequence. The header identifies the model and the
+// KV cache layout; each checkpoint appends a record with the tokens decoded since the
+// previous one and their KV cells (llama_state_seq_get_data_range), so a save writes
+// only what is new. Loading adds the cells of each record in turn.
+//
+//   header  u32 magic, u32 version, u64 fingerprint
+//   record  u32 magic, u32 flags, u32 n_tokens, u32 unused, u64 n_state, u64 n_payload,
+//           n_tokens tokens, n_payload bytes holding n_state bytes of state once decoded
+//
+// A record may store its F16 KV data as Q8_0 (lossy, about half the size) and may be
+// zlib-compressed.
+static const uint32_t SESSION_MAGIC = 0x53534e52;        // "RNSS"
+static const uint32_t SESSION_RECORD_MAGIC = 0x43524e52; // "RNRC"
+static const uint32_t SESSION_VERSION = 1;
+
+enum session_flags
+{
+    SESSION_ZLIB = 1,
+    SESSION_Q8_0 = 2,
+};
+
+struct session_record
+{
+    uint32_t flags = 0;
+    uint64_t n_state = 0;
+    uint64_t n_payload = 0;
+    size_t n_tokens_end = 0; // tokens of the session up to this record included
+    long payload_offset = 0;
+    long end_offset = 0;
+};
+
+// tokens and records of a session file, read without the payloads
+struct session_index
+{
+    std::vector<llama_token> tokens;
+    std::vector<session_record> records;
+    long header_end = 0;
+};
+
+static uint64_t session_fnv1a(uint64_t hash, const void *data, size_t size)
+{
+    const uint8_t *bytes = (const uint8_t *) data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Model and KV cache layout: files written with another model, KV type or V layout
+// are rejected from their header
+static uint64_t session_fingerprint(llama_context *ctx)
+{
+    const llama_model *model = llama_get_model(ctx);
+    char desc[256];
+    llama_model_desc(model, desc, sizeof(desc));
+    uint64_t hash = session_fnv1a(14695981039346656037ULL, desc, strlen(desc));
+    const uint64_t values[] = {
+        llama_model_n_params(model),
+        llama_model_size(model),
+        (uint64_t) llama_n_vocab(model),
+        (uint64_t) llama_n_embd(model),
+        (uint64_t) llama_n_layer(model),
+    };
+    hash = session_fnv1a(hash, values, sizeof(values));
+    // the state of no cells still lists the type and row size of every layer
+    std::vector<uint8_t> layout(llama_state_seq_get_size_range(ctx, 0, 0, 0));
+    layout.resize(llama_state_seq_get_data_range(ctx, layout.data(), layout.size(), 0, 0, 0));
+    return session_fnv1a(hash, layout.data(), layout.size());
+}
+
+// Read-only mapping of a whole file, paged in ahead of a sequential read
+struct session_mapping
+{
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+
+    explicit session_mapping(const std::string &path)
+    {
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr != MAP_FAILED)
+            {
+                madvise(addr, st.st_size, MADV_SEQUENTIAL);
+                madvise(addr, st.st_size, MADV_WILLNEED);
+                data = (const uint8_t *) addr;
+                size = st.st_size;
+            }
+        }
+        // the mapping keeps the file open
+        close(fd);
+    }
+
+    ~session_mapping()
+    {
+        if (data != nullptr)
+        {
+            munmap((void *) data, size);
+        }
+    }
+
+    session_mapping(const session_mapping &) = delete;
+    session_mapping &operator=(const session_mapping &) = delete;
+};
+
+// False when fp is not a session file of this fingerprint. A record cut short by an
+// interrupted checkpoint ends the index, the next checkpoint overwrites it.
+static bool session_read_index(FILE *fp, uint64_t fingerprint, session_index &index)
+{
+    index.tokens.clear();
+    index.records.clear();
+    if (std::fseek(fp, 0, SEEK_END) != 0)
+    {
+        return false;
+    }
+    const long file_size = std::ftell(fp);
+    std::rewind(fp);
+    uint32_t header[2];
+    uint64_t file_fingerprint;
+    if (std::fread(header, sizeof(header), 1, fp) != 1 || header[0] != SESSION_MAGIC || header[1] != SESSION_VERSION ||
+        std::fread(&file_fingerprint, sizeof(file_fingerprint), 1, fp) != 1 || file_fingerprint != fingerprint)
+    {
+        return false;
+    }
+    index.header_end = std::ftell(fp);
+    while (true)
+    {
+        uint32_t record_header[4];
+        uint64_t sizes[2];
+        if (std::fread(record_header, sizeof(record_header), 1, fp) != 1 || record_header[0] != SESSION_RECORD_MAGIC ||
+            std::fread(sizes, sizeof(sizes), 1, fp) != 1)
+        {
+            break;
+        }
+        const size_t n_tokens = index.tokens.size();
+        index.tokens.resize(n_tokens + record_header[2]);
+        if (std::fread(index.tokens.data() + n_tokens, sizeof(llama_token), record_header[2], fp) != record_header[2])
+        {
+            index.tokens.resize(n_tokens);
+            break;
+        }
+        session_record record;
+        record.flags = record_header[1];
+        record.n_state = sizes[0];
+        record.n_payload = sizes[1];
+        record.n_tokens_end = index.tokens.size();
+        record.payload_offset = std::ftell(fp);
+        record.end_offset = record.payload_offset + (long) record.n_payload;
+        if (record.end_offset > file_size || std::fseek(fp, record.end_offset, SEEK_SET) != 0)
+        {
+            index.tokens.resize(n_tokens);
+            break;
+        }
+        index.records.push_back(record);
+    }
+    return true;
+}
+
+// One KV data section of a sequence state, F16 data converted to or from Q8_0 blocks
+// (padded to whole blocks), anything else copied.
+static bool session_convert_section(const uint8_t *&src, const uint8_t *end, std::vector<uint8_t> &dst,
+                                    int32_t type, uint64_t n_bytes, bool quantize)
+{
+    if (type != LM_GGML_TYPE_F16)
+    {
+        if ((uint64_t) (end - src) < n_bytes)
+        {
+            return false;
+        }
+        dst.insert(dst.end(), src, src + n_bytes);
+        src += n_bytes;
+        return true;
+    }
+    const int64_t n_values = n_bytes / sizeof(lm_ggml_fp16_t);
+    const int64_t block = lm_ggml_blck_size(LM_GGML_TYPE_Q8_0);
+    const int64_t n_padded = (n_values + block - 1) / block * block;
+    const size_t n_quantized = lm_ggml_row_size(LM_GGML_TYPE_Q8_0, n_padded);
+    std::vector<float> values(n_padded, 0.0f);
+    const size_t n_dst = dst.size();
+    if (quantize)
+    {
+        if ((uint64_t) (end - src) < n_bytes)
+        {
+            return false;
+        }
+        lm_ggml_fp16_to_fp32_row((const lm_ggml_fp16_t *) src, values.data(), n_values);
+        dst.resize(n_dst + n_quantized);
+        lm_ggml_quantize_chunk(LM_GGML_TYPE_Q8_0, values.data(), dst.data() + n_dst, 0, 1, n_padded, nullptr);
+        src += n_bytes;
+    }
+    else
+    {
+        if ((size_t) (end - src) < n_quantized)
+        {
+            return false;
+        }
+        lm_ggml_get_type_traits(LM_GGML_TYPE_Q8_0)->to_float(src, values.data(), n_padded);
+        dst.resize(n_dst + n_bytes);
+        lm_ggml_fp32_to_fp16_row(values.data(), (lm_ggml_fp16_t *) (dst.data() + n_dst), n_values);
+        src += n_quantized;
+    }
+    return true;
+}
+
+// Walk a sequence state (llama_data_write::write_kv_cache) and convert its KV data,
+// the cell metadata and section headers are copied unchanged.
+static bool session_convert_state(const uint8_t *src, size_t size, std::vector<uint8_t> &dst, bool quantize)
+{
+    const uint8_t *end = src + size;
+    dst.clear();
+    auto copy = [&](void *value, size_t n) {
+        if ((size_t) (end - src) < n)
+        {
+            return false;
+        }
+        memcpy(value, src, n);
+        dst.insert(dst.end(), src, src + n);
+        src += n;
+        return true;
+    };
+    uint32_t cell_count;
+    if (!copy(&cell_count, sizeof(cell_count)))
+    {
+        return false;
+    }
+    for (uint32_t i = 0; i < cell_count; i++)
+    {
+        llama_pos pos;
+        uint32_t n_seq_id;
+        if (!copy(&pos, sizeof(pos)) || !copy(&n_seq_id, sizeof(n_seq_id)))
+        {
+            return false;
+        }
+        for (uint32_t j = 0; j < n_seq_id; j++)
+        {
+            llama_seq_id seq_id;
+            if (!copy(&seq_id, sizeof(seq_id)))
+            {
+                return false;
+            }
+        }
+    }
+    uint32_t v_trans;
+    uint32_t n_layer;
+    if (!copy(&v_trans, sizeof(v_trans)) || !copy(&n_layer, sizeof(n_layer)))
+    {
+        return false;
+    }
+    // keys, then values, one section per layer
+    for (int part = 0; part < 2; part++)
+    {
+        for (uint32_t il = 0; il < n_layer; il++)
+        {
+            int32_t type;
+            if (!copy(&type, sizeof(type)))
+            {
+                return false;
+            }
+            uint64_t n_bytes;
+            if (part == 0 || !v_trans)
+            {
+                uint64_t size_row;
+                if (!copy(&size_row, sizeof(size_row)))
+                {
+                    return false;
+                }
+                n_bytes = size_row * cell_count;
+            }
+            else
+            {
+                uint32_t size_el;
+                uint32_t n_embd_v_gqa;
+                if (!copy(&size_el, sizeof(size_el)) || !copy(&n_embd_v_gqa, sizeof(n_embd_v_gqa)))
+                {
+                    return false;
+                }
+                n_bytes = (uint64_t) size_el * n_embd_v_gqa * cell_count;
+            }
+            if (!session_convert_section(src, end, dst, type, n_bytes, quantize))
+            {
+                return false;
+            }
+        }
+    }
+    return src == end;
+}
+
+// Encode a state into a record payload, returns the flags actually applied
+static uint32_t session_encode(const std::vector<uint8_t> &state, uint32_t flags, std::vector<uint8_t> &payload)
+{
+    uint32_t applied = 0;
+    std::vector<uint8_t> quantized;
+    const std::vector<uint8_t> *data = &state;
+    if ((flags & SESSION_Q8_0) && session_convert_state(state.data(), state.size(), quantized, true))
+    {
+        data = &quantized;
+        applied |= SESSION_Q8_0;
+    }
+    if (flags & SESSION_ZLIB)
+    {
+        uLongf n_compressed = compressBound(data->size());
+        payload.resize(n_compressed);
+        // the fastest level: KV data compresses little, the point is to keep saves cheap
+        if (compress2(payload.data(), &n_compressed, data->data(), data->size(), Z_BEST_SPEED) == Z_OK &&
+            n_compressed < data->size())
+        {
+            payload.resize(n_compressed);
+            return applied | SESSION_ZLIB;
+        }
+    }
+    payload = *data;
+    return applied;
+}
+
+// Decode a record payload into the state it was written from
+static bool session_decode(const uint8_t *payload, size_t n_payload, const session_record &record, std::vector<uint8_t> &state)
+{
+    std::vector<uint8_t> inflated;
+    const uint8_t *data = payload;
+    size_t n_data = n_payload;
+    if (record.flags & SESSION_ZLIB)
+    {
+        // the Q8_0 state is smaller than n_state, inflate into a buffer large enough for either
+        inflated.resize(record.n_state);
+        uLongf n_inflated = inflated.size();
+        if (uncompress(inflated.data(), &n_inflated, payload, n_payload) != Z_OK)
+        {
+            return false;
+        }
+        inflated.resize(n_inflated);
+        data = inflated.data();
+        n_data = inflated.size();
+    }
+    if (record.flags & SESSION_Q8_0)
+    {
+        return session_convert_state(data, n_data, state, false) && state.size() == record.n_state;
+    }
+    if (n_data != record.n_state)
+    {
+        return false;
+    }
+    if (data == inflated.data())
+    {
+        state.swap(inflated);
+    }
+    else
+    {
+        state.assign(data, data + n_data);
+    }
+    return true;
+}
+
+// Keep the first n_keep records of the file (a new file when the index is empty) and
+// append one with the given tokens and state. Returns the bytes written, 0 on failure.
+static size_t session_append(const std::string &path, uint64_t fingerprint, const session_index &index, size_t n_keep,
+                             const llama_token *tokens, size_t n_tokens, const std::vector<uint8_t> &state, uint32_t flags)
+{
+    const bool is_new = index.header_end == 0;
+    FILE *fp = std::fopen(path.c_str(), is_new ? "wb" : "r+b");
+    if (fp == nullptr)
+    {
+        return 0;
+    }
+    size_t n_written = 0;
+    bool ok = true;
+    if (is_new)
+    {
+        const uint32_t header[2] = {SESSION_MAGIC, SESSION_VERSION};
+        ok = std::fwrite(header, sizeof(header), 1, fp) == 1 && std::fwrite(&fingerprint, sizeof(fingerprint), 1, fp) == 1;
+        n_written += sizeof(header) + sizeof(fingerprint);
+    }
+    else
+    {
+        // drop the records the sequence no longer matches, and any cut short
+        const long offset = n_keep > 0 ? index.records[n_keep - 1].end_offset : index.header_end;
+        ok = std::fflush(fp) == 0 && ftruncate(fileno(fp), offset) == 0 && std::fseek(fp, offset, SEEK_SET) == 0;
+    }
+
+    std::vector<uint8_t> payload;
+    const uint32_t applied = session_encode(state, flags, payload);
+    const uint32_t record_header[4] = {SESSION_RECORD_MAGIC, applied, (uint32_t) n_tokens, 0};
+    const uint64_t sizes[2] = {state.size(), payload.size()};
+    ok = ok && std::fwrite(record_header, sizeof(record_header), 1, fp) == 1 &&
+         std::fwrite(sizes, sizeof(sizes), 1, fp) == 1 &&
+         std::fwrite(tokens, sizeof(llama_token), n_tokens, fp) == n_tokens &&
+         std::fwrite(payload.data(), 1, payload.size(), fp) == payload.size();
+    n_written += sizeof(record_header) + sizeof(sizes) + n_tokens * sizeof(llama_token) + payload.size();
+    if (std::fclose(fp) != 0 || !ok)
+    {
+        return 0;
+    }
+    return n_written;
+}
+
+}
+
+#endif /* RNLLAMA_SESSION_H */
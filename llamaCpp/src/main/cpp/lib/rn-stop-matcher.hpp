@@ -0,0 +1,191 @@
+#ifndef RNLLAMA_STOP_MATCHER_H
+#define RNLLAMA_STOP_MATCHER_H
+
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+#include "llama.h"
+
+namespace rnllama {
+
+// Aho–Corasick automaton over a set of words. It is fed one symbol at a time and
+// keeps its state between calls, so a stream is scanned in O(1) amortized per
+// symbol whatever the number of words or the length of the stream.
+template <typename T>
+struct llama_rn_aho_corasick
+{
+    struct node
+    {
+        std::vector<std::pair<T, int>> next; // sorted by symbol
+        int fail = 0;
+        int depth = 0;
+        int word = -1;   // word ending exactly here
+        int output = -1; // longest word that is a suffix of this node
+    };
+
+    std::vector<node> nodes;
+    std::vector<size_t> word_len;
+    int state = 0;
+
+    void build(const std::vector<std::vector<T>> &words)
+    {
+        nodes.assign(1, node());
+        word_len.clear();
+        state = 0;
+        for (size_t w = 0; w < words.size(); w++)
+        {
+            word_len.push_back(words[w].size());
+            if (words[w].empty())
+            {
+                continue;
+            }
+            int cur = 0;
+            for (const T &c : words[w])
+            {
+                int child = find(cur, c);
+                if (child < 0)
+                {
+                    child = (int) nodes.size();
+                    nodes.push_back(node());
+                    nodes[child].depth = nodes[cur].depth + 1;
+                    auto &next = nodes[cur].next;
+                    next.insert(std::lower_bound(next.begin(), next.end(), std::make_pair(c, 0)), std::make_pair(c, child));
+                }
+                cur = child;
+            }
+            if (nodes[cur].word < 0)
+            {
+                nodes[cur].word = (int) w;
+            }
+        }
+
+        // breadth-first, so that failure links always point to shallower nodes
+        std::deque<int> queue;
+        for (const auto &edge : nodes[0].next)
+        {
+            queue.push_back(edge.second);
+        }
+        while (!queue.empty())
+        {
+            const int cur = queue.front();
+            queue.pop_front();
+            nodes[cur].output = nodes[cur].word >= 0 ? nodes[cur].word : nodes[nodes[cur].fail].output;
+            for (const auto &edge : nodes[cur].next)
+            {
+                int f = nodes[cur].fail;
+                while (f > 0 && find(f, edge.first) < 0)
+                {
+                    f = nodes[f].fail;
+                }
+                const int target = find(f, edge.first);
+                nodes[edge.second].fail = target >= 0 && target != edge.second ? target : 0;
+                queue.push_back(edge.second);
+            }
+        }
+    }
+
+    bool empty() const
+    {
+        return nodes.size() <= 1;
+    }
+
+    void reset()
+    {
+        state = 0;
+    }
+
+    // advance over c, returns the longest word ending at c or -1
+    int feed(const T &c)
+    {
+        int next;
+        while ((next = find(state, c)) < 0 && state > 0)
+        {
+            state = nodes[state].fail;
+        }
+        state = next < 0 ? 0 : next;
+        return nodes[state].output;
+    }
+
+    // length of the longest suffix of the stream that is a prefix of some word
+    size_t partial() const
+    {
+        return nodes.empty() ? 0 : nodes[state].depth;
+    }
+
+private:
+    int find(int n, const T &c) const
+    {
+        const auto &next = nodes[n].next;
+        auto it = std::lower_bound(next.begin(), next.end(), std::make_pair(c, 0),
+            [](const std::pair<T, int> &a, const std::pair<T, int> &b) { return a.first < b.first; });
+        return it != next.end() && it->first == c ? it->second : -1;
+    }
+};
+
+// Stop words of one request, matched incrementally against the generated text and,
+// optionally, against the sampled tokens of their tokenization.
+struct llama_rn_stop_matcher
+{
+    struct match
+    {
+        int word = -1;
+        size_t pos = std::string::npos; // start of the stop word in the text
+    };
+
+    llama_rn_aho_corasick<unsigned char> text;
+    llama_rn_aho_corasick<llama_token> tokens;
+    size_t n_fed = 0; // bytes of the text already scanned
+
+    void init(const std::vector<std::string> &words, const std::vector<std::vector<llama_token>> &token_words)
+    {
+        std::vector<std::vector<unsigned char>> bytes;
+        for (const std::string &word : words)
+        {
+            bytes.push_back(std::vector<unsigned char>(word.begin(), word.end()));
+        }
+        text.build(bytes);
+        tokens.build(token_words);
+        n_fed = 0;
+    }
+
+    // scan what was appended to the text since the last call, stopping at the
+    // first complete stop word
+    match feedText(const std::string &generated)
+    {
+        match result;
+        if (text.empty())
+        {
+            n_fed = generated.size();
+            return result;
+        }
+        while (n_fed < generated.size())
+        {
+            const int word = text.feed((unsigned char) generated[n_fed++]);
+            if (word >= 0)
+            {
+                result.word = word;
+                result.pos = n_fed - text.word_len[word];
+                break;
+            }
+        }
+        return result;
+    }
+
+    // bytes at the end of the text that could still become a stop word
+    size_t partialLength() const
+    {
+        return text.partial();
+    }
+
+    // true when the sampled tokens end with the tokenization of a stop word
+    bool feedToken(llama_token tok)
+    {
+        return !tokens.empty() && tokens.feed(tok) >= 0;
+    }
+};
+
+}
+
+#endif /* RNLLAMA_STOP_MATCHER_H */
@@ -0,0 +1,213 @@
+#ifndef RNLLAMA_STREAM_H
+#define RNLLAMA_STREAM_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace rnllama {
+
+// Bounded single-producer/single-consumer ring buffer. push and pop are lock-free:
+// each side owns one counter and publishes it with an atomic store. The mutex only
+// parks a consumer sleeping in wait(), the producer takes it when the consumer asked
+// to be woken and enough items are queued, or on close.
+template <typename T>
+class llama_rn_spsc_queue
+{
+public:
+    explicit llama_rn_spsc_queue(size_t capacity)
+    {
+        size_t n = 1;
+        while (n < capacity)
+        {
+            n <<= 1;
+        }
+        ring.resize(n);
+        mask = n - 1;
+    }
+
+    size_t capacity() const
+    {
+        return ring.size();
+    }
+
+    size_t size() const
+    {
+        return tail.load() - head.load();
+    }
+
+    // producer: false when the ring is full
+    bool push(T &&item)
+    {
+        const size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == ring.size())
+        {
+            return false;
+        }
+        ring[t & mask] = std::move(item);
+        tail.store(t + 1);
+        if (t + 1 - head.load() >= wake_at.load())
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            cv.notify_one();
+        }
+        return true;
+    }
+
+    // producer: no more items, wakes the consumer
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        cv.notify_one();
+    }
+
+    // consumer: false when the ring is empty
+    bool pop(T &item)
+    {
+        const size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        item = std::move(ring[h & mask]);
+        head.store(h + 1);
+        return true;
+    }
+
+    // consumer: once closed, everything the producer pushed can be popped and the
+    // producer no longer touches the queue
+    bool isClosed()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return closed;
+    }
+
+    // consumer: sleep until n_items are queued (at most the capacity), the queue is
+    // closed or the deadline passes
+    void wait(size_t n_items, std::chrono::steady_clock::time_point deadline)
+    {
+        n_items = std::max((size_t) 1, std::min(n_items, ring.size()));
+        std::unique_lock<std::mutex> lock(mutex);
+        wake_at.store(n_items);
+        cv.wait_until(lock, deadline, [&] { return closed || size() >= n_items; });
+        wake_at.store(SIZE_MAX);
+    }
+
+private:
+    std::vector<T> ring;
+    size_t mask = 0;
+    // free-running counters, tail - head items are queued
+    std::atomic<size_t> head{0};
+    std::atomic<size_t> tail{0};
+    std::atomic<size_t> wake_at{SIZE_MAX};
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool closed = false;
+};
+
+enum job_state
+{
+    JOB_RUNNING,
+    JOB_BLOCKED, // cannot progress until wake() is called
+    JOB_DONE,
+};
+
+// Thread running jobs in rounds: each job is a step function called once per round
+// until it returns JOB_DONE, so every posted job advances together. The thread is
+// started by the first post and sleeps while no job can progress.
+class llama_rn_worker
+{
+public:
+    ~llama_rn_worker()
+    {
+        stop();
+    }
+
+    void post(std::function<job_state()> job)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!thread.joinable())
+        {
+            stopping = false;
+            thread = std::thread(&llama_rn_worker::run, this);
+        }
+        pending.push_back(std::move(job));
+        cv.notify_one();
+    }
+
+    // a blocked job may progress again
+    void wake()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        woken = true;
+        cv.notify_one();
+    }
+
+    // returns once every posted job is done
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            cv.notify_one();
+        }
+        if (thread.joinable())
+        {
+            thread.join();
+        }
+    }
+
+private:
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<std::function<job_state()>> pending;
+    bool woken = false;
+    bool stopping = false;
+
+    void run()
+    {
+        std::vector<std::function<job_state()>> jobs;
+        bool progressed = false;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (!progressed)
+                {
+                    cv.wait(lock, [this] { return woken || stopping || !pending.empty(); });
+                }
+                woken = false;
+                jobs.insert(jobs.end(), pending.begin(), pending.end());
+                pending.clear();
+                if (stopping && jobs.empty())
+                {
+                    return;
+                }
+            }
+            progressed = false;
+            for (size_t i = 0; i < jobs.size();)
+            {
+                const job_state state = jobs[i]();
+                progressed |= state != JOB_BLOCKED;
+                if (state == JOB_DONE)
+                {
+                    jobs.erase(jobs.begin() + i);
+                    continue;
+                }
+                i++;
+            }
+        }
+    }
+};
+
+}
+
+#endif /* RNLLAMA_STREAM_H */
@@ -0,0 +1,82 @@
+#ifndef RNLLAMA_TIMING_H
+#define RNLLAMA_TIMING_H
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+namespace rnllama {
+
+// Latencies of a request, one sample per token. The samples are kept (a request
+// has at most n_ctx tokens), so percentiles are exact; the histogram buckets them
+// by powers of two of milliseconds for plotting.
+struct llama_rn_latency_histogram
+{
+    std::vector<double> samples; // ms
+
+    // upper bounds of the buckets, the last bucket holds everything above
+    static const std::vector<double> &bounds()
+    {
+        static const std::vector<double> bounds_ms = {0.5, 1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048};
+        return bounds_ms;
+    }
+
+    void add(double ms)
+    {
+        samples.push_back(ms);
+    }
+
+    void clear()
+    {
+        samples.clear();
+    }
+
+    size_t count() const
+    {
+        return samples.size();
+    }
+
+    double mean() const
+    {
+        double sum = 0;
+        for (double ms : samples)
+        {
+            sum += ms;
+        }
+        return samples.empty() ? 0 : sum / samples.size();
+    }
+
+    // nearest-rank percentile, p in [0, 100]
+    double percentile(double p) const
+    {
+        if (samples.empty())
+        {
+            return 0;
+        }
+        std::vector<double> sorted = samples;
+        const size_t rank = std::min(sorted.size() - 1, (size_t) std::max(0.0, p / 100.0 * sorted.size() - 1e-9));
+        std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+        return sorted[rank];
+    }
+
+    double max() const
+    {
+        return samples.empty() ? 0 : *std::max_element(samples.begin(), samples.end());
+    }
+
+    // samples per bucket, bounds().size() + 1 of them
+    std::vector<size_t> buckets() const
+    {
+        const std::vector<double> &upper = bounds();
+        std::vector<size_t> counts(upper.size() + 1, 0);
+        for (double ms : samples)
+        {
+            counts[std::lower_bound(upper.begin(), upper.end(), ms) - upper.begin()]++;
+        }
+        return counts;
+    }
+};
+
+}
+
+#endif /* RNLLAMA_TIMING_H */
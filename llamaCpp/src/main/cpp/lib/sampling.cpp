@@ -110,7 +110,13 @@ struct gpt_sampler {
 
     llama_token_data_array cur_p;
 
+    // time spent in each stage of gpt_sampler_sample: copying the logits, the grammar,
+    // then every sampler of the chain (see gpt_sampler_stage_times)
+    std::vector<int64_t> t_stage_us;
+
     void set_logits(struct llama_context * ctx, int idx) {
+        const int64_t t_start_us = params.no_perf ? 0 : llama_time_us();
+
         const auto * logits = llama_get_logits_ith(ctx, idx);
 
         const int n_vocab = llama_n_vocab(llama_get_model(ctx));
@@ -122,6 +128,42 @@ struct gpt_sampler {
         }
 
         cur_p = { cur.data(), cur.size(), -1, false };
+
+        if (!params.no_perf) {
+            t_stage_us[0] += llama_time_us() - t_start_us;
+        }
+    }
+
+    void apply_grammar(llama_token_data_array * data) {
+        const int64_t t_start_us = params.no_perf ? 0 : llama_time_us();
+
+        llama_sampler_apply(grmr, data);
+
+        if (!params.no_perf) {
+            t_stage_us[1] += llama_time_us() - t_start_us;
+        }
+    }
+
+    // the samplers of the chain are applied one at a time to be timed apart, the total
+    // still goes to the chain's sampling time (llama_perf_sampler)
+    void apply_chain() {
+        if (params.no_perf) {
+            llama_sampler_apply(chain, &cur_p);
+            return;
+        }
+
+        const int64_t t_chain_start_us = llama_time_us();
+
+        const int n = llama_sampler_chain_n(chain);
+        for (int i = 0; i < n; i++) {
+            const int64_t t_start_us = llama_time_us();
+
+            llama_sampler_apply(llama_sampler_chain_get(chain, i), &cur_p);
+
+            t_stage_us[2 + i] += llama_time_us() - t_start_us;
+        }
+
+        llama_perf_sampler_add(chain, llama_time_us() - t_chain_start_us);
     }
 };
 
@@ -151,6 +193,7 @@ struct gpt_sampler * gpt_sampler_init(const struct llama_model * model, const st
         /* .prev   = */ ring_buffer<llama_token>(std::max(32, params.n_prev)),
         /* .cur    = */ {},
         /* .cur_p  = */ {},
+        /* .t_stage_us = */ {},
     };
 
     llama_sampler_chain_add(result->chain,
@@ -224,6 +267,8 @@ struct gpt_sampler * gpt_sampler_init(const struct llama_model * model, const st
         llama_sampler_chain_add(result->chain, llama_sampler_init_greedy());
     }
 
+    result->t_stage_us.assign(2 + llama_sampler_chain_n(result->chain), 0);
+
     return result;
 }
 
@@ -261,6 +306,7 @@ struct gpt_sampler * gpt_sampler_clone(gpt_sampler * gsmpl) {
         /* .prev   = */ gsmpl->prev,
         /* .cur    = */ gsmpl->cur,
         /* .cur_p  = */ gsmpl->cur_p,
+        /* .t_stage_us = */ gsmpl->t_stage_us,
     };
 }
 
@@ -278,15 +324,13 @@ void gpt_perf_print(const struct llama_context * ctx, const struct gpt_sampler *
 llama_token gpt_sampler_sample(struct gpt_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first) {
     gsmpl->set_logits(ctx, idx);
 
-    auto & grmr  = gsmpl->grmr;
-    auto & chain = gsmpl->chain;
     auto & cur_p = gsmpl->cur_p; // initialized by set_logits
 
     if (grammar_first) {
-        llama_sampler_apply(grmr, &cur_p);
+        gsmpl->apply_grammar(&cur_p);
     }
 
-    llama_sampler_apply(chain, &cur_p);
+    gsmpl->apply_chain();
 
     LM_GGML_ASSERT(cur_p.selected != -1 && "no selected token during sampling - check your sampling configuration");
 
@@ -301,7 +345,7 @@ llama_token gpt_sampler_sample(struct gpt_sampler * gsmpl, struct llama_context
         llama_token_data       single_token_data       = { id, 1.0f, 0.0f };
         llama_token_data_array single_token_data_array = { &single_token_data, 1, -1, false };
 
-        llama_sampler_apply(grmr, &single_token_data_array);
+        gsmpl->apply_grammar(&single_token_data_array);
 
         const bool is_valid = single_token_data_array.data[0].logit != -INFINITY;
         if (is_valid) {
@@ -313,14 +357,24 @@ llama_token gpt_sampler_sample(struct gpt_sampler * gsmpl, struct llama_context
     // if the token is not valid, sample again, but first apply the grammar sampler and then the sampling chain
     gsmpl->set_logits(ctx, idx);
 
-    llama_sampler_apply(grmr,  &cur_p);
-    llama_sampler_apply(chain, &cur_p);
+    gsmpl->apply_grammar(&cur_p);
+    gsmpl->apply_chain();
 
     LM_GGML_ASSERT(cur_p.selected != -1 && "no selected token during re-sampling - check your sampling configuration");
 
     return cur_p.data[cur_p.selected].id;
 }
 
+std::vector<gpt_sampler_stage_time> gpt_sampler_stage_times(const struct gpt_sampler * gsmpl) {
+    std::vector<gpt_sampler_stage_time> result;
+    result.push_back({ "logits",  gsmpl->t_stage_us[0] });
+    result.push_back({ "grammar", gsmpl->t_stage_us[1] });
+    for (int i = 0; i < llama_sampler_chain_n(gsmpl->chain); i++) {
+        result.push_back({ llama_sampler_name(llama_sampler_chain_get(gsmpl->chain, i)), gsmpl->t_stage_us[2 + i] });
+    }
+    return result;
+}
+
 uint32_t gpt_sampler_get_seed(const struct gpt_sampler * gsmpl) {
     return llama_sampler_get_seed(gsmpl->chain);
 }
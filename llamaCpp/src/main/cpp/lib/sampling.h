@@ -60,6 +60,15 @@ void gpt_perf_print(const struct llama_context * ctx, const struct gpt_sampler *
 //
 llama_token gpt_sampler_sample(struct gpt_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first = false);
 
+struct gpt_sampler_stage_time {
+    std::string name;
+    int64_t     t_us;
+};
+
+// time spent by gpt_sampler_sample in each stage since the sampler was created:
+// "logits", "grammar", then each sampler of the chain by name (zero with no_perf)
+std::vector<gpt_sampler_stage_time> gpt_sampler_stage_times(const struct gpt_sampler * gsmpl);
+
 uint32_t gpt_sampler_get_seed(const struct gpt_sampler * gsmpl);
 
 // helpers
@@ -0,0 +1,228 @@
+// Thread and core planning (rn-cpu.hpp) on mocked sysfs trees, with fake per-core
+// benchmarks instead of benchmark_core.
+//
+//   cmake -S llamaCpp/src/main/cpp -B build-host && cmake --build build-host
+//   ctest --test-dir build-host
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include "rn-cpu.hpp"
+
+using namespace rnllama;
+
+static int n_failed = 0;
+
+// the mocked cores, whatever the affinity of the test process
+static const std::vector<int> all_cpus;
+
+#define CHECK(cond)                                                      \
+    do                                                                   \
+    {                                                                    \
+        if (!(cond))                                                     \
+        {                                                                \
+            std::fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            n_failed++;                                                  \
+        }                                                                \
+    } while (0)
+
+static void write_file(const std::string &path, const std::string &content)
+{
+    std::ofstream file(path);
+    file << content << "\n";
+}
+
+static void make_dirs(const std::string &path)
+{
+    for (size_t pos = path.find('/', 1); pos != std::string::npos; pos = path.find('/', pos + 1))
+    {
+        mkdir(path.substr(0, pos).c_str(), 0755);
+    }
+    mkdir(path.c_str(), 0755);
+}
+
+struct mock_core
+{
+    uint32_t max_freq_khz; // 0: no cpufreq file
+    uint32_t capacity;     // 0: no cpu_capacity file
+};
+
+// <root>/devices/system/cpu with online and, per core, cpufreq/cpuinfo_max_freq and cpu_capacity
+static void make_sysfs(const std::string &root, const std::vector<mock_core> &cores)
+{
+    const std::string cpu_dir = root + "/devices/system/cpu";
+    make_dirs(cpu_dir);
+    write_file(cpu_dir + "/online", "0-" + std::to_string(cores.size() - 1));
+    for (size_t i = 0; i < cores.size(); i++)
+    {
+        const std::string dir = cpu_dir + "/cpu" + std::to_string(i);
+        make_dirs(dir + "/cpufreq");
+        if (cores[i].max_freq_khz > 0)
+        {
+            write_file(dir + "/cpufreq/cpuinfo_max_freq", std::to_string(cores[i].max_freq_khz));
+        }
+        if (cores[i].capacity > 0)
+        {
+            write_file(dir + "/cpu_capacity", std::to_string(cores[i].capacity));
+        }
+    }
+}
+
+// 4 little cores, 3 big ones and a prime core, as on most recent phones
+static std::vector<mock_core> big_little(bool with_capacity, bool with_freq)
+{
+    std::vector<mock_core> cores;
+    for (int i = 0; i < 8; i++)
+    {
+        const uint32_t freq = i < 4 ? 1800000 : i < 7 ? 2400000 : 3000000;
+        const uint32_t capacity = i < 4 ? 400 : i < 7 ? 900 : 1024;
+        cores.push_back({with_freq ? freq : 0, with_capacity ? capacity : 0});
+    }
+    return cores;
+}
+
+static double measure_big_little(int core)
+{
+    return core < 4 ? 1.5 : core < 7 ? 2.5 : 3.0;
+}
+
+static bool same(const std::vector<int> &a, const std::vector<int> &b)
+{
+    return a == b;
+}
+
+static void test_topology(const std::string &root)
+{
+    make_sysfs(root, big_little(true, true));
+    const std::vector<llama_rn_core> cores = read_cpu_topology(root, all_cpus);
+    CHECK(cores.size() == 8);
+    CHECK(cores[0].max_freq_khz == 1800000 && cores[0].capacity == 400);
+    CHECK(cores[7].max_freq_khz == 3000000 && cores[7].capacity == 1024);
+    CHECK(same(parse_cpu_list("0-3,6"), {0, 1, 2, 3, 6}));
+}
+
+static void test_measured(const std::string &root)
+{
+    make_sysfs(root, big_little(true, true));
+    const llama_rn_cpu_plan plan = calibrate_cpu(root, measure_big_little, all_cpus);
+    CHECK(plan.measured);
+    // generation: the prime and big cores, within 80% of the fastest
+    CHECK(plan.n_threads == 4);
+    CHECK(same(plan.cores, {7, 4, 5, 6}));
+    // batches: 8 * 1.5 beats 4 * 2.5, the little cores are worth adding
+    CHECK(plan.n_threads_batch == 8);
+    CHECK(same(plan.cores_batch, {7, 4, 5, 6, 0, 1, 2, 3}));
+}
+
+static void test_cpuset(const std::string &root)
+{
+    // an app cpuset without the big and prime cores: they are neither measured nor used
+    make_sysfs(root, big_little(true, true));
+    std::vector<int> measured;
+    const llama_rn_cpu_plan plan = calibrate_cpu(root, [&measured](int core) {
+        measured.push_back(core);
+        return measure_big_little(core);
+    }, {0, 1, 2, 3, 4, 5});
+    CHECK(same(measured, {0, 1, 2, 3, 4, 5}));
+    CHECK(plan.measured && plan.topology.size() == 6);
+    CHECK(plan.n_threads == 2 && same(plan.cores, {4, 5}));
+    CHECK(plan.n_threads_batch == 6 && same(plan.cores_batch, {4, 5, 0, 1, 2, 3}));
+    // the profile of the whole device does not apply
+    CHECK(cpu_profile_key(plan.topology) != cpu_profile_key(read_cpu_topology(root, all_cpus)));
+}
+
+static void test_fallbacks(const std::string &root)
+{
+    // a core that cannot be measured: every core is scored by capacity
+    make_sysfs(root + "/capacity", big_little(true, true));
+    llama_rn_cpu_plan plan = calibrate_cpu(root + "/capacity", [](int core) { return core == 0 ? 0.0 : measure_big_little(core); }, all_cpus);
+    CHECK(!plan.measured);
+    CHECK(plan.topology[7].score == 1024 && plan.topology[0].score == 400);
+    CHECK(plan.n_threads == 4 && same(plan.cores, {7, 4, 5, 6}));
+    CHECK(plan.n_threads_batch == 4); // 8 * 400 < 4 * 900
+
+    // no cpu_capacity: by maximum frequency
+    make_sysfs(root + "/freq", big_little(false, true));
+    plan = calibrate_cpu(root + "/freq", nullptr, all_cpus);
+    CHECK(!plan.measured);
+    CHECK(plan.topology[7].score == 3000000 && plan.topology[0].score == 1800000);
+    CHECK(plan.n_threads == 4 && same(plan.cores, {7, 4, 5, 6}));
+    CHECK(plan.n_threads_batch == 8); // 8 * 1.8 > 4 * 2.4
+
+    // neither: all cores alike, in id order
+    make_sysfs(root + "/uniform", big_little(false, false));
+    plan = calibrate_cpu(root + "/uniform", nullptr, all_cpus);
+    CHECK(!plan.measured);
+    CHECK(plan.topology[7].score == 1);
+    CHECK(plan.n_threads == 4 && same(plan.cores, {0, 1, 2, 3}));
+    CHECK(plan.n_threads_batch == 8);
+}
+
+static void test_profile(const std::string &root)
+{
+    make_sysfs(root, big_little(true, true));
+    const std::string profile = root + "/cpu-profile.txt";
+    int n_measured = 0;
+    auto measure = [&n_measured](int core) {
+        n_measured++;
+        return measure_big_little(core);
+    };
+
+    llama_rn_cpu_plan plan = plan_threads(root, profile, measure, all_cpus);
+    CHECK(n_measured == 8 && plan.measured && !plan.loaded);
+
+    // read back without benchmarking again
+    llama_rn_cpu_plan loaded = plan_threads(root, profile, measure, all_cpus);
+    CHECK(n_measured == 8);
+    CHECK(loaded.loaded && loaded.measured);
+    CHECK(loaded.n_threads == plan.n_threads && same(loaded.cores, plan.cores));
+    CHECK(loaded.n_threads_batch == plan.n_threads_batch && same(loaded.cores_batch, plan.cores_batch));
+    for (size_t i = 0; i < plan.topology.size(); i++)
+    {
+        CHECK(loaded.topology[i].score == plan.topology[i].score);
+    }
+
+    // another device, or the same one with other cores online: the profile is ignored
+    write_file(root + "/devices/system/cpu/cpu7/cpufreq/cpuinfo_max_freq", "3200000");
+    llama_rn_cpu_plan other;
+    other.topology = read_cpu_topology(root, all_cpus);
+    CHECK(!load_cpu_profile(profile, other));
+    other = plan_threads(root, profile, measure, all_cpus);
+    CHECK(n_measured == 16 && !other.loaded);
+    // and replaced by the new benchmark
+    llama_rn_cpu_plan reloaded;
+    reloaded.topology = read_cpu_topology(root, all_cpus);
+    CHECK(load_cpu_profile(profile, reloaded));
+
+    // a truncated profile is not used
+    write_file(profile, cpu_profile_key(reloaded.topology) + "\n0 1.5");
+    CHECK(!load_cpu_profile(profile, reloaded));
+}
+
+int main()
+{
+    char root_template[] = "/tmp/rnllama-test-cpu-XXXXXX";
+    const char *root = mkdtemp(root_template);
+    if (root == nullptr)
+    {
+        std::perror("mkdtemp");
+        return 1;
+    }
+    test_topology(std::string(root) + "/topology");
+    test_measured(std::string(root) + "/measured");
+    test_cpuset(std::string(root) + "/cpuset");
+    test_fallbacks(std::string(root) + "/fallbacks");
+    test_profile(std::string(root) + "/profile");
+    std::system(("rm -rf " + std::string(root)).c_str());
+
+    if (n_failed > 0)
+    {
+        std::fprintf(stderr, "%d checks failed\n", n_failed);
+        return 1;
+    }
+    std::printf("all checks passed\n");
+    return 0;
+}
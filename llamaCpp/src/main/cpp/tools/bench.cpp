@@ -0,0 +1,148 @@
+// Latency and throughput benchmark suite (rn-bench.hpp) on the host, the same
+// suite LlamaContext.benchSuite runs on the device.
+//
+//   cmake -S llamaCpp/src/main/cpp -B build-host && cmake --build build-host
+//   ./build-host/rnllama-bench -m model.gguf -t 1,2,4 -ub 128,512 -np 1,4 > result.json
+//
+// Lists are comma separated, every combination of the swept values is run.
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "rn-bench.hpp"
+
+using namespace rnllama;
+
+static std::vector<int> parse_list(const char *arg)
+{
+    std::vector<int> values;
+    std::stringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        values.push_back(atoi(item.c_str()));
+    }
+    return values;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "usage: %s -m model.gguf [options]\n"
+            "  -p N         prompt tokens (default 512)\n"
+            "  -n N         generated tokens per sequence (default 128)\n"
+            "  -r N         warm repetitions (default 3)\n"
+            "  -f FILE      prompt text, repeated or cut to the prompt length\n"
+            "  -t LIST      thread counts (default all cores)\n"
+            "  -b LIST      n_batch values (default 512)\n"
+            "  -ub LIST     n_ubatch values (default 512)\n"
+            "  -np LIST     parallel sequence counts (default 1)\n"
+            "  -ngl N       layers to offload (default 0)\n"
+            "  --no-cold    discard the first run of each configuration\n",
+            argv0);
+}
+
+int main(int argc, char **argv)
+{
+    std::string model_path;
+    int n_gpu_layers = 0;
+    llama_rn_bench_params params;
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--no-cold")
+        {
+            params.cold = false;
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        const char *value = argv[++i];
+        if (arg == "-m")
+        {
+            model_path = value;
+        }
+        else if (arg == "-p")
+        {
+            params.n_prompt = atoi(value);
+        }
+        else if (arg == "-n")
+        {
+            params.n_gen = atoi(value);
+        }
+        else if (arg == "-r")
+        {
+            params.n_reps = atoi(value);
+        }
+        else if (arg == "-f")
+        {
+            std::ifstream file(value);
+            std::stringstream text;
+            text << file.rdbuf();
+            params.prompt = text.str();
+        }
+        else if (arg == "-t")
+        {
+            params.n_threads = parse_list(value);
+        }
+        else if (arg == "-b")
+        {
+            params.n_batch = parse_list(value);
+        }
+        else if (arg == "-ub")
+        {
+            params.n_ubatch = parse_list(value);
+        }
+        else if (arg == "-np")
+        {
+            params.n_parallel = parse_list(value);
+        }
+        else if (arg == "-ngl")
+        {
+            n_gpu_layers = atoi(value);
+        }
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (model_path.empty())
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    llama_backend_init();
+    llama_model_params mparams = llama_model_default_params();
+    mparams.n_gpu_layers = n_gpu_layers;
+    llama_model *model = llama_load_model_from_file(model_path.c_str(), mparams);
+    if (model == nullptr)
+    {
+        fprintf(stderr, "unable to load model: %s\n", model_path.c_str());
+        return 1;
+    }
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_threads = std::max(1u, std::thread::hardware_concurrency());
+    cparams.n_threads_batch = cparams.n_threads;
+
+    std::atomic<bool> interrupted{false};
+    // default cores, priority and polling for the threadpools
+    const nlohmann::ordered_json result = bench_suite(model, cparams, cpu_params(), params, interrupted);
+    printf("%s\n", result.dump(2).c_str());
+
+    llama_free_model(model);
+    llama_backend_free();
+    return result.contains("error") ? 1 : 0;
+}
@@ -0,0 +1,125 @@
+// Microbenchmark of the context shift planner (rn-context-shift.hpp) against the
+// dynamic programming longest common substring it replaced.
+//
+//   cmake -S llamaCpp/src/main/cpp -B build-host && cmake --build build-host
+//   ./build-host/rnllama-context-shift-bench [n_ctx...]
+//
+// Each case models a chat that overflowed its window: the new prompt keeps the
+// first n_keep tokens, drops a block of old turns and appends a new turn.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+#include "rn-context-shift.hpp"
+
+using namespace rnllama;
+
+static const int n_vocab = 32000;
+static const int n_keep = 64;
+static const size_t legacy_max_cells = 8192ull * 8192ull;
+
+// previous implementation, kept here as the baseline
+static std::vector<int> legacy_longest_common_subseq(const std::vector<int> x, const std::vector<int> y)
+{
+    int m = x.size(), n = y.size();
+    std::vector<std::vector<int>> LCSuff(m + 1, std::vector<int>(n + 1));
+    for (int i = 1; i <= m; i++)
+    {
+        for (int j = 1; j <= n; j++)
+        {
+            LCSuff[i][j] = x[i - 1] == y[j - 1] ? LCSuff[i - 1][j - 1] + 1 : 0;
+        }
+    }
+    std::vector<int> longest;
+    for (int i = 1; i <= m; i++)
+    {
+        for (int j = 1; j <= n; j++)
+        {
+            if (LCSuff[i][j] > (int) longest.size())
+            {
+                longest = std::vector<int>(x.begin() + i - LCSuff[i][j], x.begin() + i);
+            }
+        }
+    }
+    return longest;
+}
+
+static double elapsed_ms(std::chrono::steady_clock::time_point t0)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<int> sizes;
+    for (int i = 1; i < argc; i++)
+    {
+        sizes.push_back(atoi(argv[i]));
+    }
+    if (sizes.empty())
+    {
+        sizes = {2048, 8192, 32768};
+    }
+
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> token(0, n_vocab - 1);
+
+    printf("| n_ctx | shared | planner ms | legacy ms | speedup |\n");
+    printf("|------:|-------:|-----------:|----------:|--------:|\n");
+    for (int n_ctx : sizes)
+    {
+        const int n_drop = n_ctx / 4;
+        const int n_append = n_ctx / 8;
+
+        std::vector<llama_token> current(n_ctx);
+        for (auto &t : current)
+        {
+            t = token(rng);
+        }
+        std::vector<llama_token> next(current.begin(), current.begin() + n_keep);
+        next.insert(next.end(), current.begin() + n_keep + n_drop, current.end());
+        for (int i = 0; i < n_append; i++)
+        {
+            next.push_back(token(rng));
+        }
+
+        const int n_rep = n_ctx <= 8192 ? 20 : 5;
+        token_span shared;
+        int found = -1;
+        auto t0 = std::chrono::steady_clock::now();
+        for (int r = 0; r < n_rep; r++)
+        {
+            const token_suffix_automaton sam(current.data() + n_keep, current.size() - n_keep);
+            shared = sam.longestCommon(next.data() + n_keep, next.size() - n_keep);
+            found = arr_find_index_of(current, next.data() + n_keep, shared.n);
+        }
+        const double t_planner = elapsed_ms(t0) / n_rep;
+        if (found != n_keep + n_drop || shared.pos_b != 0)
+        {
+            fprintf(stderr, "unexpected match at %d for n_ctx = %d\n", found, n_ctx);
+            return 1;
+        }
+
+        const size_t cells = (size_t) (n_ctx - n_keep) * (next.size() - n_keep);
+        if (cells > legacy_max_cells)
+        {
+            printf("| %5d | %6zu | %10.3f | %9s | %7s |\n", n_ctx, shared.n, t_planner, "n/a", "n/a");
+            continue;
+        }
+        t0 = std::chrono::steady_clock::now();
+        const std::vector<int> legacy = legacy_longest_common_subseq(
+            std::vector<int>(current.begin() + n_keep, current.end()),
+            std::vector<int>(next.begin() + n_keep, next.end()));
+        const double t_legacy = elapsed_ms(t0);
+        if (legacy.size() != shared.n)
+        {
+            fprintf(stderr, "length mismatch %zu != %zu for n_ctx = %d\n", legacy.size(), shared.n, n_ctx);
+            return 1;
+        }
+        printf("| %5d | %6zu | %10.3f | %9.1f | %6.0fx |\n", n_ctx, shared.n, t_planner, t_legacy, t_legacy / t_planner);
+    }
+    return 0;
+}
@@ -123,12 +123,59 @@ class LlamaContext(private val id: Int, params: Map<String, Any>) {
             params["model"] as String,
             // boolean embedding,
             params["embedding"] as? Boolean ?: false,
+            // boolean reranking, cross-encoder scoring with rank pooling (implies embedding)
+            params["reranking"] as? Boolean ?: false,
+            // int pooling_type, -1 = model default, 0 = none (token embeddings, needed for late chunking)
+            params["pooling_type"] as? Int ?: -1,
             // int n_ctx,
             params["n_ctx"] as? Int ?: 512,
             // int n_batch,
             params["n_batch"] as? Int ?: 512,
-            // int n_threads,
+            // int n_ubatch, physical batch size, 0 = planner or llama.cpp default
+            params["n_ubatch"] as? Int ?: 0,
+            // String cache_type_k, KV cache type (f16, q8_0, q4_0...), empty = planner or f16
+            params["cache_type_k"] as? String ?: "",
+            // String cache_type_v, quantized types need flash_attn
+            params["cache_type_v"] as? String ?: "",
+            // boolean flash_attn,
+            params["flash_attn"] as? Boolean ?: false,
+            // boolean auto_plan, fit n_ctx, n_ubatch, KV types, flash_attn and mlock to the memory
+            // budget, replacing the values given here; off keeps them as given
+            params["auto_plan"] as? Boolean ?: false,
+            // int memory_budget_mb, 0 = 3/4 of the available memory
+            params["memory_budget_mb"] as? Int ?: 0,
+            // int n_threads, 0 = calibrated per device for generation and prefill
             params["n_threads"] as? Int ?: 0,
+            // int n_threads_batch, threads for prompt batches, 0 = calibrated or n_threads
+            params["n_threads_batch"] as? Int ?: 0,
+            // int thread_priority, generation threads: 0 normal, 1 medium, 2 high, 3 realtime
+            params["thread_priority"] as? Int ?: 0,
+            // int thread_priority_batch, prompt batch threads
+            params["thread_priority_batch"] as? Int ?: 0,
+            // int poll, 0-100 how long idle generation threads spin before sleeping
+            params["poll"] as? Int ?: 50,
+            // int poll_batch, same for prompt batch threads
+            params["poll_batch"] as? Int ?: 50,
+            // String cpu_profile, file keeping the per-core benchmark, empty = benchmark every time
+            params["cpu_profile"] as? String ?: "",
+            // int n_parallel,
+            params["n_parallel"] as? Int ?: 1,
+            // int prefix_cache_mb, 0 disables the prompt prefix cache
+            params["prefix_cache_mb"] as? Int ?: 0,
+            // int conversation_cache_mb, RAM for the KV snapshots of conversations, 0 disables them
+            params["conversation_cache_mb"] as? Int ?: 0,
+            // String conversation_dir, snapshots beyond conversation_cache_mb are spilled here, empty drops them
+            params["conversation_dir"] as? String ?: "",
+            // String model_draft, small model for speculative decoding, empty disables it
+            params["model_draft"] as? String ?: "",
+            // int n_draft,
+            params["n_draft"] as? Int ?: 5,
+            // int lookup_ngram, longest n-gram for prompt lookup decoding, 0 disables it
+            params["lookup_ngram"] as? Int ?: 0,
+            // String lookup_cache, file keeping lookup n-grams across sessions
+            params["lookup_cache"] as? String ?: "",
+            // int lookup_cache_mb, RAM for the lookup n-gram counts, new n-grams are ignored past it
+            params["lookup_cache_mb"] as? Int ?: 16,
             // int n_gpu_layers, // TODO: Support this
             params["n_gpu_layers"] as? Int ?: 0,
             // boolean use_mlock,
@@ -154,24 +201,26 @@ class LlamaContext(private val id: Int, params: Map<String, Any>) {
         return getFormattedChat(context, msgs, chatTemplate.ifEmpty { "" })
     }
 
-    fun emitPartialCompletion(tokenResult: Map<String, Any>) {
-        //TODO: log->"emiting partial completion $tokenResult".v()
-        val tokenWord = tokenResult["token"] as? String ?: ""
+    // One launch per drained batch: the text of each completion arrives as one token event
+    fun emitPartialCompletion(batch: Map<String, Any>) {
+        //TODO: log->"emiting partial completion $batch".v()
+        val progress = batch["prompt_progress"]
+        val tokens = batch["tokens"] as? List<Map<String, Any>> ?: emptyList()
+        if (progress == null && tokens.isEmpty()) return
         scope?.launch {
-            eventFlow.emit( "token" to tokenWord)
-        }
-    }
-
-    private inner class PartialCompletionCallback {
-        private val emitNeeded: Boolean
-
-        constructor(emitNeeded: Boolean) {
-            this.emitNeeded = emitNeeded
-        }
-
-        fun onPartialCompletion(tokenResult: Map<String, Any>) {
-            if (!emitNeeded) return
-            emitPartialCompletion(tokenResult)
+            if (progress != null) {
+                eventFlow.emit("prompt_progress" to progress)
+            }
+            for (tokenResult in tokens) {
+                val tokenWord = tokenResult["token"] as? String ?: ""
+                val index = tokenResult["index"] as? Int ?: 0
+                if (index == 0) {
+                    eventFlow.emit("token" to tokenWord)
+                } else {
+                    // the other completions of an n-best request
+                    eventFlow.emit("alternative_token" to (index to tokenWord))
+                }
+            }
         }
     }
 
@@ -197,7 +246,21 @@ class LlamaContext(private val id: Int, params: Map<String, Any>) {
         return saveSession(context, path, size)
     }
 
-    fun completion(params: Map<String, Any>): Map<String, Any> {
+    // Appends to the session file only the tokens and KV cells decoded since its
+    // last checkpoint; loadSession reads either format.
+    fun checkpointSession(path: String, compress: Boolean = true, quantizeKv: Boolean = false): Map<String, Any> {
+        if (path.isEmpty()) {
+            throw IllegalArgumentException("File path is empty")
+        }
+        val result = checkpointSession(context, path, compress, quantizeKv)
+        if (result.containsKey("error")) {
+            throw IllegalStateException(result["error"] as String)
+        }
+        return result
+    }
+
+    // onStart gets the slot id of the request once it is started, for stopCompletion
+    fun completion(params: Map<String, Any>, onStart: (Int) -> Unit = {}): Map<String, Any> {
         //TODO: log->"completion start".v()
         if (!params.containsKey("prompt")) {
             throw IllegalArgumentException("Missing required parameter: prompt")
@@ -206,8 +269,8 @@ class LlamaContext(private val id: Int, params: Map<String, Any>) {
         val logitBias = params["logit_bias"] as? List<List<Double>>
         val logitBiasArray: Array<DoubleArray> = logitBias?.map { it.toDoubleArray() }?.toTypedArray() ?: emptyArray()
 
-        //TODO: log->"willInvoke doCompletion".v()
-        val result = doCompletion(
+        //TODO: log->"willInvoke startCompletion".v()
+        val started = startCompletion(
             context,
             // String prompt,
             params["prompt"] as String,
@@ -253,16 +316,74 @@ class LlamaContext(private val id: Int, params: Map<String, Any>) {
             (params["typical_p"] as? Double)?.toFloat() ?: 1.00f,
             // int seed,
             params["seed"] as? Int ?: -1,
+            // int n, completions of the prompt decoded once; all of them are in "completions" when n > 1
+            params["n"] as? Int ?: 1,
+            // String conversation_id, resumes the conversation's KV snapshot instead of decoding its history again
+            params["conversation_id"] as? String ?: "",
             // String[] stop,
             (params["stop"] as? List<String>)?.toTypedArray() ?: emptyArray(),
+            // boolean stop_token_triggers, also stop as soon as the tokens of a stop word are sampled
+            params["stop_token_triggers"] as? Boolean ?: false,
             // boolean ignore_eos,
             params["ignore_eos"] as? Boolean ?: false,
-            // double[][] logit_bias,
-            logitBiasArray,
-            // PartialCompletionCallback partial_completion_callback
-            PartialCompletionCallback(
-                params["emit_partial_completion"] as? Boolean ?: false
-            )
+            // double[][] logit_bias
+            logitBiasArray
+        )
+        if (started.containsKey("error")) {
+            throw IllegalStateException(started["error"] as String)
+        }
+
+        // the native worker thread decodes, tokens are drained in batches of flush_tokens
+        // or every flush_ms, whichever comes first
+        val slotId = started["slot_id"] as Int
+        onStart(slotId)
+        val emitNeeded = params["emit_partial_completion"] as? Boolean ?: false
+        val flushTokens = if (emitNeeded) params["flush_tokens"] as? Int ?: 8 else Int.MAX_VALUE
+        val flushMs = if (emitNeeded) params["flush_ms"] as? Int ?: 50 else 1000
+        // the native side releases the slots with the result; when the loop is left
+        // before, by an exception or an interrupt (runInterruptible), the stream is cancelled
+        var finished = false
+        try {
+            while (true) {
+                if (Thread.interrupted()) {
+                    throw InterruptedException("Completion cancelled")
+                }
+                val batch = drainCompletion(context, slotId, flushTokens, flushMs)
+                if (batch.containsKey("error")) {
+                    throw IllegalStateException(batch["error"] as String)
+                }
+                val result = batch["result"] as? Map<String, Any>
+                finished = result != null
+                if (emitNeeded) {
+                    emitPartialCompletion(batch)
+                }
+                if (result != null) {
+                    return result.toMutableMap()
+                }
+            }
+        } finally {
+            if (!finished) {
+                cancelCompletion(context, slotId)
+            }
+        }
+    }
+
+    // Deterministic decoding with beam search, one KV sequence per beam (n_beams must
+    // not exceed n_parallel): "text" is the best beam, "beams" all of them with scores
+    fun beamSearch(params: Map<String, Any>): Map<String, Any> {
+        if (!params.containsKey("prompt")) {
+            throw IllegalArgumentException("Missing required parameter: prompt")
+        }
+        val result = beamSearch(
+            context,
+            params["prompt"] as String,
+            params["n_beams"] as? Int ?: 4,
+            params["n_predict"] as? Int ?: -1,
+            // float length_penalty, beams are ranked by logprob / length^length_penalty
+            (params["length_penalty"] as? Double)?.toFloat() ?: 1.0f,
+            // boolean early_stopping, stop as soon as n_beams beams are finished
+            params["early_stopping"] as? Boolean ?: true,
+            (params["stop"] as? List<String>)?.toTypedArray() ?: emptyArray()
         ).toMutableMap()
         if (result.containsKey("error")) {
             throw IllegalStateException(result["error"] as String)
@@ -270,8 +391,20 @@ class LlamaContext(private val id: Int, params: Map<String, Any>) {
         return result
     }
 
-    fun stopCompletion() {
-        stopCompletion(context)
+    // Drop the KV snapshot of a closed conversation
+    fun removeConversation(conversationId: String): Boolean {
+        return removeConversation(context, conversationId)
+    }
+
+    // Stop the request started on slotId (see completion's onStart), the other requests
+    // on the context keep going. False when the slot is idle.
+    fun stopCompletion(slotId: Int): Boolean {
+        return stopCompletion(context, slotId)
+    }
+
+    // Stop every request on the context, and the embedding, rerank and bench jobs
+    fun stopAll() {
+        stopAll(context)
     }
 
     fun isPredicting(): Boolean {
@@ -298,10 +431,99 @@ class LlamaContext(private val id: Int, params: Map<String, Any>) {
         return result
     }
 
+    // One call for many texts: "embeddings" is a FloatArray of n_texts * n_embd values
+    fun embedBatch(texts: List<String>): Map<String, Any> {
+        if (!isEmbeddingEnabled(context)) {
+            throw IllegalStateException("Embedding is not enabled")
+        }
+        val result = embedBatch(context, texts.toTypedArray()).toMutableMap()
+        if (result.containsKey("error")) {
+            throw IllegalStateException(result["error"] as String)
+        }
+        return result
+    }
+
+    // Embeddings of overlapping chunks of a long text: "chunks" holds the start/end of
+    // each chunk in text and its token range, "embeddings" n_embd floats per chunk
+    fun embedDocument(text: String, chunkTokens: Int, overlapTokens: Int, lateChunking: Boolean): Map<String, Any> {
+        if (!isEmbeddingEnabled(context)) {
+            throw IllegalStateException("Embedding is not enabled")
+        }
+        val result = embedDocument(context, text, chunkTokens, overlapTokens, lateChunking).toMutableMap()
+        if (result.containsKey("error")) {
+            throw IllegalStateException(result["error"] as String)
+        }
+        return result
+    }
+
+    // Scores of the documents against the query, best first: a list of {"index", "score"}
+    fun rerank(query: String, documents: List<String>): List<Map<String, Any>> {
+        if (!isRerankingEnabled(context)) {
+            throw IllegalStateException("Reranking is not enabled")
+        }
+        val result = rerank(context, query, documents.toTypedArray()).toMutableMap()
+        if (result.containsKey("error")) {
+            throw IllegalStateException(result["error"] as String)
+        }
+        @Suppress("UNCHECKED_CAST")
+        return result["results"] as List<Map<String, Any>>
+    }
+
     fun bench(pp: Int, tg: Int, pl: Int, nr: Int): String {
         return bench(context, pp, tg, pl, nr)
     }
 
+    // Latency and throughput benchmark as a JSON string: every combination of the swept
+    // values (an empty list keeps the context's own) is run on real text, reporting
+    // time to first token and inter-token latency percentiles, cold and warm
+    fun benchSuite(
+        prompt: String = "",
+        nPrompt: Int = 512,
+        nGen: Int = 128,
+        nReps: Int = 3,
+        cold: Boolean = true,
+        nThreads: List<Int> = emptyList(),
+        nBatch: List<Int> = emptyList(),
+        nUbatch: List<Int> = emptyList(),
+        nParallel: List<Int> = emptyList()
+    ): String {
+        return benchSuite(
+            context,
+            prompt,
+            nPrompt,
+            nGen,
+            nReps,
+            cold,
+            nThreads.toIntArray(),
+            nBatch.toIntArray(),
+            nUbatch.toIntArray(),
+            nParallel.toIntArray()
+        )
+    }
+
+    // Bytes of the weights (mapped and resident), KV cache, compute and output buffers,
+    // the prefix and conversation caches, and the process RSS and its peak
+    fun memoryReport(): Map<String, Any> {
+        return memoryReport(context)
+    }
+
+    // Times every op of the model's graphs until stopProfiler; counters adds cycles
+    // and cache misses where perf events are allowed. maxTraceEvents caps the
+    // per-thread events kept for the trace, 0 keeps only the totals.
+    fun startProfiler(counters: Boolean = false, maxTraceEvents: Int = 200000) {
+        startProfiler(context, counters, maxTraceEvents)
+    }
+
+    // Totals by op, tensor and layer, and a text table of them; the Chrome trace-event
+    // JSON is written to tracePath unless it is empty
+    fun stopProfiler(tracePath: String = ""): Map<String, Any> {
+        val result = stopProfiler(context, tracePath)
+        if (result.containsKey("error")) {
+            throw IllegalStateException(result["error"] as String)
+        }
+        return result
+    }
+
     fun release() {
         freeContext(context)
     }
@@ -309,9 +531,32 @@ class LlamaContext(private val id: Int, params: Map<String, Any>) {
     private external fun initContext(
         model: String,
         embedding: Boolean,
+        reranking: Boolean,
+        pooling_type: Int,
         n_ctx: Int,
         n_batch: Int,
+        n_ubatch: Int,
+        cache_type_k: String,
+        cache_type_v: String,
+        flash_attn: Boolean,
+        auto_plan: Boolean,
+        memory_budget_mb: Int,
         n_threads: Int,
+        n_threads_batch: Int,
+        thread_priority: Int,
+        thread_priority_batch: Int,
+        poll: Int,
+        poll_batch: Int,
+        cpu_profile: String,
+        n_parallel: Int,
+        prefix_cache_mb: Int,
+        conversation_cache_mb: Int,
+        conversation_dir: String,
+        model_draft: String,
+        n_draft: Int,
+        lookup_ngram: Int,
+        lookup_cache: String,
+        lookup_cache_mb: Int,
         n_gpu_layers: Int, // TODO: Support this
         use_mlock: Boolean,
         use_mmap: Boolean,
@@ -324,13 +569,22 @@ class LlamaContext(private val id: Int, params: Map<String, Any>) {
 
     private external fun loadModelDetails(contextPtr: Long): Map<String, Any>
 
+    private external fun memoryReport(contextPtr: Long): Map<String, Any>
+
     external fun getFormattedChat(contextPtr: Long, messages: Array<Map<String, Any>>, chatTemplate: String): String
 
     private external fun loadSession(contextPtr: Long, path: String): Map<String, Any>
 
     private external fun saveSession(contextPtr: Long, path: String, size: Int): Int
 
-    private external fun doCompletion(
+    private external fun checkpointSession(
+        contextPtr: Long,
+        path: String,
+        compress: Boolean,
+        quantizeKv: Boolean
+    ): Map<String, Any>
+
+    private external fun startCompletion(
         contextPtr: Long,
         prompt: String,
         grammar: String,
@@ -354,13 +608,38 @@ class LlamaContext(private val id: Int, params: Map<String, Any>) {
         tfs_z: Float,
         typical_p: Float,
         seed: Int,
+        n: Int,
+        conversation_id: String,
         stop: Array<String>,
+        stop_token_triggers: Boolean,
         ignore_eos: Boolean,
-        logit_bias: Array<DoubleArray>,
-        partial_completion_callback: PartialCompletionCallback
+        logit_bias: Array<DoubleArray>
+    ): Map<String, Any>
+
+    private external fun drainCompletion(
+        contextPtr: Long,
+        slotId: Int,
+        flushTokens: Int,
+        flushMs: Int
+    ): Map<String, Any>
+
+    private external fun cancelCompletion(contextPtr: Long, slotId: Int): Boolean
+
+    private external fun beamSearch(
+        contextPtr: Long,
+        prompt: String,
+        n_beams: Int,
+        n_predict: Int,
+        length_penalty: Float,
+        early_stopping: Boolean,
+        stop: Array<String>
     ): Map<String, Any>
 
-    private external fun stopCompletion(contextPtr: Long)
+    private external fun removeConversation(contextPtr: Long, conversationId: String): Boolean
+
+    private external fun stopCompletion(contextPtr: Long, slotId: Int): Boolean
+
+    private external fun stopAll(contextPtr: Long)
 
     private external fun isPredicting(contextPtr: Long): Boolean
 
@@ -372,7 +651,36 @@ class LlamaContext(private val id: Int, params: Map<String, Any>) {
 
     private external fun embedding(contextPtr: Long, text: String): Map<String, Any>
 
+    private external fun embedBatch(contextPtr: Long, texts: Array<String>): Map<String, Any>
+
+    private external fun embedDocument(
+        contextPtr: Long,
+        text: String,
+        n_chunk: Int,
+        n_overlap: Int,
+        late_chunking: Boolean
+    ): Map<String, Any>
+
+    private external fun isRerankingEnabled(contextPtr: Long): Boolean
+
+    private external fun rerank(contextPtr: Long, query: String, documents: Array<String>): Map<String, Any>
+
     private external fun bench(contextPtr: Long, pp: Int, tg: Int, pl: Int, nr: Int): String
+    private external fun benchSuite(
+        contextPtr: Long,
+        prompt: String,
+        n_prompt: Int,
+        n_gen: Int,
+        n_reps: Int,
+        cold: Boolean,
+        n_threads: IntArray,
+        n_batch: IntArray,
+        n_ubatch: IntArray,
+        n_parallel: IntArray
+    ): String
+
+    private external fun startProfiler(contextPtr: Long, counters: Boolean, maxTraceEvents: Int)
+    private external fun stopProfiler(contextPtr: Long, tracePath: String): Map<String, Any>
 
     private external fun freeContext(contextPtr: Long)
 }
\ No newline at end of file
@@ -156,6 +156,15 @@ class LlamaAndroid {
         }
     }.flowOn(Dispatchers.IO)
 
+    fun checkpointSession(id: Int, path: String, compress: Boolean = true, quantizeKv: Boolean = false): Flow<Map<String, Any>> = flow {
+        try {
+            val context = contexts[id] ?: throw Exception("Context not found")
+            emit(context.checkpointSession(path, compress, quantizeKv))
+        } catch (e: Exception) {
+            Log.e(NAME, "Error checkpointing session", e)
+        }
+    }.flowOn(Dispatchers.IO)
+
     fun setEventCollector(id: Int, scope: CoroutineScope): MutableSharedFlow<Pair<String, Any>> {
         val context = contexts[id] ?: throw Exception("Context not found")
         context.scope = scope
@@ -167,12 +176,12 @@ class LlamaAndroid {
         context.scope = null
     }
 
-    fun launchCompletion(id: Int, params: Map<String, Any>): Map<String, Any>?  {
+    fun launchCompletion(id: Int, params: Map<String, Any>, onStart: (Int) -> Unit = {}): Map<String, Any>?  {
         Log.i(NAME, "completion $id of $params")
         return try {
             val context = contexts[id] ?: throw Exception("Context not found")
-            if (context.isPredicting()) throw Exception("Context is busy")
-            context.completion(params).also {
+            // the native side rejects the request when all of its n_parallel slots are busy
+            context.completion(params, onStart).also {
                 Log.i(NAME, "\"got completion $it")
             }
         } catch (e: Exception) {
@@ -181,9 +190,25 @@ class LlamaAndroid {
         }
     }
 
-    suspend fun stopCompletion(id: Int) = withContext(Dispatchers.IO) {
+    fun launchBeamSearch(id: Int, params: Map<String, Any>): Map<String, Any>? {
+        return try {
+            val context = contexts[id] ?: throw Exception("Context not found")
+            context.beamSearch(params)
+        } catch (e: Exception) {
+            Log.e(NAME, "Error during beam search", e)
+            null
+        }
+    }
+
+    // slotId: the slot launchCompletion's onStart got, only that request is stopped
+    suspend fun stopCompletion(id: Int, slotId: Int) = withContext(Dispatchers.IO) {
         val context = contexts[id] ?: throw Exception("Context not found")
-        context.stopCompletion()
+        context.stopCompletion(slotId)
+    }
+
+    suspend fun stopAll(id: Int) = withContext(Dispatchers.IO) {
+        val context = contexts[id] ?: throw Exception("Context not found")
+        context.stopAll()
     }
 
     fun tokenize(id: Int, text: String): Flow<Map<String, Any>> = flow {
@@ -212,4 +237,60 @@ class LlamaAndroid {
             Log.e(NAME, "Error getting embedding", e)
         }
     }.flowOn(Dispatchers.IO)
+
+    fun embedBatch(id: Int, texts: List<String>): Flow<Map<String, Any>> = flow {
+        try {
+            val context = contexts[id] ?: throw Exception("Context not found")
+            emit(context.embedBatch(texts))
+        } catch (e: Exception) {
+            Log.e(NAME, "Error getting embeddings", e)
+        }
+    }.flowOn(Dispatchers.IO)
+
+    fun embedDocument(
+        id: Int,
+        text: String,
+        chunkTokens: Int,
+        overlapTokens: Int,
+        lateChunking: Boolean
+    ): Flow<Map<String, Any>> = flow {
+        try {
+            val context = contexts[id] ?: throw Exception("Context not found")
+            emit(context.embedDocument(text, chunkTokens, overlapTokens, lateChunking))
+        } catch (e: Exception) {
+            Log.e(NAME, "Error embedding document", e)
+        }
+    }.flowOn(Dispatchers.IO)
+
+    fun rerank(id: Int, query: String, documents: List<String>): Flow<List<Map<String, Any>>> = flow {
+        try {
+            val context = contexts[id] ?: throw Exception("Context not found")
+            emit(context.rerank(query, documents))
+        } catch (e: Exception) {
+            Log.e(NAME, "Error reranking documents", e)
+        }
+    }.flowOn(Dispatchers.IO)
+
+    fun memoryReport(id: Int): Flow<Map<String, Any>> = flow {
+        try {
+            val context = contexts[id] ?: throw Exception("Context not found")
+            emit(context.memoryReport())
+        } catch (e: Exception) {
+            Log.e(NAME, "Error reading memory report", e)
+        }
+    }.flowOn(Dispatchers.IO)
+
+    fun startProfiler(id: Int, counters: Boolean = false, maxTraceEvents: Int = 200000) {
+        val context = contexts[id] ?: throw Exception("Context not found")
+        context.startProfiler(counters, maxTraceEvents)
+    }
+
+    fun stopProfiler(id: Int, tracePath: String = ""): Flow<Map<String, Any>> = flow {
+        try {
+            val context = contexts[id] ?: throw Exception("Context not found")
+            emit(context.stopProfiler(tracePath))
+        } catch (e: Exception) {
+            Log.e(NAME, "Error stopping profiler", e)
+        }
+    }.flowOn(Dispatchers.IO)
 }
\ No newline at end of file